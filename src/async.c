@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2026 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   async.c
+ * @date   Sun Oct 18 14:02:17 2026
+ *
+ * @brief  Asynchronous dbus client
+ *
+ * Functions to call methods of other daemons without blocking the
+ * main loop. Calls are sent right away, up to ASYNC_MAX_IN_FLIGHT at
+ * a time, the rest is queued. Replies are dispatched by libdbus from
+ * dbus_post_select(), which calls the callbacks.
+ * Like db.c, this doesn't include project.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "list.h"
+#include "async.h"
+
+#define async_log(...) { fprintf(stderr, ##__VA_ARGS__); fprintf(stderr, "\n"); }
+
+typedef struct {
+  struct list_head list; /**< Linux-kernel-style list item, for the queue */
+  DBusMessage *msg;      /**< The method call, until it's sent */
+  async_cb_t cb;         /**< Reply callback */
+  void *opaque;          /**< Callback argument */
+} async_call_t;
+
+static DBusConnection *async_conn = NULL;
+static LIST_HEAD(async_queue);
+static int in_flight = 0;
+
+static void async_kick(void);
+
+static void
+async_notify(DBusPendingCall *pending, void *data)
+{
+  async_call_t *call = data;
+  DBusMessage *reply;
+
+  reply = dbus_pending_call_steal_reply(pending);
+  dbus_pending_call_unref(pending);
+  in_flight--;
+
+  if (reply != NULL && dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+    async_log("Asynchronous dbus call failed: %s",
+              dbus_message_get_error_name(reply));
+    dbus_message_unref(reply);
+    reply = NULL;
+  }
+
+  call->cb(reply, call->opaque);
+
+  if (reply != NULL)
+    dbus_message_unref(reply);
+  free(call);
+
+  async_kick();
+}
+
+static int
+async_send(async_call_t *call)
+{
+  DBusPendingCall *pending = NULL;
+
+  if (!dbus_connection_send_with_reply(async_conn, call->msg, &pending,
+                                       DBUS_TIMEOUT_USE_DEFAULT) ||
+      pending == NULL) {
+    async_log("Failed to send dbus call %s",
+              dbus_message_get_member(call->msg));
+    return -1;
+  }
+  dbus_message_unref(call->msg);
+  call->msg = NULL;
+  in_flight++;
+  dbus_pending_call_set_notify(pending, async_notify, call, NULL);
+
+  return 0;
+}
+
+/* Send queued calls while there's room */
+static void
+async_kick(void)
+{
+  async_call_t *call;
+  bool sent = false;
+
+  while (in_flight < ASYNC_MAX_IN_FLIGHT && !list_empty(&async_queue)) {
+    call = list_entry(async_queue.next, async_call_t, list);
+    list_del(&call->list);
+    if (async_send(call) != 0) {
+      /* The caller already returned, tell it through the callback */
+      dbus_message_unref(call->msg);
+      call->cb(NULL, call->opaque);
+      free(call);
+      continue;
+    }
+    sent = true;
+  }
+  if (sent)
+    dbus_connection_flush(async_conn);
+}
+
+static int
+async_submit(DBusMessage *msg, async_cb_t cb, void *opaque)
+{
+  async_call_t *call;
+
+  call = malloc(sizeof(async_call_t));
+  call->msg = msg;
+  call->cb = cb;
+  call->opaque = opaque;
+
+  if (in_flight >= ASYNC_MAX_IN_FLIGHT) {
+    list_add_tail(&call->list, &async_queue);
+    return 0;
+  }
+  if (async_send(call) != 0) {
+    dbus_message_unref(msg);
+    free(call);
+    return -1;
+  }
+  dbus_connection_flush(async_conn);
+
+  return 0;
+}
+
+/**
+ * Initialize the asynchronous client.
+ * This should be called before any other async_ function.
+ *
+ * @param conn The dbus connection used to send the calls
+ */
+void
+async_init(DBusConnection *conn)
+{
+  async_conn = conn;
+}
+
+/**
+ * Call a dbus method without waiting for the reply.
+ * The arguments are passed like for dbus_message_append_args().
+ *
+ * @param service The dbus name of the service
+ * @param obj The object path
+ * @param interface The interface of the method
+ * @param method The method name
+ * @param cb The function to call with the reply
+ * @param opaque The argument passed to cb
+ *
+ * @return 0 if the call was sent or queued, -1 otherwise, in which
+ *         case cb will never be called
+ */
+int
+async_call(const char *service, const char *obj,
+           const char *interface, const char *method,
+           async_cb_t cb, void *opaque,
+           int first_arg_type, ...)
+{
+  DBusMessage *msg;
+  va_list args;
+  dbus_bool_t ok;
+
+  if (async_conn == NULL)
+    return -1;
+
+  msg = dbus_message_new_method_call(service, obj, interface, method);
+  if (msg == NULL)
+    return -1;
+
+  va_start(args, first_arg_type);
+  ok = dbus_message_append_args_valist(msg, first_arg_type, args);
+  va_end(args);
+  if (!ok) {
+    dbus_message_unref(msg);
+    return -1;
+  }
+
+  return async_submit(msg, cb, opaque);
+}
+
+/**
+ * Read a dbus property without waiting for the reply.
+ * The reply holds a variant, which the async_reply_get_ functions
+ * look into.
+ */
+int
+async_get_property(const char *service, const char *obj,
+                   const char *interface, const char *property,
+                   async_cb_t cb, void *opaque)
+{
+  return async_call(service, obj, DBUS_PROPERTIES, "Get", cb, opaque,
+                    DBUS_TYPE_STRING, &interface,
+                    DBUS_TYPE_STRING, &property,
+                    DBUS_TYPE_INVALID);
+}
+
+/**
+ * @return The number of calls sent and not replied to yet
+ */
+int
+async_in_flight(void)
+{
+  return in_flight;
+}
+
+/* Point iter to the first reply argument, looking into variants */
+static int
+async_reply_first(DBusMessage *reply, DBusMessageIter *iter)
+{
+  DBusMessageIter variant;
+
+  if (reply == NULL || !dbus_message_iter_init(reply, iter))
+    return DBUS_TYPE_INVALID;
+  if (dbus_message_iter_get_arg_type(iter) == DBUS_TYPE_VARIANT) {
+    dbus_message_iter_recurse(iter, &variant);
+    *iter = variant;
+  }
+
+  return dbus_message_iter_get_arg_type(iter);
+}
+
+bool
+async_reply_get_int(DBusMessage *reply, int *value)
+{
+  DBusMessageIter iter;
+  dbus_int32_t v;
+
+  if (async_reply_first(reply, &iter) != DBUS_TYPE_INT32)
+    return false;
+  dbus_message_iter_get_basic(&iter, &v);
+  *value = v;
+
+  return true;
+}
+
+bool
+async_reply_get_bool(DBusMessage *reply, bool *value)
+{
+  DBusMessageIter iter;
+  dbus_bool_t v;
+
+  if (async_reply_first(reply, &iter) != DBUS_TYPE_BOOLEAN)
+    return false;
+  dbus_message_iter_get_basic(&iter, &v);
+  *value = v ? true : false;
+
+  return true;
+}
+
+/**
+ * Get a string or object path reply. The string belongs to the reply.
+ */
+bool
+async_reply_get_string(DBusMessage *reply, const char **value)
+{
+  DBusMessageIter iter;
+  int type;
+
+  type = async_reply_first(reply, &iter);
+  if (type != DBUS_TYPE_STRING && type != DBUS_TYPE_OBJECT_PATH)
+    return false;
+  dbus_message_iter_get_basic(&iter, value);
+
+  return true;
+}
+
+/**
+ * Get an array of strings or object paths reply.
+ *
+ * @return A NULL-terminated copy of the array, to be freed with
+ *         g_strfreev(), or NULL if the reply isn't an array
+ */
+char**
+async_reply_get_strv(DBusMessage *reply)
+{
+  DBusMessageIter iter, array;
+  const char *s;
+  char **res;
+  int count = 0;
+  int type;
+
+  if (async_reply_first(reply, &iter) != DBUS_TYPE_ARRAY)
+    return NULL;
+
+  dbus_message_iter_recurse(&iter, &array);
+  while (dbus_message_iter_get_arg_type(&array) != DBUS_TYPE_INVALID) {
+    count++;
+    dbus_message_iter_next(&array);
+  }
+
+  res = g_malloc0((count + 1) * sizeof(char*));
+  count = 0;
+  dbus_message_iter_recurse(&iter, &array);
+  while ((type = dbus_message_iter_get_arg_type(&array)) != DBUS_TYPE_INVALID) {
+    if (type == DBUS_TYPE_STRING || type == DBUS_TYPE_OBJECT_PATH) {
+      dbus_message_iter_get_basic(&array, &s);
+      res[count++] = g_strdup(s);
+    }
+    dbus_message_iter_next(&array);
+  }
+
+  return res;
+}
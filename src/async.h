@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2026 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   async.h
+ * @date   Sun Oct 18 14:02:17 2026
+ *
+ * @brief  Asynchronous dbus client declarations
+ *
+ * Those declarations are defined here instead of project.h because
+ * db.c, which doesn't include project.h, needs them
+ */
+
+#ifndef   	ASYNC_H_
+# define   	ASYNC_H_
+
+#include <stdbool.h>
+#include <dbus/dbus.h>
+
+#define ASYNC_MAX_IN_FLIGHT 16 /**< Calls sent before the next ones get queued */
+
+#define DBUS_PROPERTIES "org.freedesktop.DBus.Properties"
+
+/**
+ * Reply callback. reply is NULL if the call failed or timed out. It
+ * is unref'd after the callback returns.
+ */
+typedef void (*async_cb_t)(DBusMessage *reply, void *opaque);
+
+void   async_init(DBusConnection *conn);
+int    async_call(const char *service, const char *obj,
+                  const char *interface, const char *method,
+                  async_cb_t cb, void *opaque,
+                  int first_arg_type, ...);
+int    async_get_property(const char *service, const char *obj,
+                          const char *interface, const char *property,
+                          async_cb_t cb, void *opaque);
+int    async_in_flight(void);
+bool   async_reply_get_int(DBusMessage *reply, int *value);
+bool   async_reply_get_bool(DBusMessage *reply, bool *value);
+bool   async_reply_get_string(DBusMessage *reply, const char **value);
+char** async_reply_get_strv(DBusMessage *reply);
+
+#endif 	    /* !ASYNC_H_ */
@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2026 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   bench.c
+ * @date   Sun Oct 18 22:06:30 2026
+ *
+ * @brief  Plug/unplug latency benchmark
+ *
+ * "vusb-bench [plugs] [frontend ms] [backend ms]" runs
+ * usbowls_plug_device() and usbowls_unplug_device() in a loop against
+ * the fake xenstored, then prints the latency distributions and the
+ * number of XenStore requests each operation took.
+ *
+ * The fake xenstored hook plays both the vusb frontend and backend,
+ * answering each state change of the daemon after the given delay:
+ * backend Initialising -> InitWait, frontend -> Connected, backend ->
+ * Connected, and on unplug frontend -> Closed, backend -> Closed.
+ * The backend is a separate domain, like with a USB VM, so assignments
+ * go through XenStore too.
+ */
+
+#include "project.h"
+
+#define BENCH_BACKEND_DOMID 1
+#define BENCH_GUEST_DOMID   2
+#define BENCH_BUS           1
+#define BENCH_DEV           2
+#define BENCH_MAX_DEVICES   16
+
+typedef struct {
+  int virtid;            /**< 0 if the slot is free */
+  int front;             /**< Last state written to the frontend */
+  int back;              /**< Last state written to the backend */
+} bench_dev_t;
+
+/* Only touched by the fake xenstored thread */
+static bench_dev_t bench_devs[BENCH_MAX_DEVICES];
+static int bench_front_delay = 2;
+static int bench_back_delay = 2;
+
+static bench_dev_t*
+bench_dev(int virtid)
+{
+  bench_dev_t *free_slot = NULL;
+  int i;
+
+  for (i = 0; i < BENCH_MAX_DEVICES; ++i) {
+    if (bench_devs[i].virtid == virtid)
+      return &bench_devs[i];
+    if (bench_devs[i].virtid == 0 && free_slot == NULL)
+      free_slot = &bench_devs[i];
+  }
+  if (free_slot != NULL) {
+    free_slot->virtid = virtid;
+    free_slot->front = XB_UNKNOWN;
+    free_slot->back = XB_UNKNOWN;
+  }
+
+  return free_slot;
+}
+
+static void
+bench_write_state(int domid, int virtid, bool back, int state)
+{
+  char path[128];
+  char value[8];
+
+  if (back)
+    snprintf(path, sizeof(path), "/local/domain/%d/backend/vusb/%d/%d/state",
+             BENCH_BACKEND_DOMID, domid, virtid);
+  else
+    snprintf(path, sizeof(path), "/local/domain/%d/device/vusb/%d/state",
+             domid, virtid);
+  snprintf(value, sizeof(value), "%d", state);
+  xsfake_write_later(path, value, back ? bench_back_delay : bench_front_delay);
+}
+
+/* Fake xenstored hook, moves the other ends along */
+static void
+bench_agent(const char *path, const char *value)
+{
+  bench_dev_t *dev;
+  char key[8];
+  int be, domid, virtid, state;
+  bool back;
+
+  if (sscanf(path, "/local/domain/%d/backend/vusb/%d/%d/%7s",
+             &be, &domid, &virtid, key) == 4 && be == BENCH_BACKEND_DOMID)
+    back = true;
+  else if (sscanf(path, "/local/domain/%d/device/vusb/%d/%7s",
+                  &domid, &virtid, key) == 3)
+    back = false;
+  else
+    return;
+  if (strcmp(key, "state") != 0)
+    return;
+
+  dev = bench_dev(virtid);
+  if (dev == NULL)
+    return;
+  state = strtol(value, NULL, 10);
+  if (back)
+    dev->back = state;
+  else
+    dev->front = state;
+
+  if (back && state == XB_INITTING)
+    bench_write_state(domid, virtid, true, XB_INITWAIT);
+  else if (back && state == XB_INITWAIT && dev->front == XB_INITTING)
+    bench_write_state(domid, virtid, false, XB_CONNECTED);
+  else if (!back && state == XB_CONNECTED && dev->back == XB_INITWAIT)
+    bench_write_state(domid, virtid, true, XB_CONNECTED);
+  else if (back && state == XB_CLOSING && dev->front == XB_CONNECTED)
+    bench_write_state(domid, virtid, false, XB_CLOSED);
+  else if (!back && state == XB_CLOSED && dev->back == XB_CLOSING)
+    bench_write_state(domid, virtid, true, XB_CLOSED);
+}
+
+static double
+bench_ms(const struct timespec *a, const struct timespec *b)
+{
+  return (b->tv_sec - a->tv_sec) * 1000.0 + (b->tv_nsec - a->tv_nsec) / 1000000.0;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void
+bench_report(const char *name, double *samples, int n, unsigned long ops)
+{
+  double sum = 0;
+  int i;
+
+  if (n == 0)
+    return;
+  qsort(samples, n, sizeof(double), bench_cmp);
+  for (i = 0; i < n; ++i)
+    sum += samples[i];
+  printf("%-7s n=%d min=%.3f p50=%.3f p90=%.3f p99=%.3f max=%.3f mean=%.3f ms, %.1f requests\n",
+         name, n, samples[0], samples[n / 2], samples[n * 90 / 100],
+         samples[n * 99 / 100], samples[n - 1], sum / n, (double)ops / n);
+}
+
+/**
+ * Run the benchmark. This is a separate program, built with "make
+ * check", so the fake xenstored never ends up in the daemon.
+ *
+ * @param argc The number of arguments
+ * @param argv Optionally the number of plugs and the frontend and
+ *             backend delays in milliseconds
+ *
+ * @return 0 on success, 1 if any plug or unplug failed
+ */
+int
+main(int argc, char *argv[])
+{
+  struct timespec t0, t1, t2;
+  unsigned long ops0, ops1, ops2;
+  unsigned long plug_ops = 0, unplug_ops = 0;
+  double *plugs, *unplugs;
+  char sock[64];
+  int n = 100;
+  int failures = 0;
+  int i;
+
+  if (argc > 1)
+    n = strtol(argv[1], NULL, 10);
+  if (argc > 2)
+    bench_front_delay = strtol(argv[2], NULL, 10);
+  if (argc > 3)
+    bench_back_delay = strtol(argv[3], NULL, 10);
+  if (n <= 0 || bench_front_delay < 0 || bench_back_delay < 0) {
+    fprintf(stderr, "Usage: %s [plugs] [frontend ms] [backend ms]\n", argv[0]);
+    return 1;
+  }
+
+  INIT_LIST_HEAD(&vms.list);
+  INIT_LIST_HEAD(&devices.list);
+
+  snprintf(sock, sizeof(sock), "/tmp/vusb-bench.%d", getpid());
+  xsfake_set_hook(bench_agent);
+  if (xsfake_start(sock) != 0)
+    return 1;
+  setenv("XENSTORED_PATH", sock, 1);
+
+  usb_backend_domid = BENCH_BACKEND_DOMID;
+  xs_handle = NULL;
+  if (xenstore_init() == -1 || xenstore_state_handle() == -1) {
+    xsfake_stop();
+    return 1;
+  }
+  device_add(BENCH_BUS, BENCH_DEV, 0x1234, 0x5678, 0, strdup("bench"),
+             strdup("Bench device"), strdup("Bench"), strdup("1-1"), NULL);
+
+  plugs = malloc(n * sizeof(double));
+  unplugs = malloc(n * sizeof(double));
+  for (i = 0; i < n; ++i) {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ops0 = xsfake_requests();
+    if (usbowls_plug_device(BENCH_GUEST_DOMID, BENCH_BUS, BENCH_DEV) != 0)
+      failures++;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ops1 = xsfake_requests();
+    if (usbowls_unplug_device(BENCH_GUEST_DOMID, BENCH_BUS, BENCH_DEV) != 0)
+      failures++;
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    ops2 = xsfake_requests();
+
+    plugs[i] = bench_ms(&t0, &t1);
+    unplugs[i] = bench_ms(&t1, &t2);
+    plug_ops += ops1 - ops0;
+    unplug_ops += ops2 - ops1;
+  }
+
+  printf("vusb bench: %d plugs, frontend delay %d ms, backend delay %d ms, %d failures\n",
+         n, bench_front_delay, bench_back_delay, failures);
+  bench_report("plug", plugs, n, plug_ops);
+  bench_report("unplug", unplugs, n, unplug_ops);
+
+  free(plugs);
+  free(unplugs);
+  device_del(BENCH_BUS, BENCH_DEV);
+  xenstore_deinit();
+  xsfake_stop();
+
+  return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2026 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   classcache.c
+ * @date   Sun Oct 18 23:15:48 2026
+ *
+ * @brief  Device classification cache
+ *
+ * Remembers the type bits and the names computed for a device model,
+ * so that replugging a known device doesn't probe all its udev
+ * children again. Entries are keyed by VID, PID and bcdDevice, and
+ * carry a hash of the raw descriptors: a device of the same model
+ * with different descriptors (firmware update, mode switch...) gets
+ * classified again and replaces the entry.
+ *
+ * The cache can be persisted to a text file, one entry per line:
+ * "vid pid bcd hash type<TAB>vendor<TAB>model".
+ */
+
+#include "project.h"
+
+#define CLASSCACHE_BUCKETS 64  /**< Must be a power of 2 */
+#define CLASSCACHE_MAX     256 /**< Entries before new ones are ignored */
+#define CLASSCACHE_HEADER  "vusb-classcache 2" /**< Bumped when the classifier changes */
+
+typedef struct {
+  struct hlist_node node; /**< Hash table item */
+  int vendorid;
+  int deviceid;
+  int bcd;
+  uint32_t hash;          /**< Hash of the descriptors */
+  int type;
+  char *vendor;
+  char *model;
+} classcache_entry_t;
+
+static struct hlist_head classcache[CLASSCACHE_BUCKETS];
+static int classcache_entries = 0;
+static unsigned long classcache_hits = 0;
+static unsigned long classcache_misses = 0;
+static char *classcache_path = NULL; /**< Where to persist the cache, if anywhere */
+
+static struct hlist_head*
+classcache_bucket(int vendorid, int deviceid, int bcd)
+{
+  unsigned int h;
+
+  h = (vendorid * 31 + deviceid) * 31 + bcd;
+
+  return &classcache[h & (CLASSCACHE_BUCKETS - 1)];
+}
+
+static classcache_entry_t*
+classcache_find(int vendorid, int deviceid, int bcd)
+{
+  struct hlist_node *pos, *tmp;
+  classcache_entry_t *e;
+
+  hlist_for_each_safe(pos, tmp, classcache_bucket(vendorid, deviceid, bcd)) {
+    e = hlist_entry(pos, classcache_entry_t, node);
+    if (e->vendorid == vendorid && e->deviceid == deviceid && e->bcd == bcd)
+      return e;
+  }
+
+  return NULL;
+}
+
+static void
+classcache_free(classcache_entry_t *e)
+{
+  hlist_del(&e->node);
+  free(e->vendor);
+  free(e->model);
+  free(e);
+  classcache_entries--;
+}
+
+static void
+classcache_insert(int vendorid, int deviceid, int bcd, uint32_t hash,
+                  int type, const char *vendor, const char *model)
+{
+  classcache_entry_t *e;
+
+  e = classcache_find(vendorid, deviceid, bcd);
+  if (e != NULL)
+    classcache_free(e);
+  if (classcache_entries >= CLASSCACHE_MAX)
+    return;
+
+  e = malloc(sizeof(classcache_entry_t));
+  e->vendorid = vendorid;
+  e->deviceid = deviceid;
+  e->bcd = bcd;
+  e->hash = hash;
+  e->type = type;
+  e->vendor = strdup(vendor);
+  e->model = strdup(model);
+  hlist_add_head(&e->node, classcache_bucket(vendorid, deviceid, bcd));
+  classcache_entries++;
+}
+
+/* Write a string without the characters used as separators */
+static void
+classcache_put_string(FILE *f, const char *s)
+{
+  for (; *s != '\0'; ++s)
+    fputc((*s == '\t' || *s == '\n') ? ' ' : *s, f);
+}
+
+static void
+classcache_save(void)
+{
+  struct hlist_node *pos, *tmp;
+  classcache_entry_t *e;
+  char tmppath[256];
+  FILE *f;
+  int i;
+
+  if (classcache_path == NULL)
+    return;
+
+  snprintf(tmppath, sizeof(tmppath), "%s.tmp", classcache_path);
+  f = fopen(tmppath, "w");
+  if (f == NULL) {
+    xd_log(LOG_ERR, "Failed to create classification cache %s", tmppath);
+    return;
+  }
+  fprintf(f, "%s\n", CLASSCACHE_HEADER);
+  for (i = 0; i < CLASSCACHE_BUCKETS; ++i) {
+    hlist_for_each_safe(pos, tmp, &classcache[i]) {
+      e = hlist_entry(pos, classcache_entry_t, node);
+      fprintf(f, "%04x %04x %04x %08x %d\t", e->vendorid, e->deviceid,
+              e->bcd, e->hash, e->type);
+      classcache_put_string(f, e->vendor);
+      fputc('\t', f);
+      classcache_put_string(f, e->model);
+      fputc('\n', f);
+    }
+  }
+  if (fclose(f) != 0 || rename(tmppath, classcache_path) != 0) {
+    xd_log(LOG_ERR, "Failed to write classification cache %s", classcache_path);
+    unlink(tmppath);
+  }
+}
+
+/**
+ * Load the cache from a file, and persist it there from now on.
+ * A missing or invalid file just leaves the cache empty.
+ *
+ * @param path The cache file
+ *
+ * @return The number of entries loaded
+ */
+int
+classcache_load(const char *path)
+{
+  char line[512];
+  char *vendor, *model;
+  int vendorid, deviceid, bcd, type;
+  unsigned int hash;
+  FILE *f;
+  int count = 0;
+
+  free(classcache_path);
+  classcache_path = strdup(path);
+
+  f = fopen(path, "r");
+  if (f == NULL)
+    return 0;
+  if (fgets(line, sizeof(line), f) == NULL ||
+      strncmp(line, CLASSCACHE_HEADER "\n", sizeof(line))) {
+    xd_log(LOG_WARNING, "Ignoring invalid classification cache %s", path);
+    fclose(f);
+    return 0;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    line[strcspn(line, "\n")] = '\0';
+    vendor = strchr(line, '\t');
+    if (vendor == NULL)
+      continue;
+    *vendor++ = '\0';
+    model = strchr(vendor, '\t');
+    if (model == NULL)
+      continue;
+    *model++ = '\0';
+    if (sscanf(line, "%x %x %x %x %d", &vendorid, &deviceid, &bcd,
+               &hash, &type) != 5)
+      continue;
+    classcache_insert(vendorid, deviceid, bcd, hash, type, vendor, model);
+    count++;
+  }
+  fclose(f);
+
+  return count;
+}
+
+/**
+ * Look up the classification of a device model
+ *
+ * @param vendorid The device vendor ID
+ * @param deviceid The device product ID
+ * @param bcd The device release number (bcdDevice)
+ * @param hash The hash of the device descriptors
+ * @param type Set to the type bits of the device
+ * @param vendor Set to a copy of the vendor name
+ * @param model Set to a copy of the model name
+ *
+ * @return true on a hit, false if the device needs to be classified,
+ *         in which case nothing is set
+ */
+bool
+classcache_lookup(int vendorid, int deviceid, int bcd, uint32_t hash,
+                  int *type, char **vendor, char **model)
+{
+  classcache_entry_t *e;
+
+  e = classcache_find(vendorid, deviceid, bcd);
+  if (e != NULL && e->hash != hash) {
+    xd_log(LOG_INFO, "Descriptors of %04x:%04x changed, classifying it again",
+           vendorid, deviceid);
+    classcache_free(e);
+    e = NULL;
+  }
+  if (e == NULL) {
+    classcache_misses++;
+    return false;
+  }
+
+  classcache_hits++;
+  *type = e->type;
+  *vendor = strdup(e->vendor);
+  *model = strdup(e->model);
+
+  return true;
+}
+
+/**
+ * Remember the classification of a device model
+ */
+void
+classcache_add(int vendorid, int deviceid, int bcd, uint32_t hash,
+               int type, const char *vendor, const char *model)
+{
+  classcache_insert(vendorid, deviceid, bcd, hash, type, vendor, model);
+  classcache_save();
+}
+
+void
+classcache_stats(unsigned long *hits, unsigned long *misses, int *entries)
+{
+  *hits = classcache_hits;
+  *misses = classcache_misses;
+  *entries = classcache_entries;
+}
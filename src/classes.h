@@ -205,9 +205,17 @@ static const class_t classes[] = {
 /* This is a partial list of classes, interfaces, and protocols used for device type filtering */
 #define AUDIO_CLASS                     0x01
 #define COMMUNICATIONS_CLASS            0x02
+#define HID_CLASS                       0x03
+#define PRINTER_CLASS                   0x07
+#define MASS_STORAGE_CLASS              0x08
+#define SMARTCARD_CLASS                 0x0B
+#define VIDEO_CLASS                     0x0E
 #define WIRELESS_CLASS                  0xE0
 #define VENDOR_SPECIFIC_CLASS           0xFF
+#define HID_BOOT_SUBCLASS               0x01
 #define ETHERNET_NETWORKING_SUBCLASS    0x06
 #define RADIO_FREQUENCY_SUBCLASS        0x01
+#define HID_KEYBOARD_PROTOCOL           0x01
+#define HID_MOUSE_PROTOCOL              0x02
 #define BLUETOOTH_PROTOCOL              0x01
 
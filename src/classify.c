@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2026 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   classify.c
+ * @date   Mon Oct 19 09:34:12 2026
+ *
+ * @brief  Device type classification
+ *
+ * Computes all the type bits of a device from two tables: one matching
+ * the class triplets of the device and of its interfaces, one matching
+ * the udev properties of its children. The interface descriptors are
+ * walked once, and the children come from the snapshot udev.c took.
+ * New types go in the tables.
+ */
+
+#include "project.h"
+
+#define USB_DT_DEVICE         0x01
+#define USB_DT_INTERFACE      0x04
+#define USB_DT_DEVICE_SIZE    18
+#define USB_DT_INTERFACE_SIZE 9
+#define ANY                   -1    /**< Wildcard for the class rules */
+#define OPTICAL_WAIT          3     /**< Seconds to wait for a cdrom to show up */
+#define OPTICAL_SLICE         100   /**< Milliseconds between checks for an unplug */
+
+/**
+ * Class rules. For a given class triplet, the first matching rule
+ * applies, so specific rules go before generic ones.
+ */
+static const struct {
+  int class;
+  int subclass;
+  int protocol;
+  int type;
+} class_rules[] = {
+  { HID_CLASS,            HID_BOOT_SUBCLASS,            HID_KEYBOARD_PROTOCOL, KEYBOARD },
+  { HID_CLASS,            HID_BOOT_SUBCLASS,            HID_MOUSE_PROTOCOL,    MOUSE },
+  { AUDIO_CLASS,          ANY,                          ANY,                   AUDIO },
+  { COMMUNICATIONS_CLASS, ETHERNET_NETWORKING_SUBCLASS, ANY,                   NIC },
+  { PRINTER_CLASS,        ANY,                          ANY,                   PRINTER },
+  { MASS_STORAGE_CLASS,   ANY,                          ANY,                   MASS_STORAGE },
+  { SMARTCARD_CLASS,      ANY,                          ANY,                   SMARTCARD },
+  { VIDEO_CLASS,          ANY,                          ANY,                   VIDEO },
+  { WIRELESS_CLASS,       RADIO_FREQUENCY_SUBCLASS,     BLUETOOTH_PROTOCOL,    BLUETOOTH },
+  // TODO: some nics will be marked with the VENDOR_SPECIFIC class,
+  // which means they won't match this. an additional method is needed
+  // to properly ID these devices.
+  { WIRELESS_CLASS,       ANY,                          ANY,                   NIC },
+  { 0, 0, 0, 0 }
+};
+
+/**
+ * Property rules, matched against every child of the device.
+ * The property has to be set to something else than "0".
+ */
+static const struct {
+  const char *property;
+  int type;
+} property_rules[] = {
+  /* Set by the udev module id_input */
+  { "ID_INPUT_KEYBOARD", KEYBOARD },
+  { "ID_INPUT_MOUSE",    MOUSE },
+  { "ID_INPUT_TOUCHPAD", MOUSE },
+  { "ID_INPUT_JOYSTICK", GAME_CONTROLLER },
+  /* Set by the udev module cdrom_id */
+  { "ID_CDROM",          OPTICAL },
+  { NULL, 0 }
+};
+
+static int
+classify_class(int class, int subclass, int protocol)
+{
+  int i;
+
+  for (i = 0; class_rules[i].type != 0; ++i) {
+    if (class_rules[i].class == class &&
+        (class_rules[i].subclass == ANY || class_rules[i].subclass == subclass) &&
+        (class_rules[i].protocol == ANY || class_rules[i].protocol == protocol))
+      return class_rules[i].type;
+  }
+
+  return 0;
+}
+
+/* Apply the class rules to the device and all its interfaces */
+static int
+classify_descriptors(const unsigned char *buf, size_t len)
+{
+  size_t off;
+  int type = 0;
+
+  /* Every descriptor starts with its length and its type */
+  for (off = 0; off + 2 <= len && buf[off] >= 2; off += buf[off]) {
+    const unsigned char *d = buf + off;
+
+    if (d[1] == USB_DT_DEVICE && d[0] >= USB_DT_DEVICE_SIZE &&
+        off + USB_DT_DEVICE_SIZE <= len)
+      type |= classify_class(d[4], d[5], d[6]);
+    else if (d[1] == USB_DT_INTERFACE && d[0] >= USB_DT_INTERFACE_SIZE &&
+             off + USB_DT_INTERFACE_SIZE <= len)
+      type |= classify_class(d[5], d[6], d[7]);
+  }
+
+  return type;
+}
+
+/* Read a hex sysattr, or -1 */
+static int
+classify_sysattr(struct udev_device *dev, const char *key)
+{
+  const char *value;
+
+  value = udev_device_get_sysattr_value(dev, key);
+
+  return (value != NULL) ? strtol(value, NULL, 16) : -1;
+}
+
+static int
+classify_properties(struct udev_device *dev)
+{
+  const char *value;
+  int type = 0;
+  int i;
+
+  for (i = 0; property_rules[i].property != NULL; ++i) {
+    value = udev_device_get_property_value(dev, property_rules[i].property);
+    if (value != NULL && *value != '0')
+      type |= property_rules[i].type;
+  }
+
+  return type;
+}
+
+/**
+ * This is a tricky one. At this point, for some reason and even if we
+ * did a "settle", udev cdrom device information is not fully
+ * populated. So we wait for the block device to show up, and take a
+ * new snapshot of the children.
+ * This sucks for USB flash drives, because they are scsi devices too,
+ * so they'll get probed too for nothing...
+ * complete is cleared if no block device showed up in time and the
+ * children don't tell either way, the drive may still be probing.
+ */
+static int
+classify_wait_for_optical(struct udev_device *dev, udev_children_t *children,
+                          cancel_t *cancel, bool *complete)
+{
+  struct udev_monitor *mon;
+  struct timeval tv;
+  const char *value;
+  fd_set fds;
+  bool appeared = false;
+  int fd;
+  int i;
+
+  /* Create a udev monitor to wait for some "block" action */
+  mon = udev_monitor_new_from_netlink(udev_handle, "udev");
+  udev_monitor_filter_add_match_subsystem_devtype(mon, "block", "disk");
+  udev_monitor_enable_receiving(mon);
+  fd = udev_monitor_get_fd(mon);
+  /* Wait in slices, to give up as soon as the device is unplugged */
+  for (i = 0; i < OPTICAL_WAIT * 1000 / OPTICAL_SLICE; ++i) {
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    tv.tv_sec = 0;
+    tv.tv_usec = OPTICAL_SLICE * 1000;
+    if (select(fd + 1, &fds, NULL, NULL, &tv) != 0) {
+      appeared = true;
+      break;
+    }
+    if (cancel_requested(cancel))
+      break;
+  }
+  udev_monitor_unref(mon);
+  if (cancel_requested(cancel)) {
+    *complete = false;
+    return 0;
+  }
+
+  /* The block device may just have appeared, let udev settle (again...) */
+  udev_settle(cancel);
+
+  /* Wether the previous triggered or timed out, check out our subnodes */
+  udev_children_free(children);
+  udev_children_scan(dev, children);
+  for (i = 0; i < children->count; ++i) {
+    value = udev_device_get_property_value(children->devs[i], "ID_CDROM");
+    if (value != NULL)
+      return (*value != '0') ? OPTICAL : 0;
+  }
+  if (!appeared) {
+    xd_log(LOG_INFO, "Timed out waiting for the block device of %s",
+           udev_device_get_sysname(dev));
+    *complete = false;
+  }
+
+  return 0;
+}
+
+/**
+ * Compute the type bits of a device
+ *
+ * @param dev The udev device
+ * @param children The snapshot of the subtree of dev, which may get
+ *        refreshed if more children are expected
+ * @param desc The raw descriptors of the device, or NULL if they
+ *        couldn't be read, in which case the interface classes are
+ *        read from sysfs
+ * @param desc_len The size of desc
+ * @param new True if the device just appeared, its optical drive may
+ *        still be getting probed
+ * @param cancel Stops the waiting if the device goes away, may be NULL
+ * @param complete Set to false if the result is provisional because
+ *        the optical drive probe didn't finish, true otherwise. May
+ *        be NULL
+ *
+ * @return The OR-ed types of the device, see policy.h
+ */
+int
+classify_device(struct udev_device *dev, udev_children_t *children,
+                const unsigned char *desc, size_t desc_len, int new,
+                cancel_t *cancel, bool *complete)
+{
+  struct udev_device *child;
+  const char *value;
+  bool scsi = false;
+  bool done = true;
+  int type = 0;
+  int i;
+
+  if (desc != NULL)
+    type |= classify_descriptors(desc, desc_len);
+  else
+    type |= classify_class(classify_sysattr(dev, "bDeviceClass"),
+                           classify_sysattr(dev, "bDeviceSubClass"),
+                           classify_sysattr(dev, "bDeviceProtocol"));
+
+  for (i = 0; i < children->count; ++i) {
+    child = children->devs[i];
+    type |= classify_properties(child);
+    if (desc == NULL && udev_device_get_sysattr_value(child, "bInterfaceClass") != NULL)
+      type |= classify_class(classify_sysattr(child, "bInterfaceClass"),
+                             classify_sysattr(child, "bInterfaceSubClass"),
+                             classify_sysattr(child, "bInterfaceProtocol"));
+    value = udev_device_get_devtype(child);
+    if (value != NULL && !strcmp(value, "scsi_host"))
+      scsi = true;
+  }
+
+  /* Optical drives are probed in multiple udev passes. If the device
+   * didn't just appear, we can assume everything is ready */
+  if (scsi && new && !(type & OPTICAL))
+    type |= classify_wait_for_optical(dev, children, cancel, &done);
+  if (complete != NULL)
+    *complete = done;
+
+  return type;
+}
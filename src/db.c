@@ -29,6 +29,7 @@
  */
 
 #include "db.h"
+#include "async.h"
 
 #define db_log(I, ...) { fprintf(stderr, ##__VA_ARGS__); fprintf(stderr, "\n"); }
 
@@ -102,12 +103,96 @@ parse_udev_sysattr_or_property(char *node_path, char *rul, rule_t *res, bool sys
   }
 }
 
+/**
+ * Device type nodes, set to "1" if the device has to be of that type,
+ * "0" if it must not be
+ */
+static const struct {
+  const char *node;
+  int type;
+} type_nodes[] = {
+  { NODE_KEYBOARD,        KEYBOARD },
+  { NODE_MOUSE,           MOUSE },
+  { NODE_GAME_CONTROLLER, GAME_CONTROLLER },
+  { NODE_MASS_STORAGE,    MASS_STORAGE },
+  { NODE_OPTICAL,         OPTICAL },
+  { NODE_NIC,             NIC },
+  { NODE_BLUETOOTH,       BLUETOOTH },
+  { NODE_AUDIO,           AUDIO },
+  { NODE_SMARTCARD,       SMARTCARD },
+  { NODE_VIDEO,           VIDEO },
+  { NODE_PRINTER,         PRINTER },
+  { NULL, 0 }
+};
+
+static bool
+device_key_known(const char *key)
+{
+  int i;
+
+  if (!strcmp(key, NODE_VENDOR_ID) ||
+      !strcmp(key, NODE_DEVICE_ID) ||
+      !strcmp(key, NODE_SERIAL))
+    return true;
+  for (i = 0; type_nodes[i].node != NULL; ++i)
+    if (!strcmp(key, type_nodes[i].node))
+      return true;
+
+  return false;
+}
+
+/* Apply a device/<key> value to a rule */
+static void
+set_device_key(rule_t *res, const char *key, const char *value)
+{
+  int i;
+
+  for (i = 0; type_nodes[i].node != NULL; ++i) {
+    if (!strcmp(key, type_nodes[i].node)) {
+      if (*value == '0')
+        res->dev_not_type |= type_nodes[i].type;
+      else
+        res->dev_type |= type_nodes[i].type;
+      return;
+    }
+  }
+  if (!strcmp(key, NODE_VENDOR_ID)) {
+    res->dev_vendorid = strtol(value, NULL, 16);
+  } else if (!strcmp(key, NODE_DEVICE_ID)) {
+    res->dev_deviceid = strtol(value, NULL, 16);
+  } else if (!strcmp(key, NODE_SERIAL)) {
+    free(res->dev_serial);
+    res->dev_serial = strdup(value);
+  }
+}
+
+/* Apply a vm/<key> value to a rule */
+static void
+set_vm_key(rule_t *res, const char *key, const char *value)
+{
+  if (!strcmp(key, NODE_UUID)) {
+    free(res->vm_uuid);
+    res->vm_uuid = strdup(value);
+  }
+}
+
+/* Apply a <key> value to a rule */
+static void
+set_rule_key(rule_t *res, const char *key, const char *value)
+{
+  if (!strcmp(key, NODE_COMMAND)) {
+    res->cmd = policy_parse_command_string(value);
+  } else if (!strcmp(key, NODE_DESCRIPTION)) {
+    free(res->desc);
+    res->desc = strdup(value);
+  }
+}
+
 static void
 parse_device(char *rule_path, char *rule, rule_t *res)
 {
   char **rul, **rul_list;
   char *value;
-  char *serial = NULL;
   char node_path[128];
 
   snprintf(node_path, 128, "%s/%s", rule_path, rule);
@@ -118,96 +203,10 @@ parse_device(char *rule_path, char *rule, rule_t *res)
         parse_udev_sysattr_or_property(node_path, *rul, res, true);
       } else if (!strcmp(*rul, NODE_PROPERTY)) {
         parse_udev_sysattr_or_property(node_path, *rul, res, false);
-      } else if (!strcmp(*rul, NODE_MOUSE)) {
+      } else if (device_key_known(*rul)) {
         value = parse_value(node_path, *rul);
         if (value != NULL) {
-          if (*value == '0')
-            res->dev_not_type |= MOUSE;
-          else
-            res->dev_type |= MOUSE;
-          g_free(value);
-        }
-      } else if (!strcmp(*rul, NODE_KEYBOARD)) {
-        value = parse_value(node_path, *rul);
-        if (value != NULL) {
-          if (*value == '0')
-            res->dev_not_type |= KEYBOARD;
-          else
-            res->dev_type |= KEYBOARD;
-          g_free(value);
-        }
-      } else if (!strcmp(*rul, NODE_AUDIO)) {
-        value = parse_value(node_path, *rul);
-        if (value != NULL) {
-          if (*value == '0')
-            res->dev_not_type |= AUDIO;
-          else
-            res->dev_type |= AUDIO;
-          g_free(value);
-        }
-      } else if (!strcmp(*rul, NODE_NIC)) {
-        value = parse_value(node_path, *rul);
-        if (value != NULL) {
-          if (*value == '0')
-            res->dev_not_type |= NIC;
-          else
-            res->dev_type |= NIC;
-          g_free(value);
-        }
-      } else if (!strcmp(*rul, NODE_BLUETOOTH)) {
-        value = parse_value(node_path, *rul);
-        if (value != NULL) {
-          if (*value == '0')
-            res->dev_not_type |= BLUETOOTH;
-          else
-            res->dev_type |= BLUETOOTH;
-          g_free(value);
-        }
-      } else if (!strcmp(*rul, NODE_GAME_CONTROLLER)) {
-        value = parse_value(node_path, *rul);
-        if (value != NULL) {
-          if (*value == '0')
-            res->dev_not_type |= GAME_CONTROLLER;
-          else
-            res->dev_type |= GAME_CONTROLLER;
-          g_free(value);
-        }
-      } else if (!strcmp(*rul, NODE_MASS_STORAGE)) {
-        value = parse_value(node_path, *rul);
-        if (value != NULL) {
-          if (*value == '0')
-            res->dev_not_type |= MASS_STORAGE;
-          else
-            res->dev_type |= MASS_STORAGE;
-          g_free(value);
-        }
-      } else if (!strcmp(*rul, NODE_OPTICAL)) {
-        value = parse_value(node_path, *rul);
-        if (value != NULL) {
-          if (*value == '0')
-            res->dev_not_type |= OPTICAL;
-          else
-            res->dev_type |= OPTICAL;
-          g_free(value);
-        }
-      } else if (!strcmp(*rul, NODE_VENDOR_ID)) {
-        value = parse_value(node_path, *rul);
-        if (value != NULL) {
-          res->dev_vendorid = strtol(value, NULL, 16);
-          g_free(value);
-        }
-      } else if (!strcmp(*rul, NODE_DEVICE_ID)) {
-        value = parse_value(node_path, *rul);
-        if (value != NULL) {
-          res->dev_deviceid = strtol(value, NULL, 16);
-          g_free(value);
-        }
-      } else if (!strcmp(*rul, NODE_SERIAL)) {
-        value = parse_value(node_path, *rul);
-        if (value != NULL) {
-          serial = malloc(strlen(value) + 1);
-          strcpy(serial,value);
-          res->dev_serial = serial;
+          set_device_key(res, *rul, value);
           g_free(value);
         }
       } else db_log(DB_LOG_ERR, "Unknown Device attribute %s", *rul);
@@ -231,8 +230,7 @@ parse_vm(char *rule_path, char *rule, rule_t *res)
       if (!strcmp(*rul, NODE_UUID)) {
         value = parse_value(node_path, *rul);
         if (value != NULL) {
-          res->vm_uuid = malloc(strlen(value) + 1);
-          strcpy(res->vm_uuid, value);
+          set_vm_key(res, *rul, value);
           g_free(value);
         }
       } else {
@@ -259,17 +257,11 @@ parse_rule(char *rule_node)
   if (com_citrix_xenclient_db_list_(db_xcbus, DB, DB_OBJ, rule_path, &rule_list)) {
     rule = rule_list;
     while (*rule != NULL) {
-      if        (!strcmp(*rule, NODE_COMMAND)) {
-        value = parse_value(rule_path, *rule);
-        if (value != NULL) {
-          res->cmd = policy_parse_command_string(value);
-          g_free(value);
-        }
-      } else if (!strcmp(*rule, NODE_DESCRIPTION)) {
+      if        (!strcmp(*rule, NODE_COMMAND) ||
+                 !strcmp(*rule, NODE_DESCRIPTION)) {
         value = parse_value(rule_path, *rule);
         if (value != NULL) {
-          res->desc = malloc(strlen(value) + 1);
-          strcpy(res->desc, value);
+          set_rule_key(res, *rule, value);
           g_free(value);
         }
       } else if (!strcmp(*rule, NODE_DEVICE)) {
@@ -287,13 +279,16 @@ parse_rule(char *rule_node)
   return res;
 }
 
-static void
+static int
 db_write_rule_key(int pos, char *key, char *value)
 {
   char path[128];
 
   snprintf(path, 128, "%s/%d/%s", NODE_RULES, pos, key);
-  com_citrix_xenclient_db_write_(db_xcbus, DB, DB_OBJ, path, value);
+  if (!com_citrix_xenclient_db_write_(db_xcbus, DB, DB_OBJ, path, value))
+    return -1;
+
+  return 0;
 }
 
 static void
@@ -328,133 +323,351 @@ add_rule_to_list(rule_t *rules, rule_t *new_rule)
  * This should be called before any other db_ function.
  *
  * @param xcbus_conn An xcdbus open connection
+ * @param wait Block until the database service is up
  */
 void
-db_dbus_init(xcdbus_conn_t *xcbus_conn)
+db_dbus_init(xcdbus_conn_t *xcbus_conn, bool wait)
 {
   db_xcbus = xcbus_conn;
   /* Wait until all the services we talk to are up */
-  xcdbus_wait_service(db_xcbus, "com.citrix.xenclient.db");
+  if (wait)
+    xcdbus_wait_service(db_xcbus, "com.citrix.xenclient.db");
 }
 
 /**
  * Read the policy from the database
  *
  * @param rules Initialized rule list to store the policy
+ *
+ * @return 0 on success, -1 if the database couldn't be reached
  */
-void
+int
 db_read_policy(rule_t *rules)
 {
   char **rule_nodes, **rule_nodes_list;
   rule_t *rule;
 
-  if (com_citrix_xenclient_db_list_(db_xcbus, DB, DB_OBJ, NODE_RULES, &rule_nodes_list)) {
-    rule_nodes = rule_nodes_list;
-    while (*rule_nodes != NULL) {
-      rule = parse_rule(*rule_nodes);
-      if (rule != NULL)
-        add_rule_to_list(rules, rule);
-      rule_nodes++;
+  if (!com_citrix_xenclient_db_list_(db_xcbus, DB, DB_OBJ, NODE_RULES, &rule_nodes_list))
+    return -1;
+
+  rule_nodes = rule_nodes_list;
+  while (*rule_nodes != NULL) {
+    rule = parse_rule(*rule_nodes);
+    if (rule != NULL)
+      add_rule_to_list(rules, rule);
+    rule_nodes++;
+  }
+  g_strfreev(rule_nodes_list);
+
+  return 0;
+}
+
+/**
+ * @brief Asynchronous policy read
+ *
+ * State of a policy read started by db_read_policy_async()
+ */
+typedef struct {
+  struct list_head rules; /**< Rules being read, in no particular order */
+  int pending;            /**< Number of calls not replied to yet */
+  int status;             /**< 0, or -1 if any call failed */
+  db_policy_cb_t cb;      /**< Completion callback */
+  void *opaque;           /**< Completion callback argument */
+} db_read_t;
+
+/**
+ * What a db node is, which tells what to do with the reply.
+ * Directories get listed, keys get read.
+ */
+enum db_node {
+  DIR_RULES,      /**< /usb-rules */
+  DIR_RULE,       /**< /usb-rules/<rule> */
+  DIR_DEVICE,     /**< /usb-rules/<rule>/device */
+  DIR_VM,         /**< /usb-rules/<rule>/vm */
+  DIR_SYSATTR,    /**< /usb-rules/<rule>/device/sysattr */
+  DIR_PROPERTY,   /**< /usb-rules/<rule>/device/property */
+  KEY_RULE,       /**< /usb-rules/<rule>/<key> */
+  KEY_DEVICE,     /**< /usb-rules/<rule>/device/<key> */
+  KEY_VM,         /**< /usb-rules/<rule>/vm/<key> */
+  KEY_SYSATTR,    /**< /usb-rules/<rule>/device/sysattr/<key> */
+  KEY_PROPERTY    /**< /usb-rules/<rule>/device/property/<key> */
+};
+
+typedef struct {
+  db_read_t *read;
+  rule_t *rule;
+  enum db_node node;
+  char path[128];
+} db_request_t;
+
+static void db_read_reply(DBusMessage *reply, void *opaque);
+
+static void
+db_read_request(db_read_t *read, rule_t *rule, enum db_node node,
+                const char *parent, const char *child)
+{
+  db_request_t *req;
+  const char *path;
+
+  req = malloc(sizeof(db_request_t));
+  req->read = read;
+  req->rule = rule;
+  req->node = node;
+  if (child != NULL)
+    snprintf(req->path, sizeof(req->path), "%s/%s", parent, child);
+  else
+    snprintf(req->path, sizeof(req->path), "%s", parent);
+  path = req->path;
+
+  if (async_call(DB, DB_OBJ, DB_INTERFACE,
+                 (node >= KEY_RULE) ? "read" : "list",
+                 db_read_reply, req,
+                 DBUS_TYPE_STRING, &path,
+                 DBUS_TYPE_INVALID) != 0) {
+    read->status = -1;
+    free(req);
+    return;
+  }
+  read->pending++;
+}
+
+/* Queue the request for a child of the directory req->path */
+static void
+db_read_child(db_request_t *req, const char *child)
+{
+  db_read_t *read = req->read;
+  rule_t *rule;
+
+  switch (req->node) {
+  case DIR_RULES:
+    rule = malloc(sizeof(rule_t));
+    memset(rule, 0, sizeof(rule_t));
+    rule->pos = strtol(child, NULL, 10);
+    list_add_tail(&rule->list, &read->rules);
+    db_read_request(read, rule, DIR_RULE, req->path, child);
+    break;
+  case DIR_RULE:
+    if (!strcmp(child, NODE_COMMAND) || !strcmp(child, NODE_DESCRIPTION))
+      db_read_request(read, req->rule, KEY_RULE, req->path, child);
+    else if (!strcmp(child, NODE_DEVICE))
+      db_read_request(read, req->rule, DIR_DEVICE, req->path, child);
+    else if (!strcmp(child, NODE_VM))
+      db_read_request(read, req->rule, DIR_VM, req->path, child);
+    else
+      db_log(DB_LOG_ERR, "Unknown rule attribute %s", child);
+    break;
+  case DIR_DEVICE:
+    if (!strcmp(child, NODE_SYSATTR))
+      db_read_request(read, req->rule, DIR_SYSATTR, req->path, child);
+    else if (!strcmp(child, NODE_PROPERTY))
+      db_read_request(read, req->rule, DIR_PROPERTY, req->path, child);
+    else if (device_key_known(child))
+      db_read_request(read, req->rule, KEY_DEVICE, req->path, child);
+    else
+      db_log(DB_LOG_ERR, "Unknown Device attribute %s", child);
+    break;
+  case DIR_VM:
+    if (!strcmp(child, NODE_UUID))
+      db_read_request(read, req->rule, KEY_VM, req->path, child);
+    else
+      db_log(DB_LOG_ERR, "Unknown VM attribute %s", child);
+    break;
+  case DIR_SYSATTR:
+    db_read_request(read, req->rule, KEY_SYSATTR, req->path, child);
+    break;
+  case DIR_PROPERTY:
+    db_read_request(read, req->rule, KEY_PROPERTY, req->path, child);
+    break;
+  default:
+    break;
+  }
+}
+
+static void
+db_read_done(db_read_t *read)
+{
+  struct list_head *pos, *tmp;
+  rule_t rules;
+  rule_t *rule;
+
+  INIT_LIST_HEAD(&rules.list);
+  list_for_each_safe(pos, tmp, &read->rules) {
+    rule = list_entry(pos, rule_t, list);
+    list_del(pos);
+    if (read->status == 0)
+      add_rule_to_list(&rules, rule);
+    else
+      policy_free_rule(rule);
+  }
+
+  read->cb(&rules, read->status, read->opaque);
+
+  /* Free whatever the callback didn't take */
+  list_for_each_safe(pos, tmp, &rules.list) {
+    list_del(pos);
+    policy_free_rule(list_entry(pos, rule_t, list));
+  }
+  free(read);
+}
+
+static void
+db_read_reply(DBusMessage *reply, void *opaque)
+{
+  db_request_t *req = opaque;
+  db_read_t *read = req->read;
+  char *key = strrchr(req->path, '/') + 1;
+  char **children, **child;
+  const char *value;
+
+  read->pending--;
+  if (reply == NULL) {
+    read->status = -1;
+  } else if (req->node < KEY_RULE) {
+    children = async_reply_get_strv(reply);
+    for (child = children; child != NULL && *child != NULL; child++)
+      db_read_child(req, *child);
+    g_strfreev(children);
+  } else if (async_reply_get_string(reply, &value)) {
+    switch (req->node) {
+    case KEY_RULE:
+      set_rule_key(req->rule, key, value);
+      break;
+    case KEY_DEVICE:
+      set_device_key(req->rule, key, value);
+      break;
+    case KEY_VM:
+      set_vm_key(req->rule, key, value);
+      break;
+    case KEY_SYSATTR:
+      add_pair(key, (char *)value, &req->rule->dev_sysattrs);
+      break;
+    case KEY_PROPERTY:
+      add_pair(key, (char *)value, &req->rule->dev_properties);
+      break;
+    default:
+      break;
     }
-    g_strfreev(rule_nodes_list);
   }
+  free(req);
+
+  if (read->pending == 0)
+    db_read_done(read);
+}
+
+/**
+ * Read the policy from the database without blocking.
+ * All the list and read calls of a level of the tree are sent at once,
+ * so reading the whole policy takes a few round trips instead of one
+ * per key.
+ *
+ * @param cb Called once everything was read, with the (sorted) list of
+ *        rules and 0, or -1 if anything failed. The callback should
+ *        move the rules it wants to keep out of the list.
+ * @param opaque Argument passed to cb
+ *
+ * @return 0 if the read started, -1 otherwise, in which case cb will
+ *         never be called
+ */
+int
+db_read_policy_async(db_policy_cb_t cb, void *opaque)
+{
+  db_read_t *read;
+
+  read = malloc(sizeof(db_read_t));
+  INIT_LIST_HEAD(&read->rules);
+  read->pending = 0;
+  read->status = 0;
+  read->cb = cb;
+  read->opaque = opaque;
+
+  db_read_request(read, NULL, DIR_RULES, NODE_RULES, NULL);
+  if (read->pending == 0) {
+    free(read);
+    return -1;
+  }
+
+  return 0;
 }
 
 /**
  * Write sysattr or property nodes
  */
-static void
+static int
 write_sysattr_or_properties(int pos, char *node_path, char** map) {
   int index=0;
+  int ret = 0;
   char subnode_path[128];
 
-  if (node_path == NULL || map == NULL) return;
+  if (node_path == NULL || map == NULL) return 0;
   while (map[index] != NULL) {
     snprintf(subnode_path, 128, "%s/%s",
         node_path,
         map[index]);
-    db_write_rule_key(pos, subnode_path, map[index+1]);
+    ret |= db_write_rule_key(pos, subnode_path, map[index+1]);
     index += 2;
   }
+
+  return ret;
 }
 
 /**
  * Dump the policy to the database
  *
  * @param rules The list of rules to write
+ *
+ * @return 0 on success, -1 if any write failed
  */
-void
+int
 db_write_policy(rule_t *rules)
 {
   struct list_head *pos;
   rule_t *rule = NULL;
   char value[5];
+  char key[64];
+  int ret = 0;
+  int i;
 
-  com_citrix_xenclient_db_rm_(db_xcbus, DB, DB_OBJ, NODE_RULES);
+  if (!com_citrix_xenclient_db_rm_(db_xcbus, DB, DB_OBJ, NODE_RULES))
+    return -1;
 
   list_for_each(pos, &rules->list) {
     rule = list_entry(pos, rule_t, list);
     if (rule->desc != NULL)
-      db_write_rule_key(rule->pos, NODE_DESCRIPTION, rule->desc);
-
-    db_write_rule_key(rule->pos, NODE_COMMAND, policy_parse_command_enum(rule->cmd));
-
-    if (rule->dev_type != 0) {
-      if (rule->dev_type & KEYBOARD)
-        db_write_rule_key(rule->pos, NODE_DEVICE "/" NODE_KEYBOARD, "1");
-      if (rule->dev_type & MOUSE)
-        db_write_rule_key(rule->pos, NODE_DEVICE "/" NODE_MOUSE, "1");
-      if (rule->dev_type & GAME_CONTROLLER)
-        db_write_rule_key(rule->pos, NODE_DEVICE "/" NODE_GAME_CONTROLLER, "1");
-      if (rule->dev_type & MASS_STORAGE)
-        db_write_rule_key(rule->pos, NODE_DEVICE "/" NODE_MASS_STORAGE, "1");
-      if (rule->dev_type & OPTICAL)
-        db_write_rule_key(rule->pos, NODE_DEVICE "/" NODE_OPTICAL, "1");
-      if (rule->dev_type & NIC)
-        db_write_rule_key(rule->pos, NODE_DEVICE "/" NODE_NIC, "1");
-      if (rule->dev_type & BLUETOOTH)
-        db_write_rule_key(rule->pos, NODE_DEVICE "/" NODE_BLUETOOTH, "1");
-      if (rule->dev_type & AUDIO)
-        db_write_rule_key(rule->pos, NODE_DEVICE "/" NODE_AUDIO, "1");
-    }
-    if (rule->dev_not_type != 0) {
-      if (rule->dev_not_type & KEYBOARD)
-        db_write_rule_key(rule->pos, NODE_DEVICE "/" NODE_KEYBOARD, "0");
-      if (rule->dev_not_type & MOUSE)
-        db_write_rule_key(rule->pos, NODE_DEVICE "/" NODE_MOUSE, "0");
-      if (rule->dev_not_type & GAME_CONTROLLER)
-        db_write_rule_key(rule->pos, NODE_DEVICE "/" NODE_GAME_CONTROLLER, "0");
-      if (rule->dev_not_type & MASS_STORAGE)
-        db_write_rule_key(rule->pos, NODE_DEVICE "/" NODE_MASS_STORAGE, "0");
-      if (rule->dev_not_type & NIC)
-        db_write_rule_key(rule->pos, NODE_DEVICE "/" NODE_NIC, "0");
-      if (rule->dev_not_type & BLUETOOTH)
-        db_write_rule_key(rule->pos, NODE_DEVICE "/" NODE_BLUETOOTH, "0");
-      if (rule->dev_not_type & AUDIO)
-        db_write_rule_key(rule->pos, NODE_DEVICE "/" NODE_AUDIO, "0");
+      ret |= db_write_rule_key(rule->pos, NODE_DESCRIPTION, rule->desc);
+
+    ret |= db_write_rule_key(rule->pos, NODE_COMMAND, policy_parse_command_enum(rule->cmd));
+
+    for (i = 0; type_nodes[i].node != NULL; ++i) {
+      snprintf(key, sizeof(key), NODE_DEVICE "/%s", type_nodes[i].node);
+      if (rule->dev_type & type_nodes[i].type)
+        ret |= db_write_rule_key(rule->pos, key, "1");
+      else if (rule->dev_not_type & type_nodes[i].type)
+        ret |= db_write_rule_key(rule->pos, key, "0");
     }
     if (rule->dev_vendorid != 0) {
       snprintf(value, 5, "%04X", rule->dev_vendorid);
-      db_write_rule_key(rule->pos, NODE_DEVICE "/" NODE_VENDOR_ID, value);
+      ret |= db_write_rule_key(rule->pos, NODE_DEVICE "/" NODE_VENDOR_ID, value);
     }
     if (rule->dev_deviceid != 0) {
       snprintf(value, 5, "%04X", rule->dev_deviceid);
-      db_write_rule_key(rule->pos, NODE_DEVICE "/" NODE_DEVICE_ID, value);
+      ret |= db_write_rule_key(rule->pos, NODE_DEVICE "/" NODE_DEVICE_ID, value);
     }
     if (rule->dev_serial != NULL) {
-      db_write_rule_key(rule->pos, NODE_DEVICE "/" NODE_SERIAL, rule->dev_serial);
+      ret |= db_write_rule_key(rule->pos, NODE_DEVICE "/" NODE_SERIAL, rule->dev_serial);
     }
     if (rule->dev_sysattrs != NULL) {
-      write_sysattr_or_properties(rule->pos,
+      ret |= write_sysattr_or_properties(rule->pos,
           NODE_DEVICE "/" NODE_SYSATTR,
           rule->dev_sysattrs);
     }
     if (rule->dev_properties != NULL) {
-      write_sysattr_or_properties(rule->pos,
+      ret |= write_sysattr_or_properties(rule->pos,
           NODE_DEVICE "/" NODE_PROPERTY,
           rule->dev_properties);
     }
     if (rule->vm_uuid != NULL)
-      db_write_rule_key(rule->pos, NODE_VM "/" NODE_UUID, rule->vm_uuid);
+      ret |= db_write_rule_key(rule->pos, NODE_VM "/" NODE_UUID, rule->vm_uuid);
   }
+
+  return ret;
 }
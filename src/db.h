@@ -41,6 +41,7 @@
 
 #define DB          "com.citrix.xenclient.db"
 #define DB_OBJ      "/"
+#define DB_INTERFACE "com.citrix.xenclient.db"
 
 #define NODE_RULES      "/usb-rules"
 /*                        "<rule number>" */
@@ -55,6 +56,9 @@
 #define NODE_NIC              "nic"
 #define NODE_BLUETOOTH        "bluetooth"
 #define NODE_AUDIO            "audio"
+#define NODE_SMARTCARD        "smartcard"
+#define NODE_VIDEO            "video"
+#define NODE_PRINTER          "printer"
 #define NODE_VENDOR_ID        "vendor_id"
 #define NODE_DEVICE_ID        "device_id"
 #define NODE_SERIAL           "serial"
@@ -63,8 +67,14 @@
 #define NODE_VM             "vm"
 #define NODE_UUID             "uuid"
 
-void db_dbus_init(xcdbus_conn_t *xcbus_conn);
-void db_read_policy(rule_t *rules);
-void db_write_policy(rule_t *rules);
+/**
+ * Asynchronous policy read callback, see db_read_policy_async()
+ */
+typedef void (*db_policy_cb_t)(rule_t *rules, int status, void *opaque);
+
+void db_dbus_init(xcdbus_conn_t *xcbus_conn, bool wait);
+int  db_read_policy(rule_t *rules);
+int  db_read_policy_async(db_policy_cb_t cb, void *opaque);
+int  db_write_policy(rule_t *rules);
 
 #endif 	    /* !DB_H_ */
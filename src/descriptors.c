@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2017 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   descriptors.c
+ * @author Troy Crosley <crosleyt@ainfosec.com>
+ * @date   Fri Feb 03 10:53:45 2017
+ *
+ * @brief  USB descriptors reading
+ *
+ * Functions that read the raw descriptors of a device from sysfs, for
+ * classify.c to walk. The descriptors file of a device
+ * holds its device descriptor followed by all its configuration
+ * descriptors, each followed by its interface, endpoint and
+ * class-specific descriptors.
+ */
+
+#include "project.h"
+#include <limits.h>
+
+#define DESCRIPTORS_MAX                 65536 /**< Bigger files get truncated */
+
+/**
+ * Read the raw descriptors of a device
+ *
+ * @param syspath The sysfs path of the device
+ * @param len Set to the size of the returned buffer
+ *
+ * @return The descriptors, to be freed by the caller, or NULL
+ */
+unsigned char*
+descriptors_read(const char *syspath, size_t *len)
+{
+  char path[PATH_MAX];
+  unsigned char *buf;
+  size_t size = 1024;
+  ssize_t n;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/descriptors", syspath);
+  fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    xd_log(LOG_WARNING, "Unable to read the descriptors of %s. Was it removed?", syspath);
+    return NULL;
+  }
+
+  buf = malloc(size);
+  *len = 0;
+  for (;;) {
+    if (*len == size) {
+      if (size >= DESCRIPTORS_MAX)
+        break;
+      size *= 2;
+      buf = realloc(buf, size);
+    }
+    n = read(fd, buf + *len, size - *len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    *len += n;
+  }
+  close(fd);
+
+  return buf;
+}
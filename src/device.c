@@ -165,8 +165,14 @@ device_add(int  busid, int  devid,
   device->longname = longname;
   device->sysname = sysname;
   device->udev = udev;
+  device->children.devs = NULL;
+  device->children.count = 0;
+  device->children.scanned = false;
   device->vm = NULL; /* The UI isn't happy if the device is assigned to dom0 */
   device->type = type;
+  device->sticky_gen = 0;
+  device->sticky_tree = 0;
+  device->sticky_uuid = NULL;
   list_add(&device->list, &devices.list);
 
   return device;
@@ -178,6 +184,7 @@ void device_free(device_t *device)
   free(device->longname);
   free(device->sysname);
   free(device->serial);
+  udev_children_free(&device->children);
   /* udev_device_unref is okay when udev is NULL */
   udev_device_unref(device->udev);
   free(device);
@@ -280,7 +287,8 @@ device_type(unsigned char class,
 }
 
 /**
- * Iterate through all the devices attached to the VM and unplug them
+ * Iterate through all the devices attached to the VM and unplug them,
+ * all at once
  *
  * @param domid The domid of the VM
  *
@@ -291,12 +299,36 @@ device_unplug_all_from_vm(int domid)
 {
   struct list_head *pos;
   device_t *device;
+  int *bus, *dev;
+  int count = 0;
+  int n = 0;
   int res = 0;
 
+  list_for_each(pos, &devices.list) {
+    device = list_entry(pos, device_t, list);
+    if (device->vm != NULL && device->vm->domid == domid)
+      count++;
+  }
+  if (count == 0)
+    return 0;
+
+  bus = malloc(count * sizeof(int));
+  dev = malloc(count * sizeof(int));
+  list_for_each(pos, &devices.list) {
+    device = list_entry(pos, device_t, list);
+    if (device->vm != NULL && device->vm->domid == domid) {
+      bus[n] = device->busid;
+      dev[n] = device->devid;
+      n++;
+    }
+  }
+  res = usbowls_unplug_devices(domid, n, bus, dev, NULL);
+  free(bus);
+  free(dev);
+
   list_for_each(pos, &devices.list) {
     device = list_entry(pos, device_t, list);
     if (device->vm != NULL && device->vm->domid == domid) {
-      res |= usbowls_unplug_device(domid, device->busid, device->devid);
       xd_log(LOG_INFO,
           "Device [Bus=%03d, Dev=%03d, VID=%04X, PID=%04X, Serial=%s] unplugged from VM [UUID=%s, DomID=%d]",
           device->busid,
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2026 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   flap.c
+ * @date   Mon Oct 19 17:21:05 2026
+ *
+ * @brief  Plug/unplug flapping protection
+ *
+ * Two things live here:
+ * - Cancellation tokens. Probing or plugging a device involves blocking
+ *   waits, a token lets them notice that the device went away and give
+ *   up early. A token is cancelled by a remove event for its bus/dev
+ *   IDs, or when the device disappears from sysfs.
+ * - The hold-down. A port whose devices keep disappearing right after
+ *   showing up (bad cable, hub power-cycling...) stops getting its
+ *   devices assigned automatically for a while.
+ */
+
+#include "project.h"
+#include <limits.h>
+
+#define FLAP_WINDOW 5 /**< A device removed within that many seconds flapped */
+
+struct cancel {
+  struct list_head list;
+  int busid;
+  int devid;
+  char *syspath;              /**< Where the device lives in sysfs, or NULL */
+  bool cancelled;
+};
+
+typedef struct {
+  struct list_head list;
+  char *port;                 /**< The sysname, which is per-port for USB */
+  int flaps;                  /**< Consecutive flaps */
+  time_t added;               /**< When the last device showed up */
+  time_t hold_until;          /**< No automatic assignment before that */
+} flap_port_t;
+
+static LIST_HEAD(tokens);
+static LIST_HEAD(ports);
+static int flap_threshold = 3;
+static int flap_holddown = 30;
+
+static time_t
+flap_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec;
+}
+
+/**
+ * Create a cancellation token for a device, and register it so that
+ * a remove event cancels it. Free it with cancel_free().
+ *
+ * @param busid The bus ID of the device
+ * @param devid The ID of the device on the bus
+ * @param syspath The sysfs path of the device, or NULL to only rely
+ *        on remove events
+ */
+cancel_t*
+cancel_new(int busid, int devid, const char *syspath)
+{
+  cancel_t *cancel;
+
+  cancel = malloc(sizeof(cancel_t));
+  cancel->busid = busid;
+  cancel->devid = devid;
+  cancel->syspath = (syspath != NULL) ? strdup(syspath) : NULL;
+  cancel->cancelled = false;
+  list_add(&cancel->list, &tokens);
+
+  return cancel;
+}
+
+void
+cancel_free(cancel_t *cancel)
+{
+  if (cancel == NULL)
+    return;
+  list_del(&cancel->list);
+  free(cancel->syspath);
+  free(cancel);
+}
+
+/**
+ * Check if the work on a device should stop. Also checks sysfs, since
+ * remove events don't get processed while we're blocked on the device.
+ *
+ * @param cancel The token, NULL is never cancelled
+ *
+ * @return true if the device is gone
+ */
+bool
+cancel_requested(cancel_t *cancel)
+{
+  char path[PATH_MAX];
+  char value[16];
+  FILE *f;
+
+  if (cancel == NULL)
+    return false;
+  if (cancel->cancelled || cancel->syspath == NULL)
+    return cancel->cancelled;
+
+  /* Another device on the same port gets another devnum */
+  snprintf(path, sizeof(path), "%s/devnum", cancel->syspath);
+  f = fopen(path, "r");
+  if (f == NULL ||
+      fgets(value, sizeof(value), f) == NULL ||
+      strtol(value, NULL, 10) != cancel->devid)
+    cancel->cancelled = true;
+  if (f != NULL)
+    fclose(f);
+
+  return cancel->cancelled;
+}
+
+/**
+ * Cancel all the work in progress on a device, after it was removed
+ */
+void
+cancel_device(int busid, int devid)
+{
+  struct list_head *pos;
+  cancel_t *cancel;
+
+  list_for_each(pos, &tokens) {
+    cancel = list_entry(pos, cancel_t, list);
+    if (cancel->busid == busid && cancel->devid == devid)
+      cancel->cancelled = true;
+  }
+}
+
+/**
+ * Set the flapping thresholds
+ *
+ * @param threshold How many quick unplugs in a row trigger the hold-down
+ * @param holddown How long the hold-down lasts, in seconds, 0 to disable
+ */
+void
+flap_configure(int threshold, int holddown)
+{
+  flap_threshold = threshold;
+  flap_holddown = holddown;
+}
+
+static flap_port_t*
+flap_lookup(const char *port, bool create)
+{
+  struct list_head *pos;
+  flap_port_t *fp;
+
+  list_for_each(pos, &ports) {
+    fp = list_entry(pos, flap_port_t, list);
+    if (!strcmp(fp->port, port))
+      return fp;
+  }
+  if (!create)
+    return NULL;
+
+  fp = malloc(sizeof(flap_port_t));
+  fp->port = strdup(port);
+  fp->flaps = 0;
+  fp->added = 0;
+  fp->hold_until = 0;
+  list_add(&fp->list, &ports);
+
+  return fp;
+}
+
+/**
+ * Record a device showing up on a port
+ *
+ * @param port The sysname of the device
+ */
+void
+flap_added(const char *port)
+{
+  if (port == NULL || flap_holddown <= 0)
+    return;
+  flap_lookup(port, true)->added = flap_now();
+}
+
+/**
+ * Record a device leaving a port. If it didn't stay long, and that
+ * happened too many times in a row, the port gets held down.
+ *
+ * @param port The sysname of the device
+ */
+void
+flap_removed(const char *port)
+{
+  flap_port_t *fp;
+  time_t now;
+
+  if (port == NULL || flap_holddown <= 0)
+    return;
+  fp = flap_lookup(port, false);
+  if (fp == NULL || fp->added == 0)
+    return;
+
+  now = flap_now();
+  if (now - fp->added > FLAP_WINDOW) {
+    /* That one stayed, the port is fine. Forget about it */
+    list_del(&fp->list);
+    free(fp->port);
+    free(fp);
+    return;
+  }
+
+  if (++fp->flaps >= flap_threshold) {
+    xd_log(LOG_WARNING,
+           "Devices on port %s keep disconnecting, not assigning them for %d seconds",
+           fp->port, flap_holddown);
+    fp->hold_until = now + flap_holddown;
+    fp->flaps = 0;
+  }
+}
+
+/**
+ * Check if devices on a port shouldn't get assigned automatically
+ *
+ * @param port The sysname of the device
+ *
+ * @return true if the port is held down
+ */
+bool
+flap_held(const char *port)
+{
+  flap_port_t *fp;
+
+  if (port == NULL || flap_holddown <= 0)
+    return false;
+  fp = flap_lookup(port, false);
+
+  return (fp != NULL && flap_now() < fp->hold_until);
+}
@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2026 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   fpcache.c
+ * @date   Tue Oct 20 10:08:44 2026
+ *
+ * @brief  Device fingerprint cache
+ *
+ * Where the classification cache knows about device models, this one
+ * knows about physical devices: it's keyed by VID, PID, serial and
+ * port, and remembers the names and the type bits of the device. A
+ * device that gets plugged back in the same port, with the same
+ * descriptors, skips udev settling and classification entirely. It
+ * gets revalidated in the background.
+ *
+ * The cache is a file of fixed-size slots, mapped in memory. Updating
+ * an entry only dirties its page, nothing gets rewritten.
+ */
+
+#include "project.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FPCACHE_MAGIC   "VUSBFP02" /**< Bumped when the layout changes */
+#define FPCACHE_SLOTS   256        /**< Power of 2 */
+#define FPCACHE_PROBES  8          /**< Slots looked at for a key */
+#define FPCACHE_USED    0x55534544 /**< Marks a valid slot */
+
+typedef struct {
+  uint32_t used;     /**< FPCACHE_USED if valid */
+  uint16_t vendorid;
+  uint16_t deviceid;
+  uint32_t hash;     /**< Hash of the descriptors */
+  int32_t type;
+  uint8_t has_serial;
+  char serial[64];
+  char port[32];     /**< sysname, like "1-1.2" */
+  char vendor[64];
+  char model[96];
+} fpslot_t;
+
+typedef struct {
+  char magic[8];
+  uint32_t slots;
+  uint32_t slot_size;
+  fpslot_t slot[FPCACHE_SLOTS];
+} fpfile_t;
+
+static fpfile_t *fpcache = NULL;
+static unsigned long fpcache_hits = 0;
+static unsigned long fpcache_misses = 0;
+
+/**
+ * Map the cache file, creating or resetting it if needed
+ *
+ * @param path The cache file
+ *
+ * @return 0 on success, -1 if the cache is unavailable
+ */
+int
+fpcache_open(const char *path)
+{
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    xd_log(LOG_WARNING, "Unable to open the fingerprint cache %s", path);
+    return -1;
+  }
+  if (fstat(fd, &st) != 0 ||
+      (st.st_size != sizeof(fpfile_t) && ftruncate(fd, 0) != 0) ||
+      ftruncate(fd, sizeof(fpfile_t)) != 0) {
+    xd_log(LOG_WARNING, "Unable to size the fingerprint cache %s", path);
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, sizeof(fpfile_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    xd_log(LOG_WARNING, "Unable to map the fingerprint cache %s", path);
+    return -1;
+  }
+
+  fpcache = map;
+  if (memcmp(fpcache->magic, FPCACHE_MAGIC, sizeof(fpcache->magic)) ||
+      fpcache->slots != FPCACHE_SLOTS ||
+      fpcache->slot_size != sizeof(fpslot_t)) {
+    memset(fpcache, 0, sizeof(fpfile_t));
+    memcpy(fpcache->magic, FPCACHE_MAGIC, sizeof(fpcache->magic));
+    fpcache->slots = FPCACHE_SLOTS;
+    fpcache->slot_size = sizeof(fpslot_t);
+  }
+
+  return 0;
+}
+
+/* The key has to fit in a slot to be cached */
+static bool
+fpcache_key_fits(const char *serial, const char *port)
+{
+  return (port != NULL && strlen(port) < sizeof(((fpslot_t *)0)->port) &&
+          (serial == NULL || strlen(serial) < sizeof(((fpslot_t *)0)->serial)));
+}
+
+/* Same for the names, truncated ones would never match the device */
+static bool
+fpcache_names_fit(const char *vendor, const char *model)
+{
+  return ((vendor == NULL || strlen(vendor) < sizeof(((fpslot_t *)0)->vendor)) &&
+          (model == NULL || strlen(model) < sizeof(((fpslot_t *)0)->model)));
+}
+
+static unsigned int
+fpcache_index(int vendorid, int deviceid, const char *serial, const char *port)
+{
+  unsigned int h = vendorid * 31 + deviceid;
+  const char *s;
+
+  for (s = port; *s != '\0'; ++s)
+    h = h * 31 + (unsigned char)*s;
+  if (serial != NULL)
+    for (s = serial; *s != '\0'; ++s)
+      h = h * 31 + (unsigned char)*s;
+
+  return h & (FPCACHE_SLOTS - 1);
+}
+
+static bool
+fpcache_slot_matches(fpslot_t *slot, int vendorid, int deviceid,
+                     const char *serial, const char *port)
+{
+  return (slot->used == FPCACHE_USED &&
+          slot->vendorid == vendorid && slot->deviceid == deviceid &&
+          slot->has_serial == (serial != NULL) &&
+          (serial == NULL || !strcmp(slot->serial, serial)) &&
+          !strcmp(slot->port, port));
+}
+
+/* Find the slot of a key, or NULL */
+static fpslot_t*
+fpcache_find(int vendorid, int deviceid, const char *serial, const char *port)
+{
+  unsigned int i, start;
+  fpslot_t *slot;
+
+  if (fpcache == NULL || !fpcache_key_fits(serial, port))
+    return NULL;
+
+  start = fpcache_index(vendorid, deviceid, serial, port);
+  for (i = 0; i < FPCACHE_PROBES; ++i) {
+    slot = &fpcache->slot[(start + i) & (FPCACHE_SLOTS - 1)];
+    if (fpcache_slot_matches(slot, vendorid, deviceid, serial, port))
+      return slot;
+  }
+
+  return NULL;
+}
+
+/**
+ * Look up a physical device
+ *
+ * @param vendorid The device vendor ID
+ * @param deviceid The device product ID
+ * @param serial The device serial, or NULL
+ * @param port The device sysname
+ * @param hash The hash of the device descriptors
+ * @param type Set to the type bits of the device
+ * @param vendor Set to a copy of the vendor name
+ * @param model Set to a copy of the model name
+ *
+ * @return true on a hit, false otherwise, in which case nothing is set
+ */
+bool
+fpcache_lookup(int vendorid, int deviceid, const char *serial,
+               const char *port, uint32_t hash,
+               int *type, char **vendor, char **model)
+{
+  fpslot_t *slot;
+
+  slot = fpcache_find(vendorid, deviceid, serial, port);
+  if (slot == NULL || slot->hash != hash) {
+    fpcache_misses++;
+    return false;
+  }
+
+  fpcache_hits++;
+  *type = slot->type;
+  *vendor = strdup(slot->vendor);
+  *model = strdup(slot->model);
+
+  return true;
+}
+
+/* Copy a string into a slot field, it has to fit */
+static void
+fpcache_copy(char *dst, size_t size, const char *src)
+{
+  snprintf(dst, size, "%s", (src != NULL) ? src : "");
+}
+
+/**
+ * Remember a physical device. Replaces its previous entry, or the
+ * first free slot, or the first slot it could use. A device which
+ * names don't fit loses its entry instead.
+ */
+void
+fpcache_store(int vendorid, int deviceid, const char *serial,
+              const char *port, uint32_t hash,
+              int type, const char *vendor, const char *model)
+{
+  unsigned int i, start;
+  fpslot_t *slot, *victim = NULL;
+
+  if (fpcache == NULL || !fpcache_key_fits(serial, port))
+    return;
+  if (!fpcache_names_fit(vendor, model)) {
+    slot = fpcache_find(vendorid, deviceid, serial, port);
+    if (slot != NULL)
+      slot->used = 0;
+    return;
+  }
+
+  start = fpcache_index(vendorid, deviceid, serial, port);
+  for (i = 0; i < FPCACHE_PROBES; ++i) {
+    slot = &fpcache->slot[(start + i) & (FPCACHE_SLOTS - 1)];
+    if (fpcache_slot_matches(slot, vendorid, deviceid, serial, port)) {
+      victim = slot;
+      break;
+    }
+    if (victim == NULL && slot->used != FPCACHE_USED)
+      victim = slot;
+  }
+  if (victim == NULL)
+    victim = &fpcache->slot[start];
+
+  /* Invalidate while writing, in case we die halfway */
+  victim->used = 0;
+  victim->vendorid = vendorid;
+  victim->deviceid = deviceid;
+  victim->hash = hash;
+  victim->type = type;
+  victim->has_serial = (serial != NULL);
+  fpcache_copy(victim->serial, sizeof(victim->serial), serial);
+  fpcache_copy(victim->port, sizeof(victim->port), port);
+  fpcache_copy(victim->vendor, sizeof(victim->vendor), vendor);
+  fpcache_copy(victim->model, sizeof(victim->model), model);
+  victim->used = FPCACHE_USED;
+}
+
+void
+fpcache_stats(unsigned long *hits, unsigned long *misses, int *entries)
+{
+  int i;
+
+  *hits = fpcache_hits;
+  *misses = fpcache_misses;
+  *entries = 0;
+  if (fpcache == NULL)
+    return;
+  for (i = 0; i < FPCACHE_SLOTS; ++i)
+    if (fpcache->slot[i].used == FPCACHE_USED)
+      (*entries)++;
+}
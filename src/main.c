@@ -28,39 +28,67 @@
 
 #include "project.h"
 
-static void fill_vms()
+#define FILL_VMS_TIMEOUT 10 /**< Seconds to wait for the VM list at startup */
+
+static int fill_vms_pending = 0; /**< Replies fill_vms() is still waiting for */
+
+static void fill_vms_domid_reply(DBusMessage *reply, void *opaque)
 {
-  GPtrArray *paths;
-  int i;
+  char *path = opaque;
+  int domid;
 
-  /* Add dom0 to the list of VMs */
-  vm_add(DOM0_DOMID, DOM0_UUID);
+  if (!async_reply_get_int(reply, &domid))
+    xd_log(LOG_ERR, "Unable to get the domid of VM %s", path);
+  else
+    vm_add(domid, path + 4);
+  /* At this point, if the VM is running (domid > -1) we could run
+   * the sticky rules, but I don't think we should */
+  free(path);
+  if (fill_vms_pending > 0)
+    fill_vms_pending--;
+}
+
+static void fill_vms_list_reply(DBusMessage *reply, void *opaque)
+{
+  char **paths, **path;
 
-  /* Get all the (other) VMs from xenmgr */
   /* If xenmgr is not started yet, this will fail,
      which is fine since we'll get new VM notifications once xenmgr is up and runnning */
-  com_citrix_xenclient_xenmgr_list_vms_(g_xcbus, XENMGR, XENMGR_OBJ, &paths);
-  if (!com_citrix_xenclient_xenmgr_list_vms_(g_xcbus, XENMGR, XENMGR_OBJ, &paths)) {
+  if (fill_vms_pending > 0)
+    fill_vms_pending--;
+  paths = async_reply_get_strv(reply);
+  if (paths == NULL) {
     xd_log(LOG_WARNING, "Unable to get the list of VMs");
     return;
   }
 
-  /* Get their domid and add them to the list */
-  for (i = 0; i < paths->len; ++i) {
-    const char *path = g_ptr_array_index(paths, i);
-    int domid;
-
-    if (!property_get_com_citrix_xenclient_xenmgr_vm_domid_(g_xcbus, XENMGR, path, &domid)) {
-      xd_log(LOG_ERR, "Unable to get the domid of a VM");
-      return;
-    }
+  /* Get their domid, all at once, and add them to the list */
+  for (path = paths; *path != NULL; ++path) {
+    char *p = strdup(*path);
 
-    vm_add(domid, path + 4);
-    /* At this point, if the VM is running (domid > -1) we could run
-     * the sticky rules, but I don't think we should */
+    if (async_get_property(XENMGR, p, XENMGR_VM, "domid",
+                           fill_vms_domid_reply, p) != 0) {
+      xd_log(LOG_ERR, "Unable to get the domid of VM %s", p);
+      free(p);
+    } else
+      fill_vms_pending++;
   }
 
-  g_ptr_array_free(paths, TRUE);
+  g_strfreev(paths);
+}
+
+static void fill_vms()
+{
+  /* Add dom0 to the list of VMs */
+  vm_add(DOM0_DOMID, DOM0_UUID);
+
+  /* Get all the (other) VMs from xenmgr, the replies get handled by
+   * fill_vms_wait() */
+  if (async_call(XENMGR, XENMGR_OBJ, XENMGR, "list_vms",
+                 fill_vms_list_reply, NULL, DBUS_TYPE_INVALID) != 0)
+    xd_log(LOG_WARNING, "Unable to get the list of VMs");
+  else
+    fill_vms_pending = 1;
 }
 
 int dbus_pre_select(int nfds, fd_set *readfds, fd_set *writefds,
@@ -83,25 +111,105 @@ void dbus_post_select(int nfds, fd_set *readfds, fd_set *writefds,
   xcdbus_post_select(g_xcbus, nfds, readfds, writefds, exceptfds);
 }
 
+/* The devices and vusb nodes found at startup need the VM list, so
+ * process D-Bus until all the fill_vms() replies came in */
+static void fill_vms_wait()
+{
+  fd_set readfds;
+  fd_set writefds;
+  fd_set exceptfds;
+  struct timeval tv;
+  struct timespec start, now;
+  int nfds;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (fill_vms_pending > 0) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - start.tv_sec >= FILL_VMS_TIMEOUT) {
+      xd_log(LOG_WARNING, "Timed out waiting for the list of VMs");
+      return;
+    }
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    FD_ZERO(&exceptfds);
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    nfds = dbus_pre_select(0, &readfds, &writefds, &exceptfds);
+    select(nfds, &readfds, &writefds, &exceptfds, &tv);
+    dbus_post_select(nfds, &readfds, &writefds, &exceptfds);
+  }
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [--stub-mode] [--uevent] [--prestage]\n"
+          "       [--flap-threshold=N] [--flap-holddown=SECONDS]\n", name);
+}
+
 int
 main(int argc, char *argv[]) {
+  static const struct option options[] = {
+    { "stub-mode", no_argument, NULL, 's' },
+    { "uevent",    no_argument, NULL, 'u' },
+    { "prestage",  no_argument, NULL, 'p' },
+    { "flap-threshold", required_argument, NULL, 't' },
+    { "flap-holddown",  required_argument, NULL, 'd' },
+    { "help",      no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
   int ret;
   fd_set readfds;
   fd_set writefds;
   fd_set exceptfds;
   int nfds;
   int xsfd;
+  int statefd = -1;
   int udevfd;
+  int ueventfd = -1;
   int dbus = 1;
-
-  /* init libusb */
-  usb_init();
+  int stub_mode = 0;
+  int uevent = 0;
+  int prestage = 0;
+  int opt;
+  int flap_threshold = 3;
+  int flap_holddown = 30;
+  struct timeval tv, *timeout;
 
   /* Init global VMs and devices lists */
   INIT_LIST_HEAD(&vms.list);
   INIT_LIST_HEAD(&devices.list);
 
-  if (argc > 1 && strcmp(argv[1], "stub-mode") == 0) {
+  while ((opt = getopt_long(argc, argv, "supt:d:h", options, NULL)) != -1) {
+    switch (opt) {
+    case 's':
+      stub_mode = 1;
+      break;
+    case 'u':
+      uevent = 1;
+      break;
+    case 'p':
+      prestage = 1;
+      break;
+    case 't':
+      flap_threshold = strtol(optarg, NULL, 10);
+      break;
+    case 'd':
+      flap_holddown = strtol(optarg, NULL, 10);
+      break;
+    default:
+      usage(argv[0]);
+      return (opt == 'h') ? 0 : 1;
+    }
+  }
+  /* "stub-mode" used to be a plain argument */
+  if (optind < argc && strcmp(argv[optind], "stub-mode") == 0)
+    stub_mode = 1;
+  if (flap_threshold < 1)
+    flap_threshold = 1;
+  /* Devices that keep reconnecting don't get assigned for a while */
+  flap_configure(flap_threshold, flap_holddown);
+
+  if (stub_mode) {
     xd_log(LOG_INFO, "Running in stub-mode (no D-Bus)");
     dbus = 0;
     g_xcbus = NULL;
@@ -125,10 +233,11 @@ main(int argc, char *argv[]) {
       return -1;
     }
 
-    xenstore_state_handle();
+    statefd = xenstore_state_handle();
 
     /* Populate the VM list */
     fill_vms();
+    fill_vms_wait();
   }
 
   /* Why would we do that? */
@@ -145,9 +254,27 @@ main(int argc, char *argv[]) {
     return -1;
   }
 
+  /* Hear about new devices before udev is done with them, so the
+   * sticky ones can be staged early. Only useful where devices get
+   * assigned automatically */
+  if (uevent && dbus && my_domid == 0) {
+    ueventfd = uevent_init();
+    if (ueventfd < 0)
+      xd_log(LOG_WARNING, "Unable to listen to kernel uevents, continuing without");
+  }
+
+  /* Known device models don't need to be probed again, and known
+   * devices don't even need udev to settle */
+  classcache_load(CLASSCACHE_PATH);
+  fpcache_open(FPCACHE_PATH);
+
   /* Populate the USB device list */
   udev_fill_devices();
 
+  /* Get the sticky devices of new VMs ready before they boot */
+  if (prestage && dbus && my_domid == 0)
+    xenstore_prestage_enable();
+
   ret = xsdev_watch_init();
   if (ret == 0) {
     xd_log(LOG_ERR, "Unable to initialize xenstore device watch");
@@ -174,17 +301,66 @@ main(int argc, char *argv[]) {
     FD_SET(udevfd, &readfds);
     FD_SET(xsfd, &readfds);
     nfds = xsfd > udevfd ? xsfd : udevfd;
+    if (statefd >= 0) {
+      FD_SET(statefd, &readfds);
+      nfds = statefd > nfds ? statefd : nfds;
+    }
+    if (ueventfd >= 0) {
+      FD_SET(ueventfd, &readfds);
+      nfds = ueventfd > nfds ? ueventfd : nfds;
+    }
     nfds = nfds + 1;
 
+    /* Wake up regularly while the policy snapshot isn't reconciled */
+    timeout = NULL;
+    if (dbus && policy_reconcile_pending()) {
+      tv.tv_sec = 1;
+      tv.tv_usec = 0;
+      timeout = &tv;
+    }
+    /* Devices that came from the fingerprint cache get checked when
+     * nothing happened for a bit */
+    if (udev_revalidate_pending()) {
+      tv.tv_sec = 0;
+      tv.tv_usec = 500000;
+      timeout = &tv;
+    }
+    /* Don't sleep on automatic assignments that are ready */
+    if (dbus && policy_auto_assign_pending()) {
+      tv.tv_sec = 0;
+      tv.tv_usec = 0;
+      timeout = &tv;
+    }
+
     nfds = dbus_pre_select(nfds, &readfds, &writefds, &exceptfds);
-    ret = select(nfds, &readfds, &writefds, &exceptfds, NULL);
+    ret = select(nfds, &readfds, &writefds, &exceptfds, timeout);
     dbus_post_select(nfds, &readfds, &writefds, &exceptfds);
 
+    /* Rules get matched against the device trees as they are now */
+    udev_tree_refresh();
+
+    /* The replies completed above may have left devices to plug */
+    if (dbus)
+      policy_auto_assign_run();
+
+    if (dbus && policy_reconcile_pending())
+      policy_reconcile();
+
+    if (ret == 0 && udev_revalidate_pending())
+      udev_revalidate();
+
+    /* Before udev, the kernel event has nothing to add after it */
+    if (ret > 0 && ueventfd >= 0 && FD_ISSET(ueventfd, &readfds))
+      uevent_event();
+
     if (ret > 0 && FD_ISSET(udevfd, &readfds))
       udev_event();
 
     if (ret > 0 && FD_ISSET(xsfd, &readfds))
       xenstore_event();
+
+    if (ret > 0 && statefd >= 0 && FD_ISSET(statefd, &readfds))
+      xenstore_state_event();
   }
 
   /* In the future, the while loop may break on critical error,
@@ -30,23 +30,28 @@
 
 rule_t rules;
 
-static bool
-vm_gets_devices_when_in_focus(vm_t *vm)
-{
-  char *obj_path = NULL;
-  gboolean v;
-
-  if (!com_citrix_xenclient_xenmgr_find_vm_by_domid_(g_xcbus, "com.citrix.xenclient.xenmgr", "/", vm->domid, &obj_path))
-    return false;
+static bool reconcile_pending = false; /**< The policy came from the snapshot, check it against the db */
+static bool policy_dirty = false;      /**< The policy changed while the db was unreachable */
+static bool reconcile_in_flight = false; /**< An asynchronous db read is running */
+static unsigned int policy_generation = 1; /**< Bumped every time the policy changes, never 0 */
 
-  if (!property_get_com_citrix_xenclient_xenmgr_vm_usb_auto_passthrough_(g_xcbus, "com.citrix.xenclient.xenmgr", obj_path, &v)) {
-    g_free(obj_path);
-    return false;
+/**
+ * Refresh the local snapshot and write the policy to the database. If
+ * the database is unreachable, policy_reconcile() pushes it later.
+ */
+static void
+policy_persist(void)
+{
+  policy_generation++;
+  snapshot_write(&rules, POLICY_SNAPSHOT_PATH);
+  if (db_write_policy(&rules) != 0) {
+    xd_log(LOG_WARNING, "Failed to write the policy to the database, will retry");
+    policy_dirty = true;
+    reconcile_pending = true;
+    return;
   }
 
-  g_free(obj_path);
-
-  return (v == TRUE) ? true : false;
+  policy_dirty = false;
 }
 
 rule_t*
@@ -81,7 +86,7 @@ policy_remove_rule(uint16_t position)
       list_del(&rule->list);
       xd_log(LOG_INFO, "Removed USB policy rule %d", position);
       policy_free_rule(rule);
-      db_write_policy(&rules);
+      policy_persist();
       return 1;
     }
 
@@ -168,16 +173,6 @@ dump_rules(void)
   printf("-------------------------\n");
 }
 
-static vm_t*
-vm_focused(void)
-{
-  int domid;
-
-  com_citrix_xenclient_input_get_focus_domid_(g_xcbus, INPUT, INPUT_OBJ, &domid);
-
-  return vm_lookup(domid);
-}
-
 static bool
 device_matches_udev_rule(rule_t *rule, device_t *device)
 {
@@ -186,7 +181,7 @@ device_matches_udev_rule(rule_t *rule, device_t *device)
   if (rule->dev_sysattrs != NULL) {
     pairs = rule->dev_sysattrs;
     while (*pairs != NULL) {
-      if (! udev_device_tree_match_sysattr(device->udev,
+      if (! udev_device_tree_match_sysattr(device,
             pairs[0],
             pairs[1]))
         return false;
@@ -198,7 +193,7 @@ device_matches_udev_rule(rule_t *rule, device_t *device)
   if (rule->dev_properties != NULL) {
     pairs = rule->dev_properties;
     while (*pairs != NULL) {
-      if (! udev_device_tree_match_property(device->udev,
+      if (! udev_device_tree_match_property(device,
             pairs[0],
             pairs[1]))
         return false;
@@ -335,7 +330,7 @@ policy_add_rule(rule_t *new_rule)
         new_rule->pos);
   }
 
-  db_write_policy(&rules);
+  policy_persist();
 }
 
 /**
@@ -397,7 +392,7 @@ policy_set_sticky(int dev)
       new_rule->vm_uuid);
   list_add(&new_rule->list, &rules.list);
 
-  db_write_policy(&rules);
+  policy_persist();
 
   return 0;
 }
@@ -427,7 +422,7 @@ policy_unset_sticky(int dev)
   list_del(&rule->list);
   xd_log(LOG_INFO, "Policy %d removed", rule->pos);
   policy_free_rule(rule);
-  db_write_policy(&rules);
+  policy_persist();
 
   return 0;
 }
@@ -445,17 +440,160 @@ policy_get_sticky_uuid(int dev)
 {
   int busid, devid;
   device_t *device;
-  rule_t *rule;
 
   device_make_bus_dev_pair(dev, &busid, &devid);
   device = device_lookup(busid, devid);
   if (device == NULL)
     return NULL;
+
+  return policy_device_sticky_uuid(device);
+}
+
+/**
+ * Same as policy_get_sticky_uuid(), for a device we already have.
+ * Matching a device against the rules can involve its whole udev
+ * subtree, so the result is kept in the device until the policy
+ * changes or the tree gets refreshed.
+ *
+ * @param device The device
+ *
+ * @return The UUID if a sticky rule was found, NULL otherwise
+ */
+char*
+policy_device_sticky_uuid(device_t *device)
+{
+  rule_t *rule;
+
+  if (device->sticky_gen != policy_generation ||
+      device->sticky_tree != udev_tree_get_epoch()) {
+    rule = sticky_lookup(device);
+    device->sticky_uuid = (rule != NULL) ? rule->vm_uuid : NULL;
+    device->sticky_gen = policy_generation;
+    device->sticky_tree = udev_tree_get_epoch();
+  }
+
+  return device->sticky_uuid;
+}
+
+/**
+ * Find the VM a device goes to by policy, going through the sticky
+ * rules then the default rules, like the automatic assignment does.
+ * Not cached, the result follows the current type and tree of the
+ * device.
+ *
+ * @param device The device
+ *
+ * @return The UUID of the VM if a rule was found, NULL otherwise
+ */
+char*
+policy_device_rule_uuid(device_t *device)
+{
+  rule_t *rule;
+
   rule = sticky_lookup(device);
-  if (rule != NULL)
-    return rule->vm_uuid;
-  else
+  if (rule == NULL)
+    rule = default_lookup(device);
+
+  return (rule != NULL) ? rule->vm_uuid : NULL;
+}
+
+/**
+ * Stage all the devices that are always assigned to a VM which domain
+ * just showed up, so the guest finds them while it boots. The actual
+ * assignment still happens in policy_auto_assign_devices_to_new_vm(),
+ * when the toolstack tells us about the VM.
+ *
+ * @param domid The domid of the new domain
+ * @param uuid The UUID of its VM
+ *
+ * @return The number of devices staged
+ */
+int
+policy_prestage_domain(int domid, const char *uuid)
+{
+  struct list_head *pos;
+  device_t *device;
+  rule_t *rule;
+  int n = 0;
+
+  list_for_each(pos, &devices.list) {
+    device = list_entry(pos, device_t, list);
+    if (device->vm != NULL || device_is_ambiguous(device))
+      continue;
+    rule = sticky_lookup(device);
+    if (rule == NULL || rule->vm_uuid == NULL || strcmp(rule->vm_uuid, uuid))
+      continue;
+    if (usbowls_stage_device(domid, device->busid, device->devid,
+                             device->vendorid, device->deviceid) == 0)
+      n++;
+  }
+
+  return n;
+}
+
+/* Check the parts of a rule that don't need udev, NULL serial for none */
+static bool
+ids_match_rule(rule_t *rule, int vendorid, int deviceid, const char *serial)
+{
+  if (rule->dev_vendorid != 0 && vendorid != rule->dev_vendorid)
+    return false;
+  if (rule->dev_deviceid != 0 && deviceid != rule->dev_deviceid)
+    return false;
+  if (rule->dev_serial != NULL &&
+      (serial == NULL || strcmp(rule->dev_serial, serial) != 0))
+    return false;
+
+  return true;
+}
+
+static bool
+rule_needs_udev(rule_t *rule)
+{
+  return (rule->dev_type != 0 || rule->dev_not_type != 0 ||
+          rule->dev_sysattrs != NULL || rule->dev_properties != NULL);
+}
+
+/**
+ * Find out where a device will go before it's classified, when only
+ * its IDs and serial are known. This gives the same answer as
+ * sticky_lookup() then policy_is_allowed() would on the full device,
+ * or nothing if any rule that could decide needs more than the IDs.
+ *
+ * @param vendorid The device vendor ID
+ * @param deviceid The device product ID
+ * @param serial The device serial, or NULL
+ *
+ * @return The UUID of the VM the device is sticky to, or NULL
+ */
+char*
+policy_get_early_sticky_uuid(int vendorid, int deviceid, const char *serial)
+{
+  struct list_head *pos;
+  rule_t *rule, *sticky = NULL;
+
+  list_for_each(pos, &rules.list) {
+    rule = list_entry(pos, rule_t, list);
+    if (rule->cmd == ALWAYS &&
+        ids_match_rule(rule, vendorid, deviceid, serial)) {
+      sticky = rule;
+      break;
+    }
+  }
+  if (sticky == NULL || sticky->vm_uuid == NULL || rule_needs_udev(sticky))
     return NULL;
+
+  /* Any earlier rule that may apply to the device and the VM would
+   * decide policy_is_allowed() first */
+  list_for_each(pos, &rules.list) {
+    rule = list_entry(pos, rule_t, list);
+    if (rule == sticky)
+      break;
+    if (ids_match_rule(rule, vendorid, deviceid, serial) &&
+        (rule->vm_uuid == NULL || !strcmp(rule->vm_uuid, sticky->vm_uuid)))
+      return NULL;
+  }
+
+  return sticky->vm_uuid;
 }
 
 /**
@@ -517,32 +655,35 @@ policy_is_allowed(device_t *device, vm_t *vm, rule_t **rule_ptr)
 }
 
 /**
- * This function should be called when a new device is plugged.
- * It will assign the device to a VM according to policy.
- *
- * @param device A pointer to the device that was just plugged
- *
- * @return 1 if the device didn't get plugged to anything, the result
- *         of usbowls_plug_device otherwise.
+ * State of an automatic assignment, while waiting for xenmgr and input.
+ * The device is referenced by bus/dev ids since it may go away before
+ * the replies come in.
  */
-int
-policy_auto_assign_new_device(device_t *device)
+typedef struct {
+  struct list_head list; /**< Linux-kernel-style list item, once ready */
+  int busid;
+  int devid;
+  int pending;           /**< Number of calls not replied to yet */
+  int focus_domid;       /**< Focused domain, -1 if unknown */
+  int uivm_domid;        /**< UIVM domain, -1 if unknown */
+  bool auto_passthrough; /**< The focused VM gets devices when in focus */
+  cancel_t *cancel;      /**< Cancelled if the device gets unplugged */
+} auto_assign_t;
+
+/** Assignments which replies all came in, run from the main loop */
+static LIST_HEAD(auto_assign_ready);
+
+static void
+auto_assign_finish(auto_assign_t *aa)
 {
+  device_t *device;
   rule_t *rule;
   vm_t *vm = NULL;
-  int uivm;
-  int res = 1;
 
-  if (device == NULL) return 1;
-
-  /* Don't auto assign ambiguous devices */
-  if (device_is_ambiguous(device)) {
-    xd_log(LOG_INFO,
-        "Rejecting automatic assignment of ambiguous device: Bus=%d Dev=%d",
-        device->busid,
-        device->devid);
-    return 1;
-  }
+  device = device_lookup(aa->busid, aa->devid);
+  if (device == NULL || device->vm != NULL || cancel_requested(aa->cancel))
+    /* Unplugged or assigned while we were waiting */
+    return;
 
   /* If there's a sticky/default rule for the device, assign it to the
    * corresponding VM (if it's running). If there's no sticky/default rule
@@ -552,20 +693,18 @@ policy_auto_assign_new_device(device_t *device)
     rule = default_lookup(device);
   if (rule != NULL) {
     vm = vm_lookup_by_uuid(rule->vm_uuid);
-  } else {
-    vm = vm_focused();
-    if (vm != NULL && vm->domid > 0 && !vm_gets_devices_when_in_focus(vm))
+  } else if (aa->focus_domid >= 0) {
+    vm = vm_lookup(aa->focus_domid);
+    if (vm != NULL && vm->domid > 0 && !aa->auto_passthrough)
       vm = NULL;
   }
 
-  property_get_com_citrix_xenclient_xenmgr_vm_domid_(g_xcbus, XENMGR, UIVM_PATH, &uivm);
   if (vm != NULL &&
       vm->domid > 0 &&
-      vm->domid != uivm &&
+      vm->domid != aa->uivm_domid &&
       policy_is_allowed(device, vm, &rule)) {
     device->vm = vm;
-    res = usbowls_plug_device(vm->domid, device->busid, device->devid);
-    if (res != 0)
+    if (usbowls_plug_device(vm->domid, device->busid, device->devid) != 0)
       device->vm = NULL;
     xd_log(LOG_INFO,
         "Automatically assigned device [Bus=%03d, Dev=%03d, VID=%04X, PID=%04X, Serial=%s] to VM [UUID=%s, DomID=%d], according to policy rule %d",
@@ -578,8 +717,157 @@ policy_auto_assign_new_device(device_t *device)
         vm->domid,
         rule->pos);
   }
+}
+
+static void
+auto_assign_reply_done(auto_assign_t *aa)
+{
+  if (--aa->pending > 0)
+    return;
+  /* Plugging blocks, it can't happen from a D-Bus reply */
+  list_add_tail(&aa->list, &auto_assign_ready);
+}
+
+/**
+ * @return true if some automatic assignments are ready to run
+ */
+bool
+policy_auto_assign_pending(void)
+{
+  return !list_empty(&auto_assign_ready);
+}
+
+/**
+ * Plug the devices which automatic assignment got all its replies.
+ * This should be called from the main loop, after D-Bus got processed.
+ */
+void
+policy_auto_assign_run(void)
+{
+  auto_assign_t *aa, *tmp;
+  LIST_HEAD(ready);
+
+  list_splice_init(&auto_assign_ready, &ready);
+  list_for_each_entry_safe(aa, tmp, &ready, list) {
+    list_del(&aa->list);
+    auto_assign_finish(aa);
+    /* Drop the nodes staged from the uevent if the guess was wrong */
+    usbowls_unstage_device(aa->busid, aa->devid);
+    cancel_free(aa->cancel);
+    free(aa);
+  }
+}
+
+static void
+auto_assign_passthrough_reply(DBusMessage *reply, void *opaque)
+{
+  auto_assign_t *aa = opaque;
+
+  async_reply_get_bool(reply, &aa->auto_passthrough);
+  auto_assign_reply_done(aa);
+}
+
+static void
+auto_assign_vm_path_reply(DBusMessage *reply, void *opaque)
+{
+  auto_assign_t *aa = opaque;
+  const char *obj_path;
+
+  if (async_reply_get_string(reply, &obj_path) &&
+      async_get_property(XENMGR, obj_path, XENMGR_VM,
+                         "usb-auto-passthrough",
+                         auto_assign_passthrough_reply, aa) == 0)
+    return;
+  auto_assign_reply_done(aa);
+}
+
+static void
+auto_assign_focus_reply(DBusMessage *reply, void *opaque)
+{
+  auto_assign_t *aa = opaque;
+  dbus_int32_t domid;
+
+  if (async_reply_get_int(reply, &aa->focus_domid) && aa->focus_domid > 0) {
+    /* Chain the auto-passthrough lookup of the focused VM */
+    domid = aa->focus_domid;
+    if (async_call(XENMGR, XENMGR_OBJ, XENMGR, "find_vm_by_domid",
+                   auto_assign_vm_path_reply, aa,
+                   DBUS_TYPE_INT32, &domid,
+                   DBUS_TYPE_INVALID) == 0)
+      return;
+  }
+  auto_assign_reply_done(aa);
+}
 
-  return res;
+static void
+auto_assign_uivm_reply(DBusMessage *reply, void *opaque)
+{
+  auto_assign_t *aa = opaque;
+
+  async_reply_get_int(reply, &aa->uivm_domid);
+  auto_assign_reply_done(aa);
+}
+
+/**
+ * This function should be called when a new device is plugged.
+ * It will assign the device to a VM according to policy.
+ * The focus and the UIVM domid are asked to input and xenmgr
+ * concurrently, without blocking, and the device gets assigned by
+ * policy_auto_assign_run() once both replied.
+ *
+ * @param device A pointer to the device that was just plugged
+ *
+ * @return 0 if the assignment is in progress, 1 if the device won't
+ *         get plugged to anything.
+ */
+int
+policy_auto_assign_new_device(device_t *device)
+{
+  auto_assign_t *aa;
+  rule_t *rule;
+
+  if (device == NULL) return 1;
+
+  /* Don't auto assign ambiguous devices */
+  if (device_is_ambiguous(device)) {
+    xd_log(LOG_INFO,
+        "Rejecting automatic assignment of ambiguous device: Bus=%d Dev=%d",
+        device->busid,
+        device->devid);
+    return 1;
+  }
+
+  aa = malloc(sizeof(auto_assign_t));
+  aa->busid = device->busid;
+  aa->devid = device->devid;
+  aa->pending = 1; /* Released at the end of this function */
+  aa->focus_domid = -1;
+  aa->uivm_domid = -1;
+  aa->auto_passthrough = false;
+  aa->cancel = cancel_new(device->busid, device->devid, NULL);
+
+  /* The focus only matters for devices without a sticky/default rule */
+  rule = sticky_lookup(device);
+  if (rule == NULL)
+    rule = default_lookup(device);
+  if (rule == NULL &&
+      async_call(INPUT, INPUT_OBJ, INPUT, "get_focus_domid",
+                 auto_assign_focus_reply, aa,
+                 DBUS_TYPE_INVALID) == 0)
+    aa->pending++;
+  if (async_get_property(XENMGR, UIVM_PATH, XENMGR_VM, "domid",
+                         auto_assign_uivm_reply, aa) == 0)
+    aa->pending++;
+
+  if (aa->pending == 1) {
+    /* Nothing could be sent, don't guess */
+    cancel_free(aa->cancel);
+    free(aa);
+    return 1;
+  }
+  auto_assign_reply_done(aa);
+
+  return 0;
 }
 
 /**
@@ -596,9 +884,20 @@ policy_auto_assign_devices_to_new_vm(vm_t *vm)
   struct list_head *pos, *device_pos, *tmp;
   rule_t *rule;
   device_t *device;
+  int *bus, *dev;
+  int count = 0;
+  int n = 0;
   int ret = 0;
   int clean = 0;
 
+  /* The devices get plugged all together at the end */
+  list_for_each(device_pos, &devices.list)
+    count++;
+  if (count == 0)
+    return 0;
+  bus = malloc(count * sizeof(int));
+  dev = malloc(count * sizeof(int));
+
   /* For all the ALWAYS and DEFAULT rules that match the VM,
    * assign all devices that match the rule to the VM */
   list_for_each_safe(pos, tmp, &rules.list) {
@@ -635,7 +934,9 @@ policy_auto_assign_devices_to_new_vm(vm_t *vm)
           /* The device is not assigned, as expected, plug it to its VM */
           /* No need to check the policy, ALWAYS implies ALLOW */
           device->vm = vm;
-          ret |= -usbowls_plug_device(vm->domid, device->busid, device->devid);
+          bus[n] = device->busid;
+          dev[n] = device->devid;
+          n++;
           xd_log(LOG_INFO,
               "Automatically assigned device [Bus=%03d, Dev=%03d, VID=%04X, PID=%04X, Serial=%s] to VM [UUID=%s, DomID=%d], according to policy rule %d",
               device->busid,
@@ -654,11 +955,16 @@ policy_auto_assign_devices_to_new_vm(vm_t *vm)
     if (clean == 1) {
       list_del(&rule->list);
       policy_free_rule(rule);
-      db_write_policy(&rules);
+      policy_persist();
       clean = 0;
     }
   }
 
+  if (n > 0)
+    ret |= -usbowls_plug_devices(vm->domid, n, bus, dev, NULL);
+  free(bus);
+  free(dev);
+
   return ret;
 }
 
@@ -746,12 +1052,95 @@ policy_flush_rules(void)
 void
 policy_reload_from_db(void)
 {
+  policy_generation++;
   policy_flush_rules();
-  db_read_policy(&rules);
+  if (db_read_policy(&rules) == 0)
+    snapshot_write(&rules, POLICY_SNAPSHOT_PATH);
 }
 
 /**
- * Initialize the policy bits
+ * Check if the policy still has to be reconciled with the database
+ *
+ * @return true if policy_reconcile() should be called again
+ */
+bool
+policy_reconcile_pending(void)
+{
+  return reconcile_pending;
+}
+
+/* db_read_policy_async() callback for policy_reconcile() */
+static void
+policy_reconcile_read(rule_t *db_rules, int status, void *opaque)
+{
+  unsigned int generation = (unsigned int)(uintptr_t)opaque;
+
+  reconcile_in_flight = false;
+  if (status != 0)
+    /* Not up yet, policy_reconcile() will try again */
+    return;
+  if (policy_dirty || generation != policy_generation)
+    /* The policy changed while we were reading, the local copy wins
+     * and will be pushed by policy_reconcile() */
+    return;
+
+  reconcile_pending = false;
+  if (snapshot_equal(&rules, db_rules)) {
+    xd_log(LOG_INFO, "Policy snapshot matches the database");
+    return;
+  }
+
+  xd_log(LOG_WARNING, "Policy snapshot was stale, using the database policy");
+  policy_generation++;
+  policy_flush_rules();
+  list_splice_init(&db_rules->list, &rules.list);
+  snapshot_write(&rules, POLICY_SNAPSHOT_PATH);
+  dump_rules();
+}
+
+/**
+ * Compare the policy loaded from the snapshot with the one in the
+ * database, once the database is reachable. The database wins, unless
+ * the policy got modified locally in the meantime.
+ * This doesn't block and retries at most once per second, it should be
+ * called from the main loop while policy_reconcile_pending().
+ * The database is read asynchronously, the comparison happens when
+ * the last reply comes in.
+ */
+void
+policy_reconcile(void)
+{
+  static time_t last_try = 0;
+  struct timespec now;
+
+  if (!reconcile_pending || reconcile_in_flight)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec == last_try)
+    return;
+  last_try = now.tv_sec;
+
+  if (policy_dirty) {
+    /* The policy got modified while the db was down, push it */
+    policy_persist();
+    if (!policy_dirty) {
+      xd_log(LOG_INFO, "Local policy changes written to the database");
+      reconcile_pending = false;
+    }
+    return;
+  }
+
+  if (db_read_policy_async(policy_reconcile_read,
+                           (void *)(uintptr_t)policy_generation) == 0)
+    reconcile_in_flight = true;
+}
+
+/**
+ * Initialize the policy bits.
+ * If a local snapshot of the policy exists, it is used right away and
+ * the database is checked later by policy_reconcile(). Otherwise this
+ * waits for the database.
  *
  * @return 0 if everything went fine, -1 if there was an error reading
  * the policy from the database.
@@ -761,8 +1150,15 @@ policy_init(void)
 {
   INIT_LIST_HEAD(&rules.list);
 
-  db_dbus_init(g_xcbus);
-  db_read_policy(&rules);
+  if (snapshot_load(&rules, POLICY_SNAPSHOT_PATH) == 0) {
+    xd_log(LOG_INFO, "Policy loaded from %s", POLICY_SNAPSHOT_PATH);
+    db_dbus_init(g_xcbus, false);
+    reconcile_pending = true;
+  } else {
+    db_dbus_init(g_xcbus, true);
+    if (db_read_policy(&rules) == 0)
+      snapshot_write(&rules, POLICY_SNAPSHOT_PATH);
+  }
   dump_rules();
 
   return 0;
@@ -49,6 +49,9 @@ enum command {
 #define NIC             0x20	/**< Possible NIC device type */
 #define BLUETOOTH       0x40	/**< Bluetooth device type */
 #define AUDIO           0x80	/**< Audio device type */
+#define SMARTCARD       0x100	/**< Smartcard reader device type */
+#define VIDEO           0x200	/**< Video (webcam) device type */
+#define PRINTER         0x400	/**< Printer device type */
 
 /**
  * @brief Policy rule structure
@@ -73,5 +76,6 @@ typedef struct {
 
 char* policy_parse_command_enum(enum command cmd);
 enum command policy_parse_command_string(const char* cmd);
+void policy_free_rule(rule_t *rule);
 
 #endif 	    /* !POLICY_H_ */
@@ -75,8 +75,6 @@
 #include <xenstore.h>
 /* #include <xcxenstore.h> */
 #include <libudev.h>
-#include <usb.h>
-/* #include <libusb-1.0/libusb.h> */
 
 #include "rpcgen/db_client.h"
 #include "rpcgen/input_daemon_client.h"
@@ -87,6 +85,7 @@
 
 #include "policy.h"
 #include "db.h"
+#include "async.h"
 
 #define UUID_LENGTH 37 /**< Length of UUIDs, including the string terminator */
 #define DOM0_DOMID  0  /**< Dom0's domid... */
@@ -98,6 +97,7 @@
 
 #define XENMGR      "com.citrix.xenclient.xenmgr" /**< The dbus name of xenmgr */
 #define XENMGR_OBJ  "/"                           /**< The main dbus object of xenmgr */
+#define XENMGR_VM   "com.citrix.xenclient.xenmgr.vm" /**< The dbus interface of xenmgr VMs */
 
 #define INPUT       "com.citrix.xenclient.input"  /**< The dbus name of input */
 #define INPUT_OBJ   "/"                           /**< The main dbus object of input */
@@ -105,6 +105,10 @@
 #define USBDAEMON   "com.citrix.xenclient.usbdaemon" /**< The dbus name of usb daemon */
 #define USBDAEMON_OBJ "/"                         /**< The main dbus object of usb daemon */
 
+#define POLICY_SNAPSHOT_PATH "/config/vusb-daemon.policy" /**< Local copy of the compiled policy */
+#define CLASSCACHE_PATH "/config/vusb-daemon.classes" /**< Persisted device classification cache */
+#define FPCACHE_PATH    "/config/vusb-daemon.fingerprints" /**< Mapped device fingerprint cache */
+
 /**
  * The (stupid) logging macro
  */
@@ -126,6 +130,18 @@ typedef struct {
   char *uuid;            /**< VM UUID */
 } vm_t;
 
+/**
+ * @brief Snapshot of the udev subtree of a device
+ *
+ * The device itself and all its children, each with a reference held
+ */
+typedef struct {
+  struct udev_device **devs;
+  int count;
+  bool scanned;             /**< False until the subtree got enumerated */
+  unsigned long epoch;      /**< udev_tree_refresh() epoch of the enumeration */
+} udev_children_t;
+
 /**
  * @brief Device structure
  *
@@ -143,12 +159,18 @@ typedef struct {
   char *longname;           /**< Longer name shown nowhere I know of, usually sysattr["manufacturer"] */
   char *sysname;            /**< Name in sysfs */
   struct udev_device *udev; /**< A udev handle to the device, in case we need more info */
+  udev_children_t children; /**< The udev subtree, for rule matching */
   vm_t *vm;                 /**< VM currently using the device, or NULL for dom0 */
   int type;                 /**< Type of the device, can be multiple types OR-ed together. see policy.h */
+  unsigned int sticky_gen;  /**< Policy generation sticky_uuid was computed for, 0 for never */
+  unsigned long sticky_tree; /**< udev_tree_refresh() epoch sticky_uuid was computed for */
+  char *sticky_uuid;        /**< Cached policy_device_sticky_uuid(), points into the policy */
 } device_t;
 
 typedef struct dominfo
 {
+  struct list_head list;    /**< Linux-kernel-style list item, for the cache */
+  int refs;                 /**< References, including the cache's */
   int di_domid;
   char *di_name;
   char *di_dompath;
@@ -163,6 +185,56 @@ typedef struct usbinfo
   int usb_product;
 } usbinfo_t;
 
+/**
+ * Cancellation token for the work on a device, see flap.c
+ */
+typedef struct cancel cancel_t;
+
+/**
+ * Stages of a plug or an unplug, see trace.c
+ */
+enum trace_stage {
+  TRACE_DOMINFO,              /**< xenstore_get_dominfo() */
+  TRACE_USBINFO,              /**< get_usbinfo() */
+  TRACE_CREATE,               /**< xenstore_create_usb() */
+  TRACE_ONLINE,               /**< xenstore_wait_for_online() */
+  TRACE_ASSIGN,               /**< vusb_assign(), either way */
+  TRACE_DESTROY,              /**< xenstore_destroy_usb[s]() */
+  TRACE_STAGES
+};
+
+/**
+ * A traced plug or unplug
+ */
+typedef struct {
+  bool unplug;
+  int domid;
+  int count;                  /**< Devices in the batch */
+  int bus;                    /**< First device of the batch */
+  int dev;
+  int result;
+  struct timespec start;
+  struct timespec mark;       /**< End of the previous stage */
+  unsigned long stage_us[TRACE_STAGES];
+  unsigned long total_us;
+} trace_op_t;
+
+/**
+ * Pipelined XenStore connection, see xspipe.c
+ */
+typedef struct xspipe xspipe_t;
+
+/**
+ * Pipelined XenStore request callback. err is 0 on success or an errno
+ * value, data is the reply payload, NUL-terminated.
+ */
+typedef void (*xspipe_cb_t)(int err, const char *data, unsigned int len, void *opaque);
+
+/**
+ * Fake xenstored write hook, called from its thread, see xsfake.c
+ */
+typedef void (*xsfake_hook_t)(const char *path, const char *value);
+
 enum XenBusStates {
   XB_UNKNOWN, XB_INITTING, XB_INITWAIT, XB_INITTED, XB_CONNECTED,
   XB_CLOSING, XB_CLOSED
@@ -176,28 +248,86 @@ struct udev *udev_handle;    /**< The global udev handle, initialized by udev_in
 extern int usb_backend_domid;
 extern int my_domid;
 
-int   vusb_assign_local(int vendor, int product, int add);
+int   vusb_assign_local(int vendor, int product, int bus, int dev, int add);
+void  vusb_forget_local(int bus, int dev);
 int   usbowls_plug_device(int domid, int bus, int device);
 int   usbowls_unplug_device(int domid, int bus, int device);
+int   usbowls_plug_devices(int domid, int count, const int *bus, const int *device,
+                           int *results);
+int   usbowls_unplug_devices(int domid, int count, const int *bus, const int *device,
+                             int *results);
 int   usbowls_build_usbinfo(int bus, int dev, int vendor, int product, usbinfo_t *ui);
+int   usbowls_stage_device(int domid, int bus, int device, int vendor, int product);
+void  usbowls_unstage_device(int bus, int device);
+void  usbowls_unstage_domain(int domid);
 
 void  rpc_init(void);
 
 int   udev_init(void);
 void  udev_event(void);
+void  udev_settle(cancel_t *cancel);
 void  udev_fill_devices(void);
-int   udev_device_tree_match_sysattr(struct udev_device *dev,
+bool  udev_revalidate_pending(void);
+void  udev_revalidate(void);
+void  udev_index_add(int busid, int devid, int vendorid, int deviceid);
+void  udev_index_del(int busid, int devid);
+int   udev_index_lookup(int busid, int devid, int *vendorid, int *deviceid);
+void  udev_children_scan(struct udev_device *dev, udev_children_t *children);
+void  udev_children_free(udev_children_t *children);
+void  udev_tree_refresh(void);
+unsigned long udev_tree_get_epoch(void);
+void  udev_get_stats(unsigned long *enumerations, unsigned long *devices,
+                     unsigned long *shared);
+int   udev_device_tree_match_sysattr(device_t *device,
     const char *key,
     const char *value);
-int   udev_device_tree_match_property(struct udev_device *dev,
+int   udev_device_tree_match_property(device_t *device,
     const char *key,
     const char *value);
-int   udev_device_tree_match(struct udev_device *dev,
+int   udev_device_tree_match(device_t *device,
     const char *key,
     const char *value,
     int sysattr /* 1 for sysattr, 0 for property*/);
 
-int   libusb_find_more_about_nic(int vendorid, int deviceid);
+int   uevent_init(void);
+void  uevent_event(void);
+
+cancel_t* cancel_new(int busid, int devid, const char *syspath);
+void  cancel_free(cancel_t *cancel);
+bool  cancel_requested(cancel_t *cancel);
+void  cancel_device(int busid, int devid);
+void  flap_configure(int threshold, int holddown);
+void  flap_added(const char *port);
+void  flap_removed(const char *port);
+bool  flap_held(const char *port);
+
+void  trace_begin(trace_op_t *op, bool unplug, int domid, int count, int bus, int dev);
+void  trace_stage(trace_op_t *op, enum trace_stage stage);
+void  trace_end(trace_op_t *op, int result);
+void  trace_stats(unsigned long *plugs, unsigned long *unplugs, unsigned long *last_us);
+char* trace_report(void);
+
+unsigned char* descriptors_read(const char *syspath, size_t *len);
+
+int   classify_device(struct udev_device *dev, udev_children_t *children,
+                      const unsigned char *desc, size_t desc_len, int new,
+                      cancel_t *cancel, bool *complete);
+
+int   classcache_load(const char *path);
+bool  classcache_lookup(int vendorid, int deviceid, int bcd, uint32_t hash,
+                        int *type, char **vendor, char **model);
+void  classcache_add(int vendorid, int deviceid, int bcd, uint32_t hash,
+                     int type, const char *vendor, const char *model);
+void  classcache_stats(unsigned long *hits, unsigned long *misses, int *entries);
+
+int   fpcache_open(const char *path);
+bool  fpcache_lookup(int vendorid, int deviceid, const char *serial,
+                     const char *port, uint32_t hash,
+                     int *type, char **vendor, char **model);
+void  fpcache_store(int vendorid, int deviceid, const char *serial,
+                    const char *port, uint32_t hash,
+                    int type, const char *vendor, const char *model);
+void  fpcache_stats(unsigned long *hits, unsigned long *misses, int *entries);
 
 int   common_del_device(int busnum, int devnum);
 
@@ -222,39 +352,92 @@ int   vm_del(const int domid);
 
 int   xenstore_create_usb(dominfo_t *domp, usbinfo_t *usbp);
 int   xenstore_destroy_usb(dominfo_t *domp, usbinfo_t *usbp);
-int   xenstore_wait_for_online(dominfo_t *di, usbinfo_t *ui);
-int   xenstore_wait_for_offline(dominfo_t *di, usbinfo_t *ui);
+int   xenstore_destroy_usbs(dominfo_t *domp, usbinfo_t *usbp, int count, int *results);
+void  xenstore_wait_deadline(struct timespec *deadline);
+int   xenstore_wait_for_online(dominfo_t *di, usbinfo_t *ui, cancel_t *cancel,
+                               const struct timespec *deadline);
+int   xenstore_wait_for_offline(dominfo_t *di, usbinfo_t *ui,
+                                const struct timespec *deadline);
 char* xenstore_dom_read (unsigned int domid, const char *format, ...);
-int   xenstore_get_dominfo(int domid, dominfo_t *di);
+dominfo_t* xenstore_get_dominfo(int domid);
+void  xenstore_put_dominfo(dominfo_t *di);
+void  xenstore_forget_dominfo(int domid);
 void  xenstore_get_xb_states(dominfo_t *domp, usbinfo_t *usbp, int *frontst, int *backst);
 void  xenstore_list_domain_devs(dominfo_t *domp);
 int   xenstore_init(void);
 void  xenstore_deinit(void);
 int   xenstore_state_handle(void);
+void  xenstore_state_event(void);
+void  xenstore_forget_states(int domid);
+void  xenstore_cache_invalidate(const char *path);
+void  xenstore_cache_stats(unsigned long *hits, unsigned long *misses, int *entries);
 void  xenstore_event(void);
 int   xenstore_new_backend(const int backend_domid);
+int   xenstore_prestage_enable(void);
 int   xsdev_watch_init(void);
 void  xsdev_watch_deinit(void);
 void  xsdev_write(device_t *dev);
+void  xsdev_batch_begin(void);
+void  xsdev_batch_end(void);
 int   xsdev_fill(void);
 void  xsdev_del(device_t *dev);
 
 char *xasprintf(const char *fmt, ...);
+uint32_t fnv1a_hash(const void *data, size_t len);
 extern char *xs_backend_path;
 
 int   policy_init(void);
 void  policy_add_rule(rule_t *rule);
-void  policy_free_rule(rule_t *rule);
 void  policy_list_rules(uint16_t **list, size_t *size);
 rule_t* policy_get_rule(uint16_t position);
 bool  policy_is_allowed(device_t *device, vm_t *vm, rule_t **rule_ptr);
 int   policy_set_sticky(int dev);
 int   policy_unset_sticky(int dev);
 char* policy_get_sticky_uuid(int dev);
+char* policy_device_sticky_uuid(device_t *device);
+char* policy_device_rule_uuid(device_t *device);
+char* policy_get_early_sticky_uuid(int vendorid, int deviceid, const char *serial);
+int   policy_prestage_domain(int domid, const char *uuid);
 int   policy_auto_assign_new_device(device_t *device);
 int   policy_auto_assign_devices_to_new_vm(vm_t *vm);
+bool  policy_auto_assign_pending(void);
+void  policy_auto_assign_run(void);
 void  policy_reload_from_db(void);
 int   policy_remove_rule(uint16_t position);
+bool  policy_reconcile_pending(void);
+void  policy_reconcile(void);
+
+xspipe_t* xspipe_open(const char *path);
+void  xspipe_close(xspipe_t *xp);
+int   xspipe_fileno(xspipe_t *xp);
+int   xspipe_pending(xspipe_t *xp);
+int   xspipe_read(xspipe_t *xp, xs_transaction_t tx, const char *path,
+                  xspipe_cb_t cb, void *opaque);
+int   xspipe_write(xspipe_t *xp, xs_transaction_t tx, const char *path,
+                   const char *value, xspipe_cb_t cb, void *opaque);
+int   xspipe_mkdir(xspipe_t *xp, xs_transaction_t tx, const char *path,
+                   xspipe_cb_t cb, void *opaque);
+int   xspipe_rm(xspipe_t *xp, xs_transaction_t tx, const char *path,
+                xspipe_cb_t cb, void *opaque);
+int   xspipe_set_permissions(xspipe_t *xp, xs_transaction_t tx, const char *path,
+                             struct xs_permissions *perms, unsigned int num_perms,
+                             xspipe_cb_t cb, void *opaque);
+int   xspipe_flush(xspipe_t *xp);
+int   xspipe_process(xspipe_t *xp);
+int   xspipe_wait(xspipe_t *xp);
+xs_transaction_t xspipe_transaction_start(xspipe_t *xp);
+bool  xspipe_transaction_end(xspipe_t *xp, xs_transaction_t tx, bool abort);
+
+int   xsfake_start(const char *path);
+void  xsfake_stop(void);
+void  xsfake_set_hook(xsfake_hook_t hook);
+void  xsfake_write_later(const char *abs, const char *value, int delay_ms);
+unsigned long xsfake_requests(void);
+
+char* snapshot_build(rule_t *rules, size_t *size);
+int   snapshot_write(rule_t *rules, const char *path);
+int   snapshot_load(rule_t *rules, const char *path);
+bool  snapshot_equal(rule_t *a, rule_t *b);
 
 void  usbmanager_device_added(device_t *device);
 void  usbmanager_device_removed(void);
@@ -59,6 +59,17 @@
       G_TYPE_STRING,\
       G_TYPE_INVALID))
 
+#define DBUS_DEVICE_STRUCT (dbus_g_type_get_struct ("GValueArray",\
+      G_TYPE_INT,\
+      G_TYPE_STRING,\
+      G_TYPE_INT,\
+      G_TYPE_STRING,\
+      G_TYPE_STRING,\
+      G_TYPE_INT,\
+      G_TYPE_INT,\
+      G_TYPE_INT,\
+      G_TYPE_INVALID))
+
 static DBusConnection  *g_dbus_conn = NULL;
 static DBusGConnection *g_glib_dbus_conn = NULL;
 
@@ -95,6 +106,7 @@ void rpc_init(void)
     exit(1);
   }
   g_dbus_conn = dbus_g_connection_get_connection(g_glib_dbus_conn);
+  async_init(g_dbus_conn);
   g_xcbus = xcdbus_init2(SERVICE, g_glib_dbus_conn);
   if (!g_xcbus) {
     xd_log(LOG_ERR, "failed to init dbus connection / grab service name");
@@ -563,92 +575,159 @@ gboolean ctxusb_daemon_list_devices(CtxusbDaemonObject *this,
   return TRUE;
 }
 
-gboolean ctxusb_daemon_get_device_info(CtxusbDaemonObject *this,
-                                       gint IN_dev_id, const char* IN_vm_uuid,
-                                       char* *OUT_name, gint *OUT_state, char* *OUT_vm_assigned, char* *OUT_detail, GError **error)
+/**
+ * Figure out the state of a device, from the point of view of a VM
+ *
+ * @param device The device
+ * @param vm_uuid The UUID of the VM asking
+ * @param state Set to one of the DEV_STATE_*
+ *
+ * @return The UUID of the VM the device is assigned to, or always
+ *         assigned to, "" if none. Not to be freed.
+ */
+static const char*
+device_state(device_t *device, const char *vm_uuid, gint *state)
 {
-  struct list_head *pos;
-  device_t *device = NULL;
-  int busid, devid;
+  char *uuid;
 
-  device_make_bus_dev_pair(IN_dev_id, &busid, &devid);
-  list_for_each(pos, &devices.list) {
-    device = list_entry(pos, device_t, list);
-    if (device->busid == busid && device->devid == devid) {
-      break;
-    }
-  }
-  if (device == NULL || device->busid != busid || device->devid != devid) {
-    g_set_error(error,
-                DBUS_GERROR,
-                DBUS_GERROR_FAILED,
-                "Device not found: %d", IN_dev_id);
-    return FALSE;
-  }
-  *OUT_name = g_strdup(device->shortname);
-  /* Figure out the state and assigned VM for the device. Default to unused. */
+  /* Default to unused. */
   /* We could simply output the assigned VM and an always-assign
    * flag, but finding the right DEV_STATE is more fun, here goes... */
+  uuid = policy_device_sticky_uuid(device);
   if (device->vm != NULL) {
     /* The device is currently assigned to a VM */
-    if (!strncmp(device->vm->uuid, IN_vm_uuid, UUID_LENGTH)) {
-      /* The VM is IN_vm_uuid */
-      char *uuid = policy_get_sticky_uuid(IN_dev_id);
-      if (uuid != NULL && !strncmp(uuid, IN_vm_uuid, UUID_LENGTH))
+    if (!strncmp(device->vm->uuid, vm_uuid, UUID_LENGTH)) {
+      /* The VM is vm_uuid */
+      if (uuid != NULL && !strncmp(uuid, vm_uuid, UUID_LENGTH))
         /* And it's always-assigned to it */
-        *OUT_state = DEV_STATE_THIS_ALWAYS;
+        *state = DEV_STATE_THIS_ALWAYS;
       else
         /* But it's not always-assigned to it */
-        *OUT_state = DEV_STATE_THIS;
+        *state = DEV_STATE_THIS;
     } else
-      /* The VM is not IN_vm_uuid */
-      *OUT_state = DEV_STATE_IN_USE;
+      /* The VM is not vm_uuid */
+      *state = DEV_STATE_IN_USE;
     /* Either way, the assigned VM is this */
-    *OUT_vm_assigned = g_strdup(device->vm->uuid);
-  } else {
-    /* The device is not currently assigned to a VM */
-    char *uuid = policy_get_sticky_uuid(IN_dev_id);
-    if (uuid != NULL) {
-      /* But it has an always-assign VM */
-      if (device->type & OPTICAL)
-        /* It's a CD drive */
-        *OUT_state = DEV_STATE_CD_ALWAYS;
-      else {
-        if (!strncmp(uuid, IN_vm_uuid, UUID_LENGTH))
-          /* Which is IN_vm_uuid */
-          *OUT_state = DEV_STATE_ALWAYS_ONLY;
-        else
-          /* Or not */
-          *OUT_state = DEV_STATE_ASSIGNED;
-      }
-      /* Either way, the assigned VM is this */
-      *OUT_vm_assigned = g_strdup(uuid);
-    } else {
-      /* It doesn't have an always-assign VM, it's all free */
-      if (device->type & OPTICAL)
-        /* Unless it's a CD drive */
-        *OUT_state = DEV_STATE_CD_DOM0;
+    return device->vm->uuid;
+  }
+
+  /* The device is not currently assigned to a VM */
+  if (uuid != NULL) {
+    /* But it has an always-assign VM */
+    if (device->type & OPTICAL)
+      /* It's a CD drive */
+      *state = DEV_STATE_CD_ALWAYS;
+    else {
+      if (!strncmp(uuid, vm_uuid, UUID_LENGTH))
+        /* Which is vm_uuid */
+        *state = DEV_STATE_ALWAYS_ONLY;
       else
-        *OUT_state = DEV_STATE_UNUSED;
-      *OUT_vm_assigned = g_strdup("");
+        /* Or not */
+        *state = DEV_STATE_ASSIGNED;
     }
+    /* Either way, the assigned VM is this */
+    return uuid;
   }
+
+  /* It doesn't have an always-assign VM, it's all free */
+  if (device->type & OPTICAL)
+    /* Unless it's a CD drive */
+    *state = DEV_STATE_CD_DOM0;
+  else
+    *state = DEV_STATE_UNUSED;
+
+  return "";
+}
+
+gboolean ctxusb_daemon_get_device_info(CtxusbDaemonObject *this,
+                                       gint IN_dev_id, const char* IN_vm_uuid,
+                                       char* *OUT_name, gint *OUT_state, char* *OUT_vm_assigned, char* *OUT_detail, GError **error)
+{
+  device_t *device;
+  int busid, devid;
+
+  device_make_bus_dev_pair(IN_dev_id, &busid, &devid);
+  device = device_lookup(busid, devid);
+  if (device == NULL) {
+    g_set_error(error,
+                DBUS_GERROR,
+                DBUS_GERROR_FAILED,
+                "Device not found: %d", IN_dev_id);
+    return FALSE;
+  }
+  *OUT_name = g_strdup(device->shortname);
+  *OUT_vm_assigned = g_strdup(device_state(device, IN_vm_uuid, OUT_state));
   *OUT_detail = g_strdup(device->longname);
 
   return TRUE;
 }
 
-gboolean ctxusb_daemon_assign_device(CtxusbDaemonObject *this,
-                                     gint IN_dev_id, const char* IN_vm_uuid, GError **error)
+/**
+ * Everything list_devices and get_device_info would return, for all
+ * the devices, in one call. Each device is a struct of its ID, name,
+ * state, assigned VM, detail, type, vendor ID and product ID.
+ */
+gboolean ctxusb_daemon_list_devices_full(CtxusbDaemonObject *this,
+                                         const char* IN_vm_uuid,
+                                         GPtrArray* *OUT_devices, GError **error)
+{
+  GPtrArray *response;
+  struct list_head *pos;
+  device_t *device;
+  const char *vm_assigned;
+  GValue *value;
+  gint state;
+
+  response = g_ptr_array_new();
+  list_for_each(pos, &devices.list) {
+    device = list_entry(pos, device_t, list);
+    vm_assigned = device_state(device, IN_vm_uuid, &state);
+
+    value = g_new0(GValue, 1);
+    g_value_init(value, DBUS_DEVICE_STRUCT);
+    g_value_take_boxed(value,
+        dbus_g_type_specialized_construct(DBUS_DEVICE_STRUCT));
+    dbus_g_type_struct_set(value,
+        0, device_make_id(device->busid, device->devid),
+        1, device->shortname,
+        2, state,
+        3, vm_assigned,
+        4, device->longname,
+        5, device->type,
+        6, device->vendorid,
+        7, device->deviceid,
+        G_MAXUINT);
+    g_ptr_array_add(response, g_value_get_boxed(value));
+
+    g_free(value);
+  }
+  *OUT_devices = response;
+
+  return TRUE;
+}
+
+/**
+ * Check that a device can be assigned to a VM
+ *
+ * @param dev_id The device ID
+ * @param vm_uuid The UUID of the VM
+ * @param devicep Set to the device
+ * @param vmp Set to the VM
+ * @param error Set if the device can't be assigned
+ *
+ * @return TRUE if the device can be assigned, FALSE otherwise
+ */
+static gboolean
+assign_check(gint dev_id, const char *vm_uuid,
+             device_t **devicep, vm_t **vmp, GError **error)
 {
   struct list_head *pos;
   device_t *device = NULL;
   vm_t *vm = NULL;
   char *sticky_uuid;
   int busid, devid;
-  int ret;
 
-  device_make_bus_dev_pair(IN_dev_id, &busid, &devid);
+  device_make_bus_dev_pair(dev_id, &busid, &devid);
   list_for_each(pos, &devices.list) {
     device = list_entry(pos, device_t, list);
     if (device->busid == busid && device->devid == devid) {
@@ -657,7 +736,7 @@ gboolean ctxusb_daemon_assign_device(CtxusbDaemonObject *this,
   }
   list_for_each(pos, &vms.list) {
     vm = list_entry(pos, vm_t, list);
-    if (!strncmp(vm->uuid, IN_vm_uuid, UUID_LENGTH)) {
+    if (!strncmp(vm->uuid, vm_uuid, UUID_LENGTH)) {
       break;
     }
   }
@@ -666,36 +745,36 @@ gboolean ctxusb_daemon_assign_device(CtxusbDaemonObject *this,
     g_set_error(error,
                 DBUS_GERROR,
                 DBUS_GERROR_FAILED,
-                "Device not found: %d", IN_dev_id);
+                "Device not found: %d", dev_id);
     return FALSE;
   }
-  if (vm == NULL || strncmp(vm->uuid, IN_vm_uuid, UUID_LENGTH)) {
+  if (vm == NULL || strncmp(vm->uuid, vm_uuid, UUID_LENGTH)) {
     g_set_error(error,
                 DBUS_GERROR,
                 DBUS_GERROR_FAILED,
-                "VM not found: %s", IN_vm_uuid);
+                "VM not found: %s", vm_uuid);
     return FALSE;
   }
   if (vm->domid < 0) {
     g_set_error(error,
                 DBUS_GERROR,
                 DBUS_GERROR_FAILED,
-                "Can't assign device %d to stopped VM %s", IN_dev_id, IN_vm_uuid);
+                "Can't assign device %d to stopped VM %s", dev_id, vm_uuid);
     return FALSE;
   }
   if (device->vm != NULL) {
     g_set_error(error,
                 DBUS_GERROR,
                 DBUS_GERROR_FAILED,
-                "Device %d is already assigned to a VM", IN_dev_id);
+                "Device %d is already assigned to a VM", dev_id);
     return FALSE;
   }
-  sticky_uuid = policy_get_sticky_uuid(IN_dev_id);
+  sticky_uuid = policy_get_sticky_uuid(dev_id);
   if (sticky_uuid != NULL && strcmp(vm->uuid, sticky_uuid)) {
     g_set_error(error,
                 DBUS_GERROR,
                 DBUS_GERROR_FAILED,
-                "Device %d is set to be always assigned to another VM", IN_dev_id);
+                "Device %d is set to be always assigned to another VM", dev_id);
     return FALSE;
   }
   if (!policy_is_allowed(device, vm, NULL)) {
@@ -707,10 +786,53 @@ gboolean ctxusb_daemon_assign_device(CtxusbDaemonObject *this,
     g_set_error(error,
                 DBUS_GERROR,
                 DBUS_GERROR_FAILED,
-                "The policy denied assignment of device %d to VM %s", IN_dev_id, IN_vm_uuid);
+                "The policy denied assignment of device %d to VM %s", dev_id, vm_uuid);
     return FALSE;
   }
 
+  *devicep = device;
+  *vmp = vm;
+
+  return TRUE;
+}
+
+static void
+log_plugged(device_t *device, vm_t *vm)
+{
+  xd_log(LOG_INFO,
+      "Device [Bus=%03d, Dev=%03d, VID=%04X, PID=%04X] plugged into VM [UUID=%s, DomID=%d]",
+      device->busid,
+      device->devid,
+      device->vendorid,
+      device->deviceid,
+      vm->uuid,
+      vm->domid);
+}
+
+static void
+log_unplugged(device_t *device)
+{
+  xd_log(LOG_INFO,
+      "Device [Bus=%03d, Dev=%03d, VID=%04X, PID=%04X, Serial=%s] unplugged from VM [UUID=%s, DomID=%d]",
+      device->busid,
+      device->devid,
+      device->vendorid,
+      device->deviceid,
+      device->serial,
+      device->vm->uuid,
+      device->vm->domid);
+}
+
+gboolean ctxusb_daemon_assign_device(CtxusbDaemonObject *this,
+                                     gint IN_dev_id, const char* IN_vm_uuid, GError **error)
+{
+  device_t *device;
+  vm_t *vm;
+  int ret;
+
+  if (!assign_check(IN_dev_id, IN_vm_uuid, &device, &vm, error))
+    return FALSE;
+
   device->vm = vm;
   ret = usbowls_plug_device(vm->domid, device->busid, device->devid);
   if (ret != 0) {
@@ -722,27 +844,87 @@ gboolean ctxusb_daemon_assign_device(CtxusbDaemonObject *this,
     return FALSE;
   }
 
-  xd_log(LOG_INFO,
-      "Device [Bus=%03d, Dev=%03d, VID=%04X, PID=%04X] plugged into VM [UUID=%s, DomID=%d]",
-      device->busid,
-      device->devid,
-      device->vendorid,
-      device->deviceid,
-      vm->uuid,
-      vm->domid);
+  log_plugged(device, vm);
   return TRUE;
 }
 
-gboolean ctxusb_daemon_unassign_device(CtxusbDaemonObject *this,
-                                       gint IN_dev_id, GError **error)
+/**
+ * Assign multiple devices to a VM. All the devices get checked first,
+ * then the ones that passed get plugged together, which is a lot
+ * faster than one assign_device call per device.
+ *
+ * OUT_results has one entry per device, in order: an empty string if
+ * the device got assigned, the reason why it didn't otherwise.
+ */
+gboolean ctxusb_daemon_assign_devices(CtxusbDaemonObject *this,
+                                      GArray* IN_dev_ids, const char* IN_vm_uuid,
+                                      char** *OUT_results, GError **error)
+{
+  device_t **devs;
+  vm_t *vm = NULL, *dvm;
+  char **results;
+  int *bus, *dev, *res;
+  GError *err;
+  int count = IN_dev_ids->len;
+  int n = 0;
+  int i, j;
+
+  results = g_new0(char *, count + 1);
+  devs = calloc(count, sizeof(device_t *));
+  bus = calloc(count, sizeof(int));
+  dev = calloc(count, sizeof(int));
+  res = calloc(count, sizeof(int));
+
+  for (i = 0; i < count; ++i) {
+    err = NULL;
+    if (!assign_check(g_array_index(IN_dev_ids, gint, i), IN_vm_uuid,
+                      &devs[i], &dvm, &err)) {
+      results[i] = g_strdup(err->message);
+      g_error_free(err);
+      devs[i] = NULL;
+      continue;
+    }
+    vm = dvm;
+    devs[i]->vm = vm;
+    bus[n] = devs[i]->busid;
+    dev[n] = devs[i]->devid;
+    n++;
+  }
+
+  if (n > 0)
+    usbowls_plug_devices(vm->domid, n, bus, dev, res);
+
+  for (i = 0, j = 0; i < count; ++i) {
+    if (devs[i] == NULL)
+      continue;
+    if (res[j++] != 0) {
+      results[i] = g_strdup_printf("Failed to plug device %d-%d to VM %d",
+                                   devs[i]->busid, devs[i]->devid, vm->domid);
+      devs[i]->vm = NULL;
+    } else {
+      results[i] = g_strdup("");
+      log_plugged(devs[i], vm);
+    }
+  }
+
+  free(res);
+  free(dev);
+  free(bus);
+  free(devs);
+  *OUT_results = results;
+
+  return TRUE;
+}
+
+/* Find an assigned device, for unassignment */
+static gboolean
+unassign_check(gint dev_id, device_t **devicep, GError **error)
 {
   struct list_head *pos;
   device_t *device = NULL;
   int busid, devid;
-  int res;
-  gboolean ret = TRUE;
 
-  device_make_bus_dev_pair(IN_dev_id, &busid, &devid);
+  device_make_bus_dev_pair(dev_id, &busid, &devid);
   list_for_each(pos, &devices.list) {
     device = list_entry(pos, device_t, list);
     if (device->busid == busid && device->devid == devid) {
@@ -753,7 +935,7 @@ gboolean ctxusb_daemon_unassign_device(CtxusbDaemonObject *this,
     g_set_error(error,
                 DBUS_GERROR,
                 DBUS_GERROR_FAILED,
-                "Device not found: %d", IN_dev_id);
+                "Device not found: %d", dev_id);
     return FALSE;
   }
 
@@ -761,9 +943,25 @@ gboolean ctxusb_daemon_unassign_device(CtxusbDaemonObject *this,
     g_set_error(error,
                 DBUS_GERROR,
                 DBUS_GERROR_FAILED,
-                "Device %d is not currently assigned to a VM, can't unassign", IN_dev_id);
+                "Device %d is not currently assigned to a VM, can't unassign", dev_id);
     return FALSE;
   }
+
+  *devicep = device;
+
+  return TRUE;
+}
+
+gboolean ctxusb_daemon_unassign_device(CtxusbDaemonObject *this,
+                                       gint IN_dev_id, GError **error)
+{
+  device_t *device;
+  int res;
+  gboolean ret = TRUE;
+
+  if (!unassign_check(IN_dev_id, &device, error))
+    return FALSE;
+
   res = usbowls_unplug_device(device->vm->domid, device->busid, device->devid);
   if (res != 0) {
     g_set_error(error,
@@ -772,21 +970,104 @@ gboolean ctxusb_daemon_unassign_device(CtxusbDaemonObject *this,
                 "Failed to gracefully unplug device %d-%d from VM %d", device->busid, device->devid, device->vm->domid);
     ret = FALSE;
   }
-  xd_log(LOG_INFO,
-      "Device [Bus=%03d, Dev=%03d, VID=%04X, PID=%04X, Serial=%s] unplugged from VM [UUID=%s, DomID=%d]",
-      device->busid,
-      device->devid,
-      device->vendorid,
-      device->deviceid,
-      device->serial,
-      device->vm->uuid,
-      device->vm->domid);
+  log_unplugged(device);
 
   device->vm = NULL;
 
   return ret;
 }
 
+/**
+ * Unassign multiple devices, from whatever VMs they're assigned to.
+ * The devices of each VM get unplugged together.
+ *
+ * OUT_results has one entry per device, in order: an empty string if
+ * the device got unassigned cleanly, the reason why not otherwise.
+ * Like with unassign_device, a device that didn't unplug gracefully
+ * still ends up unassigned.
+ */
+gboolean ctxusb_daemon_unassign_devices(CtxusbDaemonObject *this,
+                                        GArray* IN_dev_ids,
+                                        char** *OUT_results, GError **error)
+{
+  device_t **devs;
+  vm_t *vm;
+  char **results;
+  int *bus, *dev, *res, *idx;
+  GError *err;
+  int count = IN_dev_ids->len;
+  int n;
+  int i, j;
+
+  results = g_new0(char *, count + 1);
+  devs = calloc(count, sizeof(device_t *));
+  bus = calloc(count, sizeof(int));
+  dev = calloc(count, sizeof(int));
+  res = calloc(count, sizeof(int));
+  idx = calloc(count, sizeof(int));
+
+  for (i = 0; i < count; ++i) {
+    err = NULL;
+    if (!unassign_check(g_array_index(IN_dev_ids, gint, i), &devs[i], &err)) {
+      results[i] = g_strdup(err->message);
+      g_error_free(err);
+      devs[i] = NULL;
+      continue;
+    }
+    /* Listed twice? Only unplug it once */
+    for (j = 0; j < i; ++j) {
+      if (devs[j] == devs[i]) {
+        devs[i] = NULL;
+        break;
+      }
+    }
+  }
+
+  /* One batch per VM */
+  for (i = 0; i < count; ++i) {
+    if (devs[i] == NULL || results[i] != NULL)
+      continue;
+    vm = devs[i]->vm;
+    n = 0;
+    for (j = i; j < count; ++j) {
+      if (devs[j] == NULL || results[j] != NULL || devs[j]->vm != vm)
+        continue;
+      idx[n] = j;
+      bus[n] = devs[j]->busid;
+      dev[n] = devs[j]->devid;
+      n++;
+    }
+    usbowls_unplug_devices(vm->domid, n, bus, dev, res);
+    for (j = 0; j < n; ++j) {
+      device_t *device = devs[idx[j]];
+
+      if (res[j] != 0)
+        results[idx[j]] = g_strdup_printf("Failed to gracefully unplug device %d-%d from VM %d",
+                                          device->busid, device->devid, vm->domid);
+      else
+        results[idx[j]] = g_strdup("");
+      log_unplugged(device);
+      device->vm = NULL;
+    }
+  }
+
+  /* Whatever was listed twice */
+  for (i = 0; i < count; ++i) {
+    if (results[i] == NULL)
+      results[i] = g_strdup_printf("Device %d is not currently assigned to a VM, can't unassign",
+                                   g_array_index(IN_dev_ids, gint, i));
+  }
+
+  free(idx);
+  free(res);
+  free(dev);
+  free(bus);
+  free(devs);
+  *OUT_results = results;
+
+  return TRUE;
+}
+
 gboolean ctxusb_daemon_set_sticky(CtxusbDaemonObject *this,
                                   gint IN_dev_id, gint IN_sticky, GError **error)
 {
@@ -850,6 +1131,10 @@ gboolean ctxusb_daemon_state(CtxusbDaemonObject *this,
   int vm_count = 0;
   device_t *device;
   int device_count = 0;
+  unsigned long hits, misses;
+  unsigned long enumerations, opened, shared;
+  unsigned long plugs, unplugs, last_us;
+  int entries;
 
   l = add_to_string(OUT_state, l, "vusb-daemon state:");
   list_for_each(pos, &vms.list) {
@@ -879,12 +1164,43 @@ gboolean ctxusb_daemon_state(CtxusbDaemonObject *this,
     else
       l = add_to_string(OUT_state, l, "      Not assigned to any VM");
   }
+  xenstore_cache_stats(&hits, &misses, &entries);
+  l = add_to_string(OUT_state, l, "  XenStore cache: %d entries, %lu hits, %lu misses",
+                    entries, hits, misses);
+  classcache_stats(&hits, &misses, &entries);
+  l = add_to_string(OUT_state, l, "  Classification cache: %d entries, %lu hits, %lu misses",
+                    entries, hits, misses);
+  fpcache_stats(&hits, &misses, &entries);
+  l = add_to_string(OUT_state, l, "  Fingerprint cache: %d entries, %lu hits, %lu misses",
+                    entries, hits, misses);
+  udev_get_stats(&enumerations, &opened, &shared);
+  l = add_to_string(OUT_state, l, "  udev children: %lu enumerations, %lu devices opened, %lu lookups from snapshots",
+                    enumerations, opened, shared);
+  trace_stats(&plugs, &unplugs, &last_us);
+  l = add_to_string(OUT_state, l, "  Plug tracing: %lu plugs, %lu unplugs, last took %lu us (see get_plug_traces)",
+                    plugs, unplugs, last_us);
   /* Remove last \n */
   (*OUT_state)[l - 1] = '\0';
 
   return TRUE;
 }
 
+/**
+ * Dump the per-stage timings of the recent plugs and unplugs, and the
+ * per-VM histograms, see trace.c
+ */
+gboolean ctxusb_daemon_get_plug_traces(CtxusbDaemonObject *this,
+                                       char **OUT_traces, GError **error)
+{
+  char *report;
+
+  report = trace_report();
+  *OUT_traces = g_strdup(report);
+  free(report);
+
+  return TRUE;
+}
+
 gboolean ctxusb_daemon_reload_policy(CtxusbDaemonObject *this, GError** error)
 {
   policy_reload_from_db();
@@ -0,0 +1,383 @@
+/*
+ * Copyright (c) 2026 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   snapshot.c
+ * @date   Sun Oct 18 10:12:41 2026
+ *
+ * @brief  On-disk policy snapshot
+ *
+ * Functions to dump the compiled policy to a compact binary file and
+ * to load it back, so that devices can be evaluated at startup before
+ * the database daemon is reachable.
+ *
+ * The file is a header, followed by one fixed-size record per rule,
+ * followed by a table of NUL-terminated strings referenced by offset
+ * from the records. It is written in native byte order, it's a local
+ * cache, not an exchange format.
+ */
+
+#include "project.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_MAGIC   "VUSBPOL"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_NONE    0xFFFFFFFF /**< String offset meaning "not set" */
+
+typedef struct {
+  char     magic[8];     /**< SNAPSHOT_MAGIC, NUL-terminated */
+  uint32_t version;      /**< SNAPSHOT_VERSION */
+  uint32_t count;        /**< Number of rule records */
+  uint32_t size;         /**< Total size of the file */
+  uint32_t strings;      /**< Offset of the string table */
+  uint32_t checksum;     /**< FNV-1a of everything after the header */
+  uint32_t reserved;
+} snapshot_header_t;
+
+typedef struct {
+  uint16_t pos;
+  uint8_t  cmd;
+  uint8_t  pad;
+  int32_t  dev_type;
+  int32_t  dev_not_type;
+  uint16_t dev_vendorid;
+  uint16_t dev_deviceid;
+  uint32_t desc;         /**< String offsets, or SNAPSHOT_NONE */
+  uint32_t dev_serial;
+  uint32_t vm_uuid;
+  uint32_t sysattrs;     /**< Offset of the first key, pairs are consecutive */
+  uint32_t n_sysattrs;
+  uint32_t properties;
+  uint32_t n_properties;
+} snapshot_rule_t;
+
+typedef struct {
+  char   *buf;
+  size_t  len;
+  size_t  size;
+} snapshot_buf_t;
+
+static void
+buf_reserve(snapshot_buf_t *b, size_t len)
+{
+  if (b->len + len <= b->size)
+    return;
+  while (b->len + len > b->size)
+    b->size = b->size ? b->size * 2 : 1024;
+  b->buf = realloc(b->buf, b->size);
+}
+
+static uint32_t
+buf_add_string(snapshot_buf_t *b, const char *s)
+{
+  size_t len;
+  uint32_t off;
+
+  if (s == NULL)
+    return SNAPSHOT_NONE;
+
+  len = strlen(s) + 1;
+  buf_reserve(b, len);
+  off = b->len;
+  memcpy(b->buf + b->len, s, len);
+  b->len += len;
+
+  return off;
+}
+
+static uint32_t
+buf_add_pairs(snapshot_buf_t *b, char **pairs, uint32_t *count)
+{
+  uint32_t off = b->len;
+
+  *count = 0;
+  if (pairs == NULL)
+    return SNAPSHOT_NONE;
+  while (pairs[0] != NULL && pairs[1] != NULL) {
+    buf_add_string(b, pairs[0]);
+    buf_add_string(b, pairs[1]);
+    (*count)++;
+    pairs += 2;
+  }
+
+  return off;
+}
+
+/**
+ * Serialize a list of rules to the snapshot format.
+ * The caller is responsible for freeing the returned buffer.
+ *
+ * @param rules The list of rules to serialize
+ * @param size Set to the size of the returned buffer
+ *
+ * @return The snapshot
+ */
+char*
+snapshot_build(rule_t *rules, size_t *size)
+{
+  snapshot_buf_t records = { NULL, 0, 0 };
+  snapshot_buf_t strings = { NULL, 0, 0 };
+  snapshot_header_t header;
+  struct list_head *pos;
+  rule_t *rule;
+  char *res;
+
+  memset(&header, 0, sizeof(header));
+  strcpy(header.magic, SNAPSHOT_MAGIC);
+  header.version = SNAPSHOT_VERSION;
+
+  list_for_each(pos, &rules->list) {
+    snapshot_rule_t r;
+
+    rule = list_entry(pos, rule_t, list);
+    memset(&r, 0, sizeof(r));
+    r.pos = rule->pos;
+    r.cmd = rule->cmd;
+    r.dev_type = rule->dev_type;
+    r.dev_not_type = rule->dev_not_type;
+    r.dev_vendorid = rule->dev_vendorid;
+    r.dev_deviceid = rule->dev_deviceid;
+    r.desc = buf_add_string(&strings, rule->desc);
+    r.dev_serial = buf_add_string(&strings, rule->dev_serial);
+    r.vm_uuid = buf_add_string(&strings, rule->vm_uuid);
+    r.sysattrs = buf_add_pairs(&strings, rule->dev_sysattrs, &r.n_sysattrs);
+    r.properties = buf_add_pairs(&strings, rule->dev_properties, &r.n_properties);
+    buf_reserve(&records, sizeof(r));
+    memcpy(records.buf + records.len, &r, sizeof(r));
+    records.len += sizeof(r);
+    header.count++;
+  }
+
+  header.strings = sizeof(header) + records.len;
+  header.size = header.strings + strings.len;
+  res = malloc(header.size);
+  memcpy(res + sizeof(header), records.buf, records.len);
+  memcpy(res + header.strings, strings.buf, strings.len);
+  header.checksum = fnv1a_hash(res + sizeof(header),
+                               header.size - sizeof(header));
+  memcpy(res, &header, sizeof(header));
+  free(records.buf);
+  free(strings.buf);
+  *size = header.size;
+
+  return res;
+}
+
+/**
+ * Atomically write the snapshot of a list of rules to a file
+ *
+ * @param rules The list of rules to write
+ * @param path The snapshot file
+ *
+ * @return 0 on success, -1 on failure
+ */
+int
+snapshot_write(rule_t *rules, const char *path)
+{
+  char tmp[256];
+  char *data;
+  size_t size, done = 0;
+  ssize_t n;
+  int fd;
+  int ret = -1;
+
+  data = snapshot_build(rules, &size);
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) {
+    xd_log(LOG_ERR, "Failed to create policy snapshot %s", tmp);
+    free(data);
+    return -1;
+  }
+  while (done < size) {
+    n = write(fd, data + done, size - done);
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  if (done == size && fsync(fd) == 0)
+    ret = 0;
+  close(fd);
+  free(data);
+
+  if (ret == 0 && rename(tmp, path) != 0)
+    ret = -1;
+  if (ret != 0) {
+    xd_log(LOG_ERR, "Failed to write policy snapshot %s", path);
+    unlink(tmp);
+  }
+
+  return ret;
+}
+
+/* Return the string at offset off, or NULL if it's not set or invalid */
+static char*
+snapshot_string(const char *data, const snapshot_header_t *header,
+                uint32_t off, bool *valid)
+{
+  const char *s;
+
+  if (off == SNAPSHOT_NONE)
+    return NULL;
+  if (off >= header->size - header->strings) {
+    *valid = false;
+    return NULL;
+  }
+  s = data + header->strings + off;
+  if (memchr(s, '\0', header->size - header->strings - off) == NULL) {
+    *valid = false;
+    return NULL;
+  }
+
+  return strdup(s);
+}
+
+static char**
+snapshot_pairs(const char *data, const snapshot_header_t *header,
+               uint32_t off, uint32_t count, bool *valid)
+{
+  char **res;
+  uint32_t i;
+
+  if (off == SNAPSHOT_NONE || count == 0)
+    return NULL;
+  if (count > (header->size - header->strings) / 2) {
+    *valid = false;
+    return NULL;
+  }
+
+  res = calloc(2 * count + 1, sizeof(char*));
+  for (i = 0; i < 2 * count && *valid; ++i) {
+    res[i] = snapshot_string(data, header, off, valid);
+    if (res[i] != NULL)
+      off += strlen(res[i]) + 1;
+    else
+      *valid = false;
+  }
+
+  return res;
+}
+
+/**
+ * Load the rules from a snapshot file and append them to a list
+ *
+ * @param rules The (empty) list of rules to fill
+ * @param path The snapshot file
+ *
+ * @return 0 on success, -1 if the file is missing or invalid, in
+ *         which case the list is left untouched
+ */
+int
+snapshot_load(rule_t *rules, const char *path)
+{
+  const snapshot_header_t *header;
+  const snapshot_rule_t *records;
+  struct list_head loaded;
+  struct stat st;
+  char *data;
+  bool valid = true;
+  uint32_t i;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return -1;
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(snapshot_header_t)) {
+    close(fd);
+    return -1;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return -1;
+
+  header = (const snapshot_header_t *)data;
+  if (strncmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) ||
+      header->version != SNAPSHOT_VERSION ||
+      header->size != st.st_size ||
+      header->strings != sizeof(*header) + header->count * sizeof(snapshot_rule_t) ||
+      header->strings > header->size ||
+      header->checksum != fnv1a_hash(data + sizeof(*header),
+                                     header->size - sizeof(*header))) {
+    xd_log(LOG_WARNING, "Ignoring invalid policy snapshot %s", path);
+    munmap(data, st.st_size);
+    return -1;
+  }
+
+  INIT_LIST_HEAD(&loaded);
+  records = (const snapshot_rule_t *)(data + sizeof(*header));
+  for (i = 0; i < header->count && valid; ++i) {
+    const snapshot_rule_t *r = &records[i];
+    rule_t *rule;
+
+    rule = malloc(sizeof(rule_t));
+    memset(rule, 0, sizeof(rule_t));
+    rule->pos = r->pos;
+    rule->cmd = (r->cmd <= UNKNOWN) ? r->cmd : UNKNOWN;
+    rule->dev_type = r->dev_type;
+    rule->dev_not_type = r->dev_not_type;
+    rule->dev_vendorid = r->dev_vendorid;
+    rule->dev_deviceid = r->dev_deviceid;
+    rule->desc = snapshot_string(data, header, r->desc, &valid);
+    rule->dev_serial = snapshot_string(data, header, r->dev_serial, &valid);
+    rule->vm_uuid = snapshot_string(data, header, r->vm_uuid, &valid);
+    rule->dev_sysattrs = snapshot_pairs(data, header, r->sysattrs,
+                                        r->n_sysattrs, &valid);
+    rule->dev_properties = snapshot_pairs(data, header, r->properties,
+                                          r->n_properties, &valid);
+    list_add_tail(&rule->list, &loaded);
+  }
+  munmap(data, st.st_size);
+
+  if (!valid) {
+    struct list_head *pos, *tmp;
+
+    xd_log(LOG_WARNING, "Ignoring corrupted policy snapshot %s", path);
+    list_for_each_safe(pos, tmp, &loaded) {
+      list_del(pos);
+      policy_free_rule(list_entry(pos, rule_t, list));
+    }
+    return -1;
+  }
+
+  list_splice(&loaded, rules->list.prev);
+
+  return 0;
+}
+
+/**
+ * Check if two lists of rules would produce the same snapshot
+ *
+ * @return true if the policies are identical, false otherwise
+ */
+bool
+snapshot_equal(rule_t *a, rule_t *b)
+{
+  char *da, *db;
+  size_t sa, sb;
+  bool res;
+
+  da = snapshot_build(a, &sa);
+  db = snapshot_build(b, &sb);
+  res = (sa == sb && !memcmp(da, db, sa));
+  free(da);
+  free(db);
+
+  return res;
+}
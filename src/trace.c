@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2026 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   trace.c
+ * @date   Wed Oct 21 11:46:19 2026
+ *
+ * @brief  Plug/unplug latency tracing
+ *
+ * Every plug and unplug gets its time split in stages (domain info,
+ * device info, node creation, frontend/backend handshake, vusb
+ * assignment, node removal), on the monotonic clock. The last
+ * operations are kept in a ring, and every stage feeds a per-VM log2
+ * histogram, so a slow frontend or a slow xenstored shows up as the
+ * stage where the time goes.
+ */
+
+#include "project.h"
+
+#define TRACE_RING    64 /**< Operations kept for the report */
+#define TRACE_BUCKETS 24 /**< Bucket b counts [2^b, 2^(b+1)) us, the last one is open */
+
+static const char *trace_stage_names[TRACE_STAGES] = {
+  "dominfo", "usbinfo", "create", "online", "assign", "destroy"
+};
+
+/**
+ * Histograms of a VM, kept by UUID so they survive reboots
+ */
+typedef struct {
+  struct list_head list;
+  char *uuid;                 /**< VM UUID, or "domain-N" if unknown */
+  unsigned long ops[2];       /**< Plugs, unplugs */
+  unsigned int hist[2][TRACE_STAGES + 1][TRACE_BUCKETS]; /**< The last stage is the total */
+} trace_vm_t;
+
+static trace_op_t trace_ring[TRACE_RING];
+static unsigned long trace_count = 0;
+static LIST_HEAD(trace_vms);
+
+static unsigned long
+trace_elapsed_us(const struct timespec *from, const struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) * 1000000UL +
+    (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static int
+trace_bucket(unsigned long us)
+{
+  int b = 0;
+
+  while (us > 1 && b < TRACE_BUCKETS - 1) {
+    us >>= 1;
+    b++;
+  }
+
+  return b;
+}
+
+static trace_vm_t*
+trace_vm_get(int domid)
+{
+  trace_vm_t *tv;
+  char name[UUID_LENGTH + 8];
+  vm_t *vm;
+
+  vm = vm_lookup(domid);
+  if (vm != NULL)
+    snprintf(name, sizeof(name), "%s", vm->uuid);
+  else
+    snprintf(name, sizeof(name), "domain-%d", domid);
+
+  list_for_each_entry(tv, &trace_vms, list) {
+    if (!strcmp(tv->uuid, name))
+      return tv;
+  }
+
+  tv = calloc(1, sizeof(trace_vm_t));
+  tv->uuid = strdup(name);
+  list_add_tail(&tv->list, &trace_vms);
+
+  return tv;
+}
+
+/**
+ * Start timing an operation
+ *
+ * @param op The operation, usually on the stack
+ * @param unplug True for an unplug, false for a plug
+ * @param domid The VM the devices get plugged to or unplugged from
+ * @param count The number of devices in the operation
+ * @param bus The bus ID of the first device
+ * @param dev The device ID of the first device
+ */
+void
+trace_begin(trace_op_t *op, bool unplug, int domid, int count, int bus, int dev)
+{
+  memset(op, 0, sizeof(trace_op_t));
+  op->unplug = unplug;
+  op->domid = domid;
+  op->count = count;
+  op->bus = bus;
+  op->dev = dev;
+  clock_gettime(CLOCK_MONOTONIC, &op->start);
+  op->mark = op->start;
+}
+
+/**
+ * Charge the time elapsed since the previous stage to a stage. Stages
+ * run for every device of a batch add up.
+ */
+void
+trace_stage(trace_op_t *op, enum trace_stage stage)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  op->stage_us[stage] += trace_elapsed_us(&op->mark, &now);
+  op->mark = now;
+}
+
+/**
+ * Finish timing an operation, and record it
+ *
+ * @param op The operation
+ * @param result 0 if all went well
+ */
+void
+trace_end(trace_op_t *op, int result)
+{
+  struct timespec now;
+  trace_vm_t *tv;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  op->total_us = trace_elapsed_us(&op->start, &now);
+  op->result = result;
+
+  trace_ring[trace_count % TRACE_RING] = *op;
+  trace_count++;
+
+  tv = trace_vm_get(op->domid);
+  tv->ops[op->unplug]++;
+  for (i = 0; i < TRACE_STAGES; ++i) {
+    if (op->stage_us[i] > 0)
+      tv->hist[op->unplug][i][trace_bucket(op->stage_us[i])]++;
+  }
+  tv->hist[op->unplug][TRACE_STAGES][trace_bucket(op->total_us)]++;
+
+  xd_log(LOG_DEBUG, "%s of %d device(s) for domain %d: %lu us "
+         "(dominfo %lu, usbinfo %lu, create %lu, online %lu, assign %lu, destroy %lu)",
+         op->unplug ? "Unplug" : "Plug", op->count, op->domid, op->total_us,
+         op->stage_us[TRACE_DOMINFO], op->stage_us[TRACE_USBINFO],
+         op->stage_us[TRACE_CREATE], op->stage_us[TRACE_ONLINE],
+         op->stage_us[TRACE_ASSIGN], op->stage_us[TRACE_DESTROY]);
+}
+
+/**
+ * Summarize all the operations recorded so far
+ *
+ * @param plugs Set to the number of plugs
+ * @param unplugs Set to the number of unplugs
+ * @param last_us Set to the duration of the last operation, 0 if none
+ */
+void
+trace_stats(unsigned long *plugs, unsigned long *unplugs, unsigned long *last_us)
+{
+  trace_vm_t *tv;
+
+  *plugs = 0;
+  *unplugs = 0;
+  list_for_each_entry(tv, &trace_vms, list) {
+    *plugs += tv->ops[0];
+    *unplugs += tv->ops[1];
+  }
+  *last_us = (trace_count > 0) ? trace_ring[(trace_count - 1) % TRACE_RING].total_us : 0;
+}
+
+/* Append to a malloc()ed string */
+static int
+trace_append(char **s, int len, const char *fmt, ...)
+{
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+
+  *s = realloc(*s, len + n + 1);
+  va_start(ap, fmt);
+  vsnprintf(*s + len, n + 1, fmt, ap);
+  va_end(ap);
+
+  return len + n;
+}
+
+static int
+trace_append_hist(char **s, int len, const char *what, const unsigned int *hist)
+{
+  int b;
+
+  for (b = 0; b < TRACE_BUCKETS && hist[b] == 0; ++b);
+  if (b == TRACE_BUCKETS)
+    return len;
+
+  len = trace_append(s, len, "      %-8s", what);
+  for (b = 0; b < TRACE_BUCKETS; ++b) {
+    if (hist[b] > 0)
+      len = trace_append(s, len, " %s%luus:%u", (b == TRACE_BUCKETS - 1) ? ">=" : "",
+                         1UL << b, hist[b]);
+  }
+
+  return trace_append(s, len, "\n");
+}
+
+/**
+ * Format the recent operations, oldest first, and the histograms of
+ * every VM. A histogram entry "512us:3" means 3 operations took
+ * between 512 and 1023 microseconds in that stage.
+ *
+ * @return A string to free(), never NULL
+ */
+char*
+trace_report(void)
+{
+  unsigned long i, first;
+  trace_op_t *op;
+  trace_vm_t *tv;
+  char *s = NULL;
+  int len = 0;
+  int u, st;
+
+  first = (trace_count > TRACE_RING) ? trace_count - TRACE_RING : 0;
+  len = trace_append(&s, len, "Recent operations (%lu of %lu), in us:\n",
+                     trace_count - first, trace_count);
+  for (i = first; i < trace_count; ++i) {
+    op = &trace_ring[i % TRACE_RING];
+    len = trace_append(&s, len, "  %-6s dom %3d %3d-%-3d x%-2d %s total %lu:",
+                       op->unplug ? "unplug" : "plug", op->domid, op->bus, op->dev,
+                       op->count, (op->result == 0) ? "ok    " : "failed", op->total_us);
+    for (st = 0; st < TRACE_STAGES; ++st) {
+      if (op->stage_us[st] > 0)
+        len = trace_append(&s, len, " %s %lu", trace_stage_names[st], op->stage_us[st]);
+    }
+    len = trace_append(&s, len, "\n");
+  }
+
+  len = trace_append(&s, len, "Histograms:\n");
+  list_for_each_entry(tv, &trace_vms, list) {
+    for (u = 0; u < 2; ++u) {
+      if (tv->ops[u] == 0)
+        continue;
+      len = trace_append(&s, len, "  %s, %lu %s:\n", tv->uuid, tv->ops[u],
+                         u ? "unplugs" : "plugs");
+      for (st = 0; st < TRACE_STAGES; ++st)
+        len = trace_append_hist(&s, len, trace_stage_names[st], tv->hist[u][st]);
+      len = trace_append_hist(&s, len, "total", tv->hist[u][TRACE_STAGES]);
+    }
+  }
+
+  return s;
+}
@@ -27,12 +27,135 @@
  */
 
 #include "project.h"
+#include <pthread.h>
 
 /**
  * The global udev monitor handler. Only used in udev.c
  */
 static struct udev_monitor *udev_mon;
 
+#define UDEV_MONITOR_RCVBUF (1024 * 1024) /**< Room for a hub full of devices */
+#define UDEV_EVENT_BUDGET   32            /**< Events handled per wakeup */
+#define COLDPLUG_WORKERS    4             /**< Max threads classifying at startup */
+#define UDEV_INDEX_BUCKETS  64            /**< Power of 2 */
+
+/**
+ * Index of the USB devices announced by the kernel or udev, by bus/dev
+ * IDs. Devices are in there as soon as their event arrives, before
+ * they get settled, classified and added to the device list.
+ */
+typedef struct {
+  struct hlist_node node;
+  int busid;
+  int devid;
+  int vendorid;
+  int deviceid;
+} udev_index_t;
+
+static struct hlist_head udev_index[UDEV_INDEX_BUCKETS];
+
+/**
+ * Counters of the udev work done to look at device children
+ */
+static struct {
+  unsigned long enumerations; /**< Subtree enumerations */
+  unsigned long devices;      /**< udev_device_new_from_syspath() calls */
+  unsigned long shared;       /**< Lookups served by an existing snapshot */
+} udev_stats;
+
+static unsigned long udev_tree_epoch = 1; /**< Snapshots from older epochs are stale */
+
+static struct hlist_head*
+udev_index_bucket(int busid, int devid)
+{
+  return &udev_index[(busid * 131 + devid) & (UDEV_INDEX_BUCKETS - 1)];
+}
+
+static udev_index_t*
+udev_index_find(int busid, int devid)
+{
+  struct hlist_node *pos, *tmp;
+  udev_index_t *e;
+
+  hlist_for_each_safe(pos, tmp, udev_index_bucket(busid, devid)) {
+    e = hlist_entry(pos, udev_index_t, node);
+    if (e->busid == busid && e->devid == devid)
+      return e;
+  }
+
+  return NULL;
+}
+
+/**
+ * Record a device that just showed up
+ */
+void
+udev_index_add(int busid, int devid, int vendorid, int deviceid)
+{
+  udev_index_t *e;
+
+  e = udev_index_find(busid, devid);
+  if (e == NULL) {
+    e = malloc(sizeof(udev_index_t));
+    e->busid = busid;
+    e->devid = devid;
+    hlist_add_head(&e->node, udev_index_bucket(busid, devid));
+  }
+  e->vendorid = vendorid;
+  e->deviceid = deviceid;
+}
+
+/**
+ * Forget a device that went away
+ */
+void
+udev_index_del(int busid, int devid)
+{
+  udev_index_t *e;
+
+  e = udev_index_find(busid, devid);
+  if (e == NULL)
+    return;
+  hlist_del(&e->node);
+  free(e);
+}
+
+/**
+ * Get the IDs of a device that was announced, even if it's not in the
+ * device list yet
+ *
+ * @return 0 on success, -ENOENT if the device isn't known
+ */
+int
+udev_index_lookup(int busid, int devid, int *vendorid, int *deviceid)
+{
+  udev_index_t *e;
+
+  e = udev_index_find(busid, devid);
+  if (e == NULL)
+    return -ENOENT;
+  *vendorid = e->vendorid;
+  *deviceid = e->deviceid;
+
+  return 0;
+}
+
+/* Index a device from its udev event, sysattrs don't need a settle */
+static void
+udev_index_event(struct udev_device *dev)
+{
+  const char *busnum, *devnum, *vendor, *product;
+
+  busnum = udev_device_get_sysattr_value(dev, "busnum");
+  devnum = udev_device_get_sysattr_value(dev, "devnum");
+  vendor = udev_device_get_sysattr_value(dev, "idVendor");
+  product = udev_device_get_sysattr_value(dev, "idProduct");
+  if (busnum == NULL || devnum == NULL || vendor == NULL || product == NULL)
+    return;
+  udev_index_add(strtol(busnum, NULL, 10), strtol(devnum, NULL, 10),
+                 strtol(vendor, NULL, 16), strtol(product, NULL, 16));
+}
+
 /**
  * Initialize the udev bits.
  *
@@ -52,16 +175,21 @@ udev_init(void)
   }
 
   udev_mon = udev_monitor_new_from_netlink(udev_handle, "udev");
+  /* This installs a socket filter, usb_interface and other events
+   * get dropped by the kernel */
   udev_monitor_filter_add_match_subsystem_devtype(udev_mon, "usb", "usb_device");
+  if (udev_monitor_set_receive_buffer_size(udev_mon, UDEV_MONITOR_RCVBUF) < 0)
+    xd_log(LOG_WARNING, "Unable to enlarge the udev monitor buffer");
   udev_monitor_enable_receiving(udev_mon);
   fd = udev_monitor_get_fd(udev_mon);
 
   return fd;
 }
 
-/* Let's do our best to make sure device are properly created */
-static void
-udev_settle(void)
+/* Let's do our best to make sure device are properly created.
+ * Stops early if the device we're waiting for goes away */
+void
+udev_settle(cancel_t *cancel)
 {
   struct udev_queue *queue;
   unsigned int i;
@@ -76,7 +204,7 @@ udev_settle(void)
   }
 
   for (i = 0; i < 10; ++i) {
-    if (udev_queue_get_queue_is_empty(queue)) {
+    if (udev_queue_get_queue_is_empty(queue) || cancel_requested(cancel)) {
       break;
     }
     xd_log(LOG_DEBUG, "udev queue is not empty, retrying for %f seconds...", 0.5 - i * 0.05);
@@ -87,242 +215,149 @@ udev_settle(void)
   udev_queue_unref(queue);
 }
 
-static int
-udev_find_more_about_input(struct udev_device *udev_device)
-{
-  const char *value;
-  int type = 0;
-
-  /* First, check if the id_input module considered the device, to
-   * avoid wasting time */
-  value = udev_device_get_property_value(udev_device, "ID_INPUT");
-  if (value == NULL || *value == '0')
-    return type;
-
-  /* The udev module id_input provides: */
-  /* ID_INPUT_ACCELEROMETER */
-  /* ID_INPUT_JOYSTICK      == GAME_CONTROLLER */
-  /* ID_INPUT_KEY */
-  /* ID_INPUT_KEYBOARD      == KEYBOARD */
-  /* ID_INPUT_MOUSE         == MOUSE */
-  /* ID_INPUT_TABLET */
-  /* ID_INPUT_TOUCHPAD      == MOUSE */
-  /* ID_INPUT_TOUCHSCREEN */
-  value = udev_device_get_property_value(udev_device, "ID_INPUT_KEYBOARD");
-  if (value != NULL && *value != '0')
-    type |= KEYBOARD;
-  value = udev_device_get_property_value(udev_device, "ID_INPUT_MOUSE");
-  if (value != NULL && *value != '0')
-    type |= MOUSE;
-  value = udev_device_get_property_value(udev_device, "ID_INPUT_TOUCHPAD");
-  if (value != NULL && *value != '0')
-    type |= MOUSE;
-  value = udev_device_get_property_value(udev_device, "ID_INPUT_JOYSTICK");
-  if (value != NULL && *value != '0')
-    type |= GAME_CONTROLLER;
-
-  return type;
-}
-
-static int
-class_to_device(const char *class)
+/**
+ * Enumerate the subtree of a device once, including the device itself,
+ * keeping a reference on every node so that all the probes and rule
+ * matchers can share it.
+ *
+ * @param dev The udev device
+ * @param children The snapshot to fill, empty it with udev_children_free()
+ */
+static unsigned long
+children_scan(struct udev *udev, struct udev_device *dev,
+              udev_children_t *children)
 {
-  int type = 0;
-  int c;
+  struct udev_enumerate *enumerate;
+  struct udev_list_entry *list, *entry;
+  struct udev_device *child;
+  unsigned long opened = 0;
+  int size = 0;
+
+  children->devs = NULL;
+  children->count = 0;
+  children->scanned = true;
+  children->epoch = udev_tree_epoch;
+  if (dev == NULL)
+    return 0;
 
-  if (class != NULL)
-  {
-    c = strtol(class, NULL, 16);
-    if (c == 0x08)
-      type |= MASS_STORAGE;
-    if (c == AUDIO_CLASS)
-      type |= AUDIO;
+  enumerate = udev_enumerate_new(udev);
+  udev_enumerate_add_match_parent(enumerate, dev);
+  udev_enumerate_scan_devices(enumerate);
+  list = udev_enumerate_get_list_entry(enumerate);
+  udev_list_entry_foreach(entry, list) {
+    child = udev_device_new_from_syspath(udev, udev_list_entry_get_name(entry));
+    opened++;
+    if (child == NULL)
+      continue;
+    if (children->count == size) {
+      size = size ? size * 2 : 8;
+      children->devs = realloc(children->devs, size * sizeof(struct udev_device *));
+    }
+    children->devs[children->count++] = child;
   }
+  udev_enumerate_unref(enumerate);
 
-  return type;
+  return opened;
 }
 
-static int
-udev_find_more_about_class(struct udev_device *udev_device)
+void
+udev_children_scan(struct udev_device *dev, udev_children_t *children)
 {
-  const char *value;
-  int type = 0;
-
-  value = udev_device_get_sysattr_value(udev_device, "bDeviceClass");
-  type |= class_to_device(value);
-  value = udev_device_get_sysattr_value(udev_device, "bInterfaceClass");
-  type |= class_to_device(value);
-
-  return type;
+  if (dev != NULL)
+    udev_stats.enumerations++;
+  udev_stats.devices += children_scan(udev_handle, dev, children);
 }
 
-/**
- * This is a tricky one. At this point, for some reason and even if we
- * did a "settle", udev cdrom device information is not fully
- * populated. So we try to wait until it is.
- * This sucks for USB flash drives, because they are scsi devices too,
- * so they'll get probed too for nothing... Maybe in the future we can
- * gather advanced info about them here, for super-advanced filtering!
- */
-static int
-udev_find_more_about_optical(struct udev_device *udev_device, int type, int new)
+void
+udev_children_free(udev_children_t *children)
 {
-  struct udev_monitor *mon;
-  struct timeval tv;
-  int fd;
-  struct udev_device *udev_child;
-  struct udev_enumerate *enumerate;
-  struct udev_list_entry *udev_device_list, *udev_device_entry;
-  const char *path;
-  const char *value;
-  fd_set fds;
-
-  /* Optical drives are probed in multiple udev passes...
-   * For every scsi devices, wait for a second udev pass */
-
-  /* If the device is already an optical drive we're good */
-  if (type & OPTICAL)
-    return type | OPTICAL;
-
-  /* Check if the device is scsi */
-  value = udev_device_get_devtype(udev_device);
-  if (value == NULL || strcmp(value, "scsi_host")) {
-    return type;
-  }
-
-  /* If the device didn't just appear, we can assume everything is ready */
-  if (!new) {
-    value = udev_device_get_property_value(udev_device, "ID_CDROM");
-    if (value != NULL && *value != '0')
-      type |= OPTICAL;
-    return type;
-  }
-
-  /* Create a udev monitor to wait for some "block" action for 3 seconds */
-  mon = udev_monitor_new_from_netlink(udev_handle, "udev");
-  udev_monitor_filter_add_match_subsystem_devtype(mon, "block", "disk");
-  udev_monitor_enable_receiving(mon);
-  fd = udev_monitor_get_fd(mon);
-  FD_ZERO(&fds);
-  FD_SET(fd, &fds);
-  tv.tv_sec = 3;
-  tv.tv_usec = 0;
-  select(fd + 1, &fds, NULL, NULL, &tv);
-  udev_monitor_unref(mon);
-
-  /* The block device may just have appeared, let udev settle (again...) */
-  udev_settle();
-
-  /* Wether the previous triggered or timed out, check out our subnodes */
-  enumerate = udev_enumerate_new(udev_handle);
-  udev_enumerate_add_match_parent(enumerate, udev_device);
-  udev_enumerate_scan_devices(enumerate);
-  udev_device_list = udev_enumerate_get_list_entry(enumerate);
-  udev_list_entry_foreach(udev_device_entry, udev_device_list) {
-    path = udev_list_entry_get_name(udev_device_entry);
-    udev_child = udev_device_new_from_syspath(udev_handle, path);
-    value = udev_device_get_property_value(udev_child, "ID_CDROM");
-    if (value != NULL) {
-      if (*value != '0')
-        type |= OPTICAL;
-      udev_device_unref(udev_child);
-      break;
-    }
-    udev_device_unref(udev_child);
-  }
-
-  /* Cleanup */
-  udev_enumerate_unref(enumerate);
+  int i;
+
+  for (i = 0; i < children->count; ++i)
+    udev_device_unref(children->devs[i]);
+  free(children->devs);
+  children->devs = NULL;
+  children->count = 0;
+  children->scanned = false;
+}
 
-  return type;
+void
+udev_get_stats(unsigned long *enumerations, unsigned long *devices,
+               unsigned long *shared)
+{
+  *enumerations = udev_stats.enumerations;
+  *devices = udev_stats.devices;
+  *shared = udev_stats.shared;
 }
 
 /**
- * Look at all the childs of a given device to figure out more about
- * what it does
+ * Make the next rule matches take a fresh snapshot of the device
+ * trees. Interfaces and their nodes keep showing up after a device got
+ * added, and libudev caches the properties of the devices it holds, so
+ * a snapshot is only good for one round of policy evaluation.
  */
-static int
-udev_find_more(struct udev_device *dev, int new)
+void
+udev_tree_refresh(void)
 {
-  struct udev_enumerate *enumerate;
-  struct udev_list_entry *udev_device_list, *udev_device_entry;
-  struct udev_device *udev_device;
-  const char *path;
-  int type = 0;
-
-  enumerate = udev_enumerate_new(udev_handle);
-  udev_enumerate_add_match_parent(enumerate, dev);
-  udev_enumerate_scan_devices(enumerate);
-  udev_device_list = udev_enumerate_get_list_entry(enumerate);
-  udev_list_entry_foreach(udev_device_entry, udev_device_list) {
-    path = udev_list_entry_get_name(udev_device_entry);
-    udev_device = udev_device_new_from_syspath(udev_handle, path);
-    type |= udev_find_more_about_input(udev_device);
-    type |= udev_find_more_about_class(udev_device);
-    type |= udev_find_more_about_optical(udev_device, type, new);
-    udev_device_unref(udev_device);
-  }
-
-  /* Cleanup */
-  udev_enumerate_unref(enumerate);
+  udev_tree_epoch++;
+}
 
-  return type;
+/* Results derived from a device tree are good for this epoch only */
+unsigned long
+udev_tree_get_epoch(void)
+{
+  return udev_tree_epoch;
 }
 
+/**
+ * Check if the device or any of its children has a given sysattr or
+ * property value. The children are enumerated on the first call for
+ * a given device since the last udev_tree_refresh(), later calls
+ * reuse that snapshot.
+ */
 int
-udev_device_tree_match(struct udev_device *dev,
+udev_device_tree_match(device_t *device,
     const char *key,
     const char *value,
     int sysattr)
 {
-  struct udev_enumerate *enumerate;
-  struct udev_list_entry *udev_device_list, *udev_device_entry;
-  struct udev_device *udev_device;
-  const char *path;
   const char *temp_value;
-  int found = 0;
+  int i;
 
-  enumerate = udev_enumerate_new(udev_handle);
-  udev_enumerate_add_match_parent(enumerate, dev);
-  udev_enumerate_scan_devices(enumerate);
-  udev_device_list = udev_enumerate_get_list_entry(enumerate);
-  udev_list_entry_foreach(udev_device_entry, udev_device_list) {
-    path = udev_list_entry_get_name(udev_device_entry);
-    udev_device = udev_device_new_from_syspath(udev_handle, path);
+  if (!device->children.scanned || device->children.epoch != udev_tree_epoch) {
+    udev_children_free(&device->children);
+    udev_children_scan(device->udev, &device->children);
+  } else
+    udev_stats.shared++;
+
+  for (i = 0; i < device->children.count; ++i) {
     if (sysattr)
-      temp_value = udev_device_get_sysattr_value(udev_device, key);
+      temp_value = udev_device_get_sysattr_value(device->children.devs[i], key);
     else
-      temp_value = udev_device_get_property_value(udev_device, key);
+      temp_value = udev_device_get_property_value(device->children.devs[i], key);
 
     if (temp_value != NULL && !strcmp(temp_value, value))
-    {
-      udev_device_unref(udev_device);
-      found = 1;
-      break;
-    }
-    udev_device_unref(udev_device);
+      return 1;
   }
 
-  /* Cleanup */
-  udev_enumerate_unref(enumerate);
-  return found;
+  return 0;
 }
 
 
 int
-udev_device_tree_match_sysattr(struct udev_device *dev,
+udev_device_tree_match_sysattr(device_t *device,
     const char *key,
     const char *value)
 {
-  return udev_device_tree_match(dev, key, value, 1);
+  return udev_device_tree_match(device, key, value, 1);
 }
 
 int
-udev_device_tree_match_property(struct udev_device *dev,
+udev_device_tree_match_property(device_t *device,
     const char *key,
     const char *value)
 {
-  return udev_device_tree_match(dev, key, value, 0);
+  return udev_device_tree_match(device, key, value, 0);
 }
 
 /* Ignore device configurations and interfaces */
@@ -364,80 +399,168 @@ check_product(const char *s)
   return -1;
 }
 
-static device_t*
-udev_maybe_add_device(struct udev_device *dev, int auto_assign)
+/**
+ * Devices that were added from the fingerprint cache, to classify
+ * for real once things are quiet
+ */
+typedef struct {
+  struct list_head list;
+  int busid;
+  int devid;
+} revalidate_t;
+
+static LIST_HEAD(revalidate);
+
+static void
+udev_revalidate_later(device_t *device)
 {
-  const char *value;
-  int busnum, devnum;
-  int vendorid, deviceid;
-  int type;
-  char *serial = NULL;
-  char *vendor = NULL;
-  char *model;
-  char *sysname = NULL;
+  revalidate_t *rv;
+
+  rv = malloc(sizeof(revalidate_t));
+  rv->busid = device->busid;
+  rv->devid = device->devid;
+  list_add_tail(&rv->list, &revalidate);
+}
+
+bool
+udev_revalidate_pending(void)
+{
+  return !list_empty(&revalidate);
+}
+
+/**
+ * What we learn about a device before adding it to the list. The
+ * classification step can run in a coldplug worker, with its own
+ * udev context.
+ */
+typedef struct {
+  struct udev_device *dev;       /**< The device, from udev_handle */
+  const char *syspath;           /**< Owned by dev */
+  int busnum;
+  int devnum;
+  int vendorid;
+  int deviceid;
   unsigned char class;
   unsigned char subclass;
   unsigned char protocol;
-  int size;
-  device_t *device;
+  int bcd;
+  char *sysname;
+  char *serial;
+  unsigned char *desc;           /**< Raw descriptors, or NULL */
+  size_t desc_len;
+  uint32_t desc_hash;
+  bool cached;                   /**< Type and names came from a cache */
+  bool fingerprint;              /**< ...the fingerprint cache, to revalidate */
+  bool provisional;              /**< The optical probe timed out, don't cache the type */
+  int type;
+  char *vendor;
+  char *model;
+  udev_children_t children;
+} udev_probe_t;
 
-  /* Give udev some time to finish create the device and its children.
-     We could probably use udev_device_get_is_initialized() if it worked... */
-  udev_settle();
+/**
+ * Read the identity of a device, and look it up in the classification
+ * cache. Cheap, sysfs reads only.
+ *
+ * @return 0 if the device is one we want, -1 otherwise
+ */
+static int
+udev_probe_read(struct udev_device *dev, udev_probe_t *probe)
+{
+  const char *value;
+
+  memset(probe, 0, sizeof(udev_probe_t));
+  probe->dev = dev;
+  probe->syspath = udev_device_get_syspath(dev);
 
   /* Make sure the device is useful for us */
   value = udev_device_get_sysname(dev);
   if (value != NULL && check_sysname(value) != 0)
-    return NULL;
+    return -1;
 
   /* Check main device attributes.
      Skip any device that doesn't have them (shouldn't happen) */
   value = udev_device_get_sysattr_value(dev, "busnum");
   if (value == NULL)
-    return NULL;
+    return -1;
   else
-    busnum = strtol(value, NULL, 10);
+    probe->busnum = strtol(value, NULL, 10);
   value = udev_device_get_sysattr_value(dev, "devnum");
   if (value == NULL)
-    return NULL;
+    return -1;
   else
-    devnum = strtol(value, NULL, 10);
+    probe->devnum = strtol(value, NULL, 10);
   value = udev_device_get_sysattr_value(dev, "idVendor");
   if (value == NULL)
-    return NULL;
+    return -1;
   else
-    vendorid = strtol(value, NULL, 16);
+    probe->vendorid = strtol(value, NULL, 16);
   value = udev_device_get_sysattr_value(dev, "idProduct");
   if (value == NULL)
-    return NULL;
+    return -1;
   else
-    deviceid = strtol(value, NULL, 16);
+    probe->deviceid = strtol(value, NULL, 16);
   value = udev_device_get_sysattr_value(dev, "bDeviceClass");
   if (value == NULL)
-    return NULL;
+    return -1;
   else
-    class = strtol(value, NULL, 16);
+    probe->class = strtol(value, NULL, 16);
   value = udev_device_get_sysattr_value(dev, "bDeviceSubClass");
   if (value == NULL)
-    return NULL;
+    return -1;
   else
-    subclass = strtol(value, NULL, 16);
+    probe->subclass = strtol(value, NULL, 16);
   value = udev_device_get_sysattr_value(dev, "bDeviceProtocol");
   if (value == NULL)
-    return NULL;
+    return -1;
   else
-    protocol = strtol(value, NULL, 16);
+    probe->protocol = strtol(value, NULL, 16);
   value = udev_device_get_sysname(dev);
   if (value == NULL)
-    return NULL;
-  else
-    sysname = strdup(value);
+    return -1;
 
   /* This is a hub, we don't do hubs. */
-  if (class == 0x09)
-    return NULL;
+  if (probe->class == 0x09)
+    return -1;
 
   /* The device passes all the tests, we want it in the list */
+  probe->sysname = strdup(value);
+
+  /* Look for the serial, if present (may not be). We only care about short serial,
+   * as long serial is often otherwise not unique */
+  value = udev_device_get_sysattr_value(dev, "serial");
+  if (value != NULL )
+    probe->serial = strdup(value);
+
+  /* Identical devices get the same type and names, don't probe them
+     again if we've seen this model before */
+  value = udev_device_get_sysattr_value(dev, "bcdDevice");
+  probe->bcd = (value != NULL) ? strtol(value, NULL, 16) : 0;
+  probe->desc = descriptors_read(probe->syspath, &probe->desc_len);
+  probe->desc_hash = (probe->desc != NULL) ? fnv1a_hash(probe->desc, probe->desc_len) : 0;
+  if (probe->desc == NULL)
+    return 0;
+  /* This very device, or at least the same model */
+  probe->fingerprint = fpcache_lookup(probe->vendorid, probe->deviceid,
+                                      probe->serial, probe->sysname,
+                                      probe->desc_hash, &probe->type,
+                                      &probe->vendor, &probe->model);
+  probe->cached = (probe->fingerprint ||
+                   classcache_lookup(probe->vendorid, probe->deviceid,
+                                     probe->bcd, probe->desc_hash,
+                                     &probe->type, &probe->vendor,
+                                     &probe->model));
+
+  return 0;
+}
+
+/* Build the vendor and model names of a device */
+static void
+udev_probe_names(struct udev_device *dev, udev_probe_t *probe)
+{
+  const char *value;
+  char *vendor, *model;
+  int size;
 
   /* Read the device manufacturer */
   value = udev_device_get_sysattr_value(dev, "manufacturer");
@@ -468,7 +591,7 @@ udev_maybe_add_device(struct udev_device *dev, int auto_assign)
     char *type;
 
     /* Get the type string for the device. */
-    type = device_type(class, subclass, protocol);
+    type = device_type(probe->class, probe->subclass, probe->protocol);
     if (type != NULL) {
       /* There's a type, let's do "<vendor> device (<type>)" */
       size = strlen(vendor) + strlen(" device ()") + strlen(type) + 1;
@@ -479,7 +602,8 @@ udev_maybe_add_device(struct udev_device *dev, int auto_assign)
       /* There's no type, let's just do "<vendor> device (<vendorid>:<deviceid>)" */
       size = strlen(vendor) + strlen(" device (XXXX:XXXX)") + 1;
       model = malloc(size);
-      snprintf(model, size, "%s device (%04x:%04x)", vendor, vendorid, deviceid);
+      snprintf(model, size, "%s device (%04x:%04x)", vendor,
+               probe->vendorid, probe->deviceid);
     }
   } else {
     /* Model was found in usb.ids */
@@ -490,39 +614,232 @@ udev_maybe_add_device(struct udev_device *dev, int auto_assign)
   /* Broadcom device model has a meaningless display name.
    * This is a hack to make it more human readable */
   if (!strcmp(model, "58200")) {
-	  free(model);
-	  size = strlen("Broadcom 58200 Smartcard Reader") + 1;
-	  model = malloc(size);
-	  snprintf(model, size, "Broadcom 58200 Smartcard Reader");
+    free(model);
+    size = strlen("Broadcom 58200 Smartcard Reader") + 1;
+    model = malloc(size);
+    snprintf(model, size, "Broadcom 58200 Smartcard Reader");
   }
 
-  /* Look for the serial, if present (may not be). We only care about short serial,
-   * as long serial is often otherwise not unique */
-  value = udev_device_get_sysattr_value(dev, "serial");
-  if (value != NULL ) {
-    serial = malloc(strlen(value) + 1);
-    strcpy(serial, value);
-  }
+  probe->vendor = vendor;
+  probe->model = model;
+}
+
+/**
+ * Add a probed device to the list, and publish it. Takes ownership of
+ * the probe contents.
+ */
+static device_t*
+udev_probe_publish(udev_probe_t *probe)
+{
+  device_t *device;
 
-  /* Find out more about the device by looking at its children */
-  type = udev_find_more(dev, auto_assign);
-  type |= libusb_find_more_about_nic(vendorid, deviceid);
+  if (!probe->cached && !probe->provisional && probe->desc != NULL)
+    classcache_add(probe->vendorid, probe->deviceid, probe->bcd,
+                   probe->desc_hash, probe->type, probe->vendor, probe->model);
+  if (!probe->fingerprint && !probe->provisional && probe->desc != NULL)
+    fpcache_store(probe->vendorid, probe->deviceid, probe->serial,
+                  probe->sysname, probe->desc_hash,
+                  probe->type, probe->vendor, probe->model);
+  free(probe->desc);
 
   /* Finally add the device */
-  device = device_add(busnum, devnum,
-                      vendorid, deviceid,
-                      type,
-                      serial,
-                      model, vendor,
-                      sysname, dev);
+  device = device_add(probe->busnum, probe->devnum,
+                      probe->vendorid, probe->deviceid,
+                      probe->type,
+                      probe->serial,
+                      probe->model, probe->vendor,
+                      probe->sysname, probe->dev);
 
   if (device) {
+    /* Keep the snapshot for rule matching, or build it when needed */
+    device->children = probe->children;
     xsdev_write(device);
-  }
+  } else
+    udev_children_free(&probe->children);
 
   return device;
 }
 
+/* Drop a probe that won't be published, the device stays referenced */
+static void
+udev_probe_free(udev_probe_t *probe)
+{
+  free(probe->sysname);
+  free(probe->serial);
+  free(probe->desc);
+  free(probe->vendor);
+  free(probe->model);
+  udev_children_free(&probe->children);
+}
+
+static void
+udev_revalidate_device(device_t *device)
+{
+  udev_probe_t probe;
+  cancel_t *cancel;
+  const char *before, *after;
+  bool rematch = false;
+
+  cancel = cancel_new(device->busid, device->devid,
+                      udev_device_get_syspath(device->udev));
+  udev_settle(cancel);
+  if (cancel_requested(cancel) || udev_probe_read(device->udev, &probe) != 0) {
+    cancel_free(cancel);
+    return;
+  }
+  /* Forget what the caches said */
+  free(probe.vendor);
+  free(probe.model);
+  udev_probe_names(device->udev, &probe);
+  udev_children_scan(device->udev, &probe.children);
+  probe.type = classify_device(device->udev, &probe.children,
+                               probe.desc, probe.desc_len, 0, cancel, NULL);
+  if (cancel_requested(cancel)) {
+    udev_probe_free(&probe);
+    cancel_free(cancel);
+    return;
+  }
+  cancel_free(cancel);
+
+  /* The fresh snapshot is as good as any */
+  udev_children_free(&device->children);
+  device->children = probe.children;
+  probe.children.devs = NULL;
+  probe.children.count = 0;
+
+  if (probe.type != device->type ||
+      strcmp(probe.vendor, device->longname) ||
+      strcmp(probe.model, device->shortname)) {
+    xd_log(LOG_WARNING,
+           "Device %s changed since it was cached: type %x -> %x, refreshing it",
+           device->sysname, device->type, probe.type);
+    before = policy_device_rule_uuid(device);
+    device->type = probe.type;
+    /* The rules it matches may have changed with its type */
+    device->sticky_gen = 0;
+    free(device->longname);
+    free(device->shortname);
+    device->longname = strdup(probe.vendor);
+    device->shortname = strdup(probe.model);
+    classcache_add(probe.vendorid, probe.deviceid, probe.bcd,
+                   probe.desc_hash, probe.type, probe.vendor, probe.model);
+    fpcache_store(probe.vendorid, probe.deviceid, probe.serial,
+                  probe.sysname, probe.desc_hash,
+                  probe.type, probe.vendor, probe.model);
+    xsdev_write(device);
+    after = policy_device_rule_uuid(device);
+    rematch = (before != after &&
+               (before == NULL || after == NULL || strcmp(before, after)));
+  }
+  udev_probe_free(&probe);
+
+  /* The policy first ran on the cached type, before udev settled, so
+   * rules matching the device tree may have missed nodes. Run it again
+   * on the device as it is now. */
+  if (device->vm != NULL && !policy_is_allowed(device, device->vm, NULL)) {
+    xd_log(LOG_WARNING, "Device %s no longer allowed in VM %s, unplugging it",
+           device->sysname, device->vm->uuid);
+    if (usbowls_unplug_device(device->vm->domid, device->busid, device->devid) == 0)
+      device->vm = NULL;
+  }
+  /* Assign it again only if the first pass went by the wrong rule, a
+   * device it left in dom0 stays there */
+  if (rematch && device->vm == NULL && my_domid == 0 &&
+      !flap_held(device->sysname))
+    policy_auto_assign_new_device(device);
+}
+
+/**
+ * Classify the devices that came from the fingerprint cache, and fix
+ * them up if the cache was wrong. Meant to run when the main loop is
+ * idle.
+ */
+void
+udev_revalidate(void)
+{
+  revalidate_t *rv;
+  device_t *device;
+
+  while (!list_empty(&revalidate)) {
+    rv = list_entry(revalidate.next, revalidate_t, list);
+    list_del(&rv->list);
+    device = device_lookup(rv->busid, rv->devid);
+    if (device != NULL && device->udev != NULL)
+      udev_revalidate_device(device);
+    free(rv);
+  }
+}
+
+static device_t*
+udev_maybe_add_device(struct udev_device *dev, int new)
+{
+  udev_probe_t probe;
+  device_t *device;
+  cancel_t *cancel;
+  const char *busnum, *devnum;
+  const char *gone = NULL;
+  bool complete;
+
+  /* A device we know, back in the same port: no need to wait for udev,
+   * the classification gets checked later */
+  if (new) {
+    if (udev_probe_read(dev, &probe) == 0 && probe.fingerprint) {
+      device = udev_probe_publish(&probe);
+      if (device != NULL) {
+        xd_log(LOG_INFO, "Device %s is known, skipping classification",
+               device->sysname);
+        udev_revalidate_later(device);
+      }
+      return device;
+    }
+    udev_probe_free(&probe);
+  }
+
+  /* Stop wasting time on the device if it gets unplugged meanwhile */
+  busnum = udev_device_get_sysattr_value(dev, "busnum");
+  devnum = udev_device_get_sysattr_value(dev, "devnum");
+  cancel = cancel_new((busnum != NULL) ? strtol(busnum, NULL, 10) : -1,
+                      (devnum != NULL) ? strtol(devnum, NULL, 10) : -1,
+                      udev_device_get_syspath(dev));
+
+  /* Give udev some time to finish create the device and its children.
+     We could probably use udev_device_get_is_initialized() if it worked... */
+  udev_settle(cancel);
+
+  if (cancel_requested(cancel)) {
+    gone = "settling";
+    goto out;
+  }
+  if (udev_probe_read(dev, &probe) != 0) {
+    udev_probe_free(&probe);
+    goto out;
+  }
+  if (!probe.cached) {
+    udev_probe_names(dev, &probe);
+    /* Find out more about the device by looking at its interfaces and children */
+    udev_children_scan(dev, &probe.children);
+    probe.type = classify_device(dev, &probe.children,
+                                 probe.desc, probe.desc_len, new, cancel,
+                                 &complete);
+    probe.provisional = !complete;
+  }
+  if (cancel_requested(cancel)) {
+    gone = "classification";
+    udev_probe_free(&probe);
+    goto out;
+  }
+
+  cancel_free(cancel);
+  return udev_probe_publish(&probe);
+
+ out:
+  if (gone != NULL)
+    xd_log(LOG_INFO, "Device %s went away during %s, giving up on it",
+           udev_device_get_sysname(dev), gone);
+  cancel_free(cancel);
+  return NULL;
+}
+
 static void
 udev_node_to_ids(const char *node, int *busid, int *devid)
 {
@@ -560,10 +877,12 @@ int
 common_del_device(int busnum, int devnum)
 {
   usbinfo_t ui;
-  dominfo_t di;
+  dominfo_t *di;
   device_t *device;
   int ret;
 
+  usbowls_unstage_device(busnum, devnum);
+
   /* Cleanup xenstore if the device was assigned to a VM */
   device = device_lookup(busnum, devnum);
   if (device == NULL) {
@@ -573,10 +892,16 @@ common_del_device(int busnum, int devnum)
   }
   if (device->vm != NULL) {
     usbowls_build_usbinfo(busnum, devnum, device->vendorid, device->deviceid, &ui);
-    xenstore_get_dominfo(device->vm->domid, &di);
-    xenstore_destroy_usb(&di, &ui);
+    di = xenstore_get_dominfo(device->vm->domid);
+    if (di != NULL) {
+      xenstore_destroy_usb(di, &ui);
+      xenstore_put_dominfo(di);
+    }
   }
 
+  /* Drop its vusb dynamic ID, unless an identical device still needs it */
+  vusb_forget_local(busnum, devnum);
+
   /* Delete the device from the global list */
   ret = device_del(busnum, devnum);
 
@@ -605,13 +930,113 @@ udev_del_device(struct udev_device *dev)
   if (node == NULL)
     return -1;
   udev_node_to_ids(node, &busnum, &devnum);
+  cancel_device(busnum, devnum);
+  udev_index_del(busnum, devnum);
 
   return common_del_device(busnum, devnum);
 }
 
+/**
+ * Shared state of the coldplug workers. Each worker takes the next
+ * probe that needs classifying and works on it with its own udev
+ * context, since libudev contexts can't be shared between threads.
+ */
+typedef struct {
+  udev_probe_t **jobs;
+  int count;
+  int next;                   /**< Next job to take, atomically incremented */
+  unsigned long enumerations; /**< Worker stats, folded into udev_stats */
+  unsigned long devices;
+  pthread_mutex_t lock;       /**< Protects the stats */
+} coldplug_t;
+
+static void
+coldplug_work(coldplug_t *cp, struct udev *udev)
+{
+  struct udev_device *dev;
+  udev_probe_t *probe;
+  unsigned long enumerations = 0, devices = 0;
+  int i;
+
+  while ((i = __sync_fetch_and_add(&cp->next, 1)) < cp->count) {
+    probe = cp->jobs[i];
+    dev = udev_device_new_from_syspath(udev, probe->syspath);
+    if (dev == NULL)
+      continue;
+    udev_probe_names(dev, probe);
+    enumerations++;
+    devices += children_scan(udev, dev, &probe->children);
+    probe->type = classify_device(dev, &probe->children,
+                                  probe->desc, probe->desc_len, 0, NULL, NULL);
+    /* The snapshot belongs to this context, the device will build its
+     * own if a rule needs it */
+    udev_children_free(&probe->children);
+    udev_device_unref(dev);
+  }
+
+  pthread_mutex_lock(&cp->lock);
+  cp->enumerations += enumerations;
+  cp->devices += devices;
+  pthread_mutex_unlock(&cp->lock);
+}
+
+static void*
+coldplug_thread(void *opaque)
+{
+  struct udev *udev;
+
+  udev = udev_new();
+  if (udev == NULL)
+    /* The other workers will take our share */
+    return NULL;
+  coldplug_work(opaque, udev);
+  udev_unref(udev);
+
+  return NULL;
+}
+
+/* Classify all the jobs, in parallel when it's worth it */
+static int
+coldplug_classify(udev_probe_t **jobs, int count)
+{
+  pthread_t threads[COLDPLUG_WORKERS];
+  coldplug_t cp;
+  long cpus;
+  int n, i;
+
+  cp.jobs = jobs;
+  cp.count = count;
+  cp.next = 0;
+  cp.enumerations = 0;
+  cp.devices = 0;
+  pthread_mutex_init(&cp.lock, NULL);
+
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  n = (count < COLDPLUG_WORKERS) ? count : COLDPLUG_WORKERS;
+  if (cpus > 0 && n > cpus)
+    n = cpus;
+  /* The main thread is a worker too */
+  for (i = 0; i < n - 1; ++i)
+    if (pthread_create(&threads[i], NULL, coldplug_thread, &cp) != 0)
+      break;
+  n = i;
+  coldplug_work(&cp, udev_handle);
+  for (i = 0; i < n; ++i)
+    pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&cp.lock);
+
+  udev_stats.enumerations += cp.enumerations;
+  udev_stats.devices += cp.devices;
+
+  return n + 1;
+}
+
 /**
  * Enumerate all the udev USB devices that we care about,
- * build nice model and vendor strings and add them to the list
+ * build nice model and vendor strings and add them to the list.
+ * udev gets to settle once for all of them, the devices that aren't
+ * in the classification cache get classified in parallel, and all of
+ * them get published to XenStore in one batch.
  */
 void
 udev_fill_devices(void)
@@ -619,7 +1044,15 @@ udev_fill_devices(void)
   struct udev_enumerate *enumerate;
   struct udev_list_entry *udev_device_list, *udev_device_entry;
   struct udev_device *udev_device;
+  struct timespec start, end;
+  udev_probe_t *probes = NULL;
+  udev_probe_t **jobs = NULL;
   const char *path;
+  int count = 0, size = 0, misses = 0, added = 0, threads = 0;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  udev_settle(NULL);
 
   enumerate = udev_enumerate_new(udev_handle);
   udev_enumerate_add_match_subsystem(enumerate, "usb");
@@ -630,69 +1063,130 @@ udev_fill_devices(void)
   udev_list_entry_foreach(udev_device_entry, udev_device_list) {
     path = udev_list_entry_get_name(udev_device_entry);
     udev_device = udev_device_new_from_syspath(udev_handle, path);
-    if (udev_maybe_add_device(udev_device, 0) == NULL)
+    if (udev_device == NULL)
+      continue;
+    if (count == size) {
+      size = size ? size * 2 : 16;
+      probes = realloc(probes, size * sizeof(udev_probe_t));
+    }
+    if (udev_probe_read(udev_device, &probes[count]) != 0) {
+      udev_probe_free(&probes[count]);
       udev_device_unref(udev_device);
-    /* Otherwise we keep a reference to the udev device, mainly for
-     * advanced rule-matching purposes */
+      continue;
+    }
+    count++;
   }
-
-  /* Cleanup */
   udev_enumerate_unref(enumerate);
+
+  /* probes won't move anymore, the workers can point into it */
+  jobs = malloc((count ? count : 1) * sizeof(udev_probe_t *));
+  for (i = 0; i < count; ++i)
+    if (!probes[i].cached)
+      jobs[misses++] = &probes[i];
+  if (misses > 0)
+    threads = coldplug_classify(jobs, misses);
+  free(jobs);
+
+  /* Publish all the devices present at startup in one go */
+  xsdev_batch_begin();
+  for (i = 0; i < count; ++i) {
+    /* Gone before a worker could look at it */
+    if (probes[i].vendor == NULL)
+      udev_probe_free(&probes[i]);
+    else if (udev_probe_publish(&probes[i]) != NULL) {
+      /* We keep a reference to the udev device, mainly for
+       * advanced rule-matching purposes */
+      added++;
+      continue;
+    }
+    udev_device_unref(probes[i].dev);
+  }
+  xsdev_batch_end();
+  free(probes);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  xd_log(LOG_INFO,
+         "Coldplug: %d devices in %ld ms, %d classified with %d threads, %d from cache",
+         added,
+         (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000,
+         misses, threads, count - misses);
 }
 
-/**
- * Udev monitor "callback". This function will add/delete devices
- * according to a udev event. It should be called every time the udev
- * monitor "wakes up".
- */
-void
-udev_event(void)
+static void
+udev_handle_event(struct udev_device *dev)
 {
-  struct udev_device *dev;
   const char *action;
   device_t *device;
   int auto_assign = my_domid == 0;
 
-  dev = udev_monitor_receive_device(udev_mon);
-  if (dev) {
-    action = udev_device_get_action(dev);
-    if (!strcmp(action, "add")) {
-      device = udev_maybe_add_device(dev, 1);
-      if (device != NULL) {
-        /* We keep a reference to the udev device, mainly for advanced rule-matching */
-        /* udev_device_unref(dev); */
-        /* Tell the "USB manager" about the new device. */
-        usbmanager_device_added(device);
-        xd_log(LOG_INFO,
-            "Device %s [Bus=%03d, Dev=%03d, VID=%04X, PID=%04X, Serial=%s] available for assignment",
-            udev_device_get_sysname(dev),
-            device->busid,
-            device->devid,
-            device->vendorid,
-            device->deviceid,
-            device->serial);
-
-        if (auto_assign)
-          policy_auto_assign_new_device(device);
-      } else {
-        /* This seems to happen when a device is quickly plugged and
-         * unplugged. */
-        xd_log(LOG_WARNING, "Device [%s] not added",
-            udev_device_get_sysnum(dev));
-        udev_device_unref(dev);
+  action = udev_device_get_action(dev);
+  if (!strcmp(action, "add")) {
+    flap_added(udev_device_get_sysname(dev));
+    udev_index_event(dev);
+    device = udev_maybe_add_device(dev, 1);
+    if (device != NULL) {
+      /* We keep a reference to the udev device, mainly for advanced rule-matching */
+      /* udev_device_unref(dev); */
+      /* Tell the "USB manager" about the new device. */
+      usbmanager_device_added(device);
+      xd_log(LOG_INFO,
+          "Device %s [Bus=%03d, Dev=%03d, VID=%04X, PID=%04X, Serial=%s] available for assignment",
+          udev_device_get_sysname(dev),
+          device->busid,
+          device->devid,
+          device->vendorid,
+          device->deviceid,
+          device->serial);
+
+      if (auto_assign && flap_held(device->sysname)) {
+        xd_log(LOG_INFO, "Port %s is held down, not assigning device %d-%d",
+            device->sysname, device->busid, device->devid);
+        auto_assign = 0;
       }
-    }
-    if (!strcmp(action, "remove")) {
-      if (udev_del_device(dev) == 0)
-        xd_log(LOG_INFO, "Device %s no longer available for assignment",
-            udev_device_get_sysname(dev));
-      else
-        xd_log(LOG_WARNING, "Device %s disconnected but not removed",
-            udev_device_get_sysname(dev));
+      if (!auto_assign || policy_auto_assign_new_device(device) != 0)
+        usbowls_unstage_device(device->busid, device->devid);
+    } else {
+      /* This seems to happen when a device is quickly plugged and
+       * unplugged. */
+      xd_log(LOG_WARNING, "Device [%s] not added",
+          udev_device_get_sysnum(dev));
       udev_device_unref(dev);
     }
+    return;
   }
-  else {
-    xd_log(LOG_ERR, "No Device from receive_device(). An error occured.");
+  if (!strcmp(action, "remove")) {
+    flap_removed(udev_device_get_sysname(dev));
+    if (udev_del_device(dev) == 0)
+      xd_log(LOG_INFO, "Device %s no longer available for assignment",
+          udev_device_get_sysname(dev));
+    else
+      xd_log(LOG_WARNING, "Device %s disconnected but not removed",
+          udev_device_get_sysname(dev));
+  }
+  udev_device_unref(dev);
+}
+
+/**
+ * Udev monitor "callback". This function will add/delete devices
+ * according to udev events. It should be called every time the udev
+ * monitor "wakes up", and handles everything that's pending, up to
+ * UDEV_EVENT_BUDGET events so the other sources don't starve. The
+ * socket stays readable if there's more.
+ */
+void
+udev_event(void)
+{
+  struct udev_device *dev;
+  int i;
+
+  for (i = 0; i < UDEV_EVENT_BUDGET; ++i) {
+    /* The monitor socket is non-blocking, NULL means we're done */
+    dev = udev_monitor_receive_device(udev_mon);
+    if (dev == NULL)
+      break;
+    udev_handle_event(dev);
   }
+
+  if (i == 0)
+    xd_log(LOG_ERR, "No Device from receive_device(). An error occured.");
 }
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2026 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   uevent.c
+ * @date   Mon Oct 19 14:02:37 2026
+ *
+ * @brief  Kernel uevent listener
+ *
+ * The udev monitor only hears about a device once udevd ran all its
+ * rules, and the device still has to settle before it gets classified.
+ * The kernel announces the device much earlier, with its bus/dev IDs
+ * and its VID/PID. When that's enough for the policy to know where the
+ * device goes (a sticky rule on IDs/serial only), the XenStore nodes
+ * get staged right away, so the frontend and the backend connect while
+ * udev is still busy. The udev event still does the full
+ * classification and the actual assignment.
+ */
+
+#include "project.h"
+#include <limits.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#define UEVENT_BUFFER_SIZE 8192
+#define UEVENT_RCVBUF      (256 * 1024)
+
+static int uevent_fd = -1;
+
+/**
+ * Open the kernel uevent socket
+ *
+ * @return The file descriptor to watch, or -1 on error
+ */
+int
+uevent_init(void)
+{
+  struct sockaddr_nl addr;
+  int size = UEVENT_RCVBUF;
+
+  uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     NETLINK_KOBJECT_UEVENT);
+  if (uevent_fd < 0) {
+    xd_log(LOG_ERR, "Unable to open the uevent socket");
+    return -1;
+  }
+  setsockopt(uevent_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = 1; /* The kernel group, udevd broadcasts on 2 */
+  if (bind(uevent_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    xd_log(LOG_ERR, "Unable to bind the uevent socket");
+    close(uevent_fd);
+    uevent_fd = -1;
+    return -1;
+  }
+
+  return uevent_fd;
+}
+
+/* Find a KEY=value pair in a uevent message */
+static const char*
+uevent_get(const char *buf, size_t len, const char *key)
+{
+  size_t keylen = strlen(key);
+  const char *p;
+
+  for (p = buf; p < buf + len; p += strlen(p) + 1) {
+    if (!strncmp(p, key, keylen) && p[keylen] == '=')
+      return p + keylen + 1;
+  }
+
+  return NULL;
+}
+
+/* Read the serial of the device from sysfs, NULL if it doesn't have one */
+static char*
+uevent_read_serial(const char *devpath)
+{
+  char path[PATH_MAX];
+  char serial[256];
+  FILE *f;
+
+  snprintf(path, sizeof(path), "/sys%s/serial", devpath);
+  f = fopen(path, "r");
+  if (f == NULL)
+    return NULL;
+  if (fgets(serial, sizeof(serial), f) == NULL) {
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+  serial[strcspn(serial, "\n")] = '\0';
+
+  return strdup(serial);
+}
+
+static void
+uevent_add(const char *buf, size_t len, int bus, int dev)
+{
+  const char *value, *devpath, *uuid;
+  unsigned int vendorid, deviceid, class;
+  device_t tmp;
+  vm_t *vm;
+
+  value = uevent_get(buf, len, "PRODUCT");
+  if (value == NULL || sscanf(value, "%x/%x", &vendorid, &deviceid) != 2)
+    return;
+  udev_index_add(bus, dev, vendorid, deviceid);
+
+  /* The udev event beat us to it, nothing to gain */
+  if (device_lookup(bus, dev) != NULL)
+    return;
+
+  /* We don't do hubs */
+  value = uevent_get(buf, len, "TYPE");
+  if (value != NULL && sscanf(value, "%u", &class) == 1 && class == 0x09)
+    return;
+  devpath = uevent_get(buf, len, "DEVPATH");
+  if (devpath == NULL || flap_held(strrchr(devpath, '/') + 1))
+    return;
+
+  memset(&tmp, 0, sizeof(tmp));
+  tmp.busid = bus;
+  tmp.devid = dev;
+  tmp.vendorid = vendorid;
+  tmp.deviceid = deviceid;
+  tmp.serial = uevent_read_serial(devpath);
+
+  /* Same checks as the udev path, minus what needs the device type */
+  uuid = policy_get_early_sticky_uuid(tmp.vendorid, tmp.deviceid, tmp.serial);
+  if (uuid != NULL && !device_is_ambiguous(&tmp)) {
+    vm = vm_lookup_by_uuid(uuid);
+    if (vm != NULL && vm->domid > 0)
+      usbowls_stage_device(vm->domid, bus, dev, tmp.vendorid, tmp.deviceid);
+  }
+
+  free(tmp.serial);
+}
+
+static void
+uevent_handle(const char *buf, size_t len)
+{
+  const char *action, *value;
+  int bus, dev;
+
+  action = uevent_get(buf, len, "ACTION");
+  value = uevent_get(buf, len, "SUBSYSTEM");
+  if (action == NULL || value == NULL || strcmp(value, "usb"))
+    return;
+  value = uevent_get(buf, len, "DEVTYPE");
+  if (value == NULL || strcmp(value, "usb_device"))
+    return;
+  value = uevent_get(buf, len, "BUSNUM");
+  if (value == NULL)
+    return;
+  bus = strtol(value, NULL, 10);
+  value = uevent_get(buf, len, "DEVNUM");
+  if (value == NULL)
+    return;
+  dev = strtol(value, NULL, 10);
+
+  if (!strcmp(action, "add"))
+    uevent_add(buf, len, bus, dev);
+  else if (!strcmp(action, "remove")) {
+    cancel_device(bus, dev);
+    udev_index_del(bus, dev);
+    usbowls_unstage_device(bus, dev);
+  }
+}
+
+/**
+ * Uevent socket "callback", handles all the pending kernel messages.
+ * It should be called every time the socket is readable.
+ */
+void
+uevent_event(void)
+{
+  char buf[UEVENT_BUFFER_SIZE];
+  struct sockaddr_nl addr;
+  struct iovec iov;
+  struct msghdr msg;
+  ssize_t len;
+
+  for (;;) {
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf) - 1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &addr;
+    msg.msg_namelen = sizeof(addr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    len = recvmsg(uevent_fd, &msg, 0);
+    if (len <= 0) {
+      if (len < 0 && errno != EAGAIN && errno != EINTR)
+        xd_log(LOG_WARNING, "Failed to read a uevent: %s", strerror(errno));
+      return;
+    }
+    /* Only trust the kernel */
+    if (addr.nl_pid != 0 || (msg.msg_flags & MSG_TRUNC))
+      continue;
+    buf[len] = '\0';
+    uevent_handle(buf, len);
+  }
+}
@@ -30,34 +30,202 @@
  */
 
 #include "project.h"
+#include <sys/sysmacros.h>
 
 #define VUSB_ADD_DEV            "/sys/bus/usb/drivers/vusb/new_id"
 #define VUSB_DEL_DEV            "/sys/bus/usb/drivers/vusb/remove_id"
+#define USB_DEVICE_MAJOR        189 /**< Minors are (bus - 1) * 128 + dev - 1 */
 
-int
-vusb_assign_local(int vendor, int product, int add)
+/**
+ * A device which XenStore nodes got created before it was plugged,
+ * see usbowls_stage_device()
+ */
+typedef struct {
+  struct list_head list;
+  int domid;
+  int bus;
+  int device;
+  int vendor;
+  int product;
+} staged_t;
+
+static LIST_HEAD(staged);
+
+/**
+ * A device bound to vusb through its dynamic ID. The driver matches on
+ * VID:PID only, so identical devices share the ID, which has to stay
+ * until the last of them is unassigned.
+ */
+typedef struct {
+  struct list_head list;
+  int vendor;
+  int product;
+  int bus;                /**< -1 for an ID found in the driver at startup */
+  int dev;
+} dynid_t;
+
+static LIST_HEAD(dynids);
+static bool dynids_loaded = false;
+static int vusb_add_fd = -1;
+static int vusb_del_fd = -1;
+
+/* Mirror the dynamic IDs the driver already has, from a previous run */
+static void
+dynids_load(void)
 {
-  char command[64];
-  int fd;
-  int ret = 0;
-  char *path = add ? VUSB_ADD_DEV : VUSB_DEL_DEV;
+  unsigned int vendor, product;
+  dynid_t *id;
+  FILE *f;
+
+  dynids_loaded = true;
+  f = fopen(VUSB_ADD_DEV, "r");
+  if (f == NULL)
+    return;
+  while (fscanf(f, "%x %x%*[^\n]", &vendor, &product) == 2) {
+    id = malloc(sizeof(dynid_t));
+    id->vendor = vendor;
+    id->product = product;
+    id->bus = -1;
+    id->dev = -1;
+    list_add(&id->list, &dynids);
+  }
+  fclose(f);
+}
 
-  xd_log(LOG_INFO, "%s: %04x:%04x add=%d", __func__, vendor, product, add);
+static dynid_t*
+dynids_find(int vendor, int product, int bus, int dev)
+{
+  struct list_head *pos;
+  dynid_t *id;
+
+  list_for_each(pos, &dynids) {
+    id = list_entry(pos, dynid_t, list);
+    if (id->vendor == vendor && id->product == product &&
+        id->bus == bus && id->dev == dev)
+      return id;
+  }
+
+  return NULL;
+}
+
+/* Count the holders of an ID, including the unknown ones or not */
+static int
+dynids_count(int vendor, int product, bool known_only)
+{
+  struct list_head *pos;
+  dynid_t *id;
+  int refs = 0;
+
+  list_for_each(pos, &dynids) {
+    id = list_entry(pos, dynid_t, list);
+    if (id->vendor == vendor && id->product == product &&
+        (!known_only || id->bus >= 0))
+      refs++;
+  }
+
+  return refs;
+}
+
+static int
+vusb_write_id(int *fd, const char *path, int vendor, int product)
+{
+  char command[64];
+  int len;
 
-  fd = open(path, O_WRONLY);
-  if (fd == -1) {
+  if (*fd < 0)
+    *fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (*fd < 0) {
     xd_log(LOG_ERR, "%s: failed to open %s", __func__, path);
-    return (-1);
+    return -1;
   }
 
-  snprintf(command, sizeof (command), "%x %x\n", vendor, product);
+  len = snprintf(command, sizeof (command), "%x %x\n", vendor, product);
+  /* Each write to a sysfs attribute is a new command */
+  if (pwrite(*fd, command, len, 0) != len) {
+    xd_log(LOG_ERR, "%s: failed to write %s: %s", __func__, path, strerror(errno));
+    return -1;
+  }
 
-  if (write(fd, command, strlen(command)) == -1)
-    ret = -1;
-  if (close(fd) == -1)
-    ret = -1;
+  return 0;
+}
+
+/**
+ * Assign or unassign a device to vusb, in the same domain. Only the
+ * first assignment of a VID:PID adds the dynamic ID to the driver, and
+ * only the last unassignment removes it.
+ *
+ * @param vendor The vendor ID of the device
+ * @param product The product ID of the device
+ * @param bus The bus ID of the device
+ * @param dev The ID of the device on the bus
+ * @param add 1 to assign, 0 to unassign
+ *
+ * @return 0 on success, -1 on failure
+ */
+int
+vusb_assign_local(int vendor, int product, int bus, int dev, int add)
+{
+  dynid_t *id;
+
+  xd_log(LOG_INFO, "%s: %04x:%04x %d-%d add=%d", __func__, vendor, product,
+         bus, dev, add);
+
+  if (!dynids_loaded)
+    dynids_load();
+
+  id = dynids_find(vendor, product, bus, dev);
+  if (add) {
+    if (id != NULL)
+      /* Already assigned */
+      return 0;
+    if (dynids_count(vendor, product, false) == 0 &&
+        vusb_write_id(&vusb_add_fd, VUSB_ADD_DEV, vendor, product) != 0)
+      return -1;
+    id = malloc(sizeof(dynid_t));
+    id->vendor = vendor;
+    id->product = product;
+    id->bus = bus;
+    id->dev = dev;
+    list_add(&id->list, &dynids);
+    return 0;
+  }
+
+  if (id != NULL) {
+    list_del(&id->list);
+    free(id);
+  } else if (dynids_count(vendor, product, false) == 0)
+    /* Not assigned */
+    return 0;
+  if (dynids_count(vendor, product, true) > 0)
+    /* Still used by an identical device */
+    return 0;
+
+  /* Nobody knows who the IDs from a previous run were for, they go
+   * with the last device we know about */
+  while ((id = dynids_find(vendor, product, -1, -1)) != NULL) {
+    list_del(&id->list);
+    free(id);
+  }
+
+  return vusb_write_id(&vusb_del_fd, VUSB_DEL_DEV, vendor, product);
+}
 
-  return (ret);
+/**
+ * Forget a device that went away while assigned to vusb
+ */
+void
+vusb_forget_local(int bus, int dev)
+{
+  struct list_head *pos, *tmp;
+  dynid_t *id;
+
+  list_for_each_safe(pos, tmp, &dynids) {
+    id = list_entry(pos, dynid_t, list);
+    if (id->bus == bus && id->dev == dev) {
+      vusb_assign_local(id->vendor, id->product, bus, dev, 0);
+      return;
+    }
+  }
 }
 
 static int
@@ -73,9 +241,10 @@ vusb_assign_remote(int vendor, int product, int bus, int dev, int add)
   /* Set to either "0" or "1" */
   add_str[0] += (add == 1);
 
-  path = xasprintf("%s/data/usb/dev%x-%x/assign", xs_backend_path, bus, dev);
+  path = xasprintf("%s/data/usb/dev%d-%d/assign", xs_backend_path, bus, dev);
 
   ret = xs_write(xs_handle, XBT_NULL, path, add_str, strlen(add_str));
+  xenstore_cache_invalidate(path);
 
   free(path);
 
@@ -95,7 +264,7 @@ vusb_assign(int vendor, int product, int bus, int dev, int add)
   if (usb_backend_domid > 0) {
     return vusb_assign_remote(vendor, product, bus, dev, add);
   } else {
-    return vusb_assign_local(vendor, product, add);
+    return vusb_assign_local(vendor, product, bus, dev, add);
   }
 }
 
@@ -133,10 +302,8 @@ usbowls_build_usbinfo(int bus, int dev, int vendor, int product, usbinfo_t *ui)
 static int
 get_usbinfo(int bus, int dev, usbinfo_t *ui)
 {
-  struct udev_enumerate *enumerate;
-  struct udev_list_entry *devices, *dev_list_entry;
   struct udev_device *udev_dev;
-  char bus_str[16], dev_str[16];
+  const char *vendor_str, *product_str, *busnum, *devnum;
   int vendor, product;
   device_t *device;
 
@@ -153,136 +320,422 @@ get_usbinfo(int bus, int dev, usbinfo_t *ui)
     }
   }
 
-  xd_log(LOG_ERR, "%s: device_lookup failed, falling back to udev", __func__);
-
-  enumerate = udev_enumerate_new(udev_handle);
-  if (!enumerate) {
-    xd_log(LOG_ERR, "Can't create enumeration");
-    return -ENOMEM;
+  /* The device may still be settling, its event gave us its IDs */
+  if (udev_index_lookup(bus, dev, &vendor, &product) == 0) {
+    xd_log(LOG_DEBUG, "%s: device %d-%d not listed yet, using the event index",
+           __func__, bus, dev);
+    return usbowls_build_usbinfo(bus, dev, vendor, product, ui);
   }
 
-  snprintf(bus_str, sizeof(bus_str), "%d", bus);
-  snprintf(dev_str, sizeof(dev_str), "%d", dev);
-
-  udev_enumerate_add_match_subsystem(enumerate, "usb");
-  udev_enumerate_add_match_sysattr(enumerate, "busnum", bus_str);
-  udev_enumerate_add_match_sysattr(enumerate, "devnum", dev_str);
-  udev_enumerate_scan_devices(enumerate);
-  devices = udev_enumerate_get_list_entry(enumerate);
-  udev_list_entry_foreach(dev_list_entry, devices) {
-    const char *path;
-
-    path = udev_list_entry_get_name(dev_list_entry);
-    udev_dev = udev_device_new_from_syspath(udev_handle, path);
-    sscanf(udev_device_get_sysattr_value(udev_dev, "idVendor"), "%x", &vendor);
-    sscanf(udev_device_get_sysattr_value(udev_dev, "idProduct"), "%x", &product);
+  /* Last resort, straight to the device node, no enumeration needed */
+  xd_log(LOG_ERR, "%s: device_lookup failed, falling back to sysfs", __func__);
+  udev_dev = udev_device_new_from_devnum(udev_handle, 'c',
+                                         makedev(USB_DEVICE_MAJOR,
+                                                 (bus - 1) * 128 + dev - 1));
+  if (udev_dev == NULL)
+    return -ENOENT;
+  busnum = udev_device_get_sysattr_value(udev_dev, "busnum");
+  devnum = udev_device_get_sysattr_value(udev_dev, "devnum");
+  vendor_str = udev_device_get_sysattr_value(udev_dev, "idVendor");
+  product_str = udev_device_get_sysattr_value(udev_dev, "idProduct");
+  if (busnum == NULL || strtol(busnum, NULL, 10) != bus ||
+      devnum == NULL || strtol(devnum, NULL, 10) != dev ||
+      vendor_str == NULL || product_str == NULL) {
     udev_device_unref(udev_dev);
-    udev_enumerate_unref(enumerate);
-    return usbowls_build_usbinfo(bus, dev, vendor, product, ui);
+    return -ENOENT;
   }
-  udev_enumerate_unref(enumerate);
-  return -ENOENT;
+  vendor = strtol(vendor_str, NULL, 16);
+  product = strtol(product_str, NULL, 16);
+  udev_device_unref(udev_dev);
+
+  return usbowls_build_usbinfo(bus, dev, vendor, product, ui);
 }
 
-/* static void */
-/* dump_dev(usbinfo_t *ui) */
-/* { */
-/*   xd_log(LOG_INFO, "bus %d device %d vendor %04x product %04x virtid %06x", */
-/*          ui->usb_bus, ui->usb_device, ui->usb_vendor, ui->usb_product, ui->usb_virtid); */
-/* } */
+static staged_t*
+staged_lookup(int bus, int device)
+{
+  struct list_head *pos;
+  staged_t *st;
+
+  list_for_each(pos, &staged) {
+    st = list_entry(pos, staged_t, list);
+    if (st->bus == bus && st->device == device)
+      return st;
+  }
+
+  return NULL;
+}
+
+/* Tear down the nodes of a staged device, unless keep is set */
+static void
+staged_forget(staged_t *st, bool keep)
+{
+  dominfo_t *di;
+  usbinfo_t ui;
+
+  if (!keep &&
+      usbowls_build_usbinfo(st->bus, st->device, st->vendor, st->product, &ui) == 0) {
+    di = xenstore_get_dominfo(st->domid);
+    if (di != NULL) {
+      xenstore_destroy_usb(di, &ui);
+      xenstore_put_dominfo(di);
+    }
+  }
+  list_del(&st->list);
+  free(st);
+}
 
 /**
- * "Plug" a device to a VM.
- * xenstore_create_usb() will be called to "attach" the device, then
- * vusb_assign() will "assign" it.
+ * Get a device ready to be plugged to a VM, before the device is fully
+ * known. The XenStore nodes get created, so the frontend and the
+ * backend can connect, but the device isn't assigned: that's for
+ * usbowls_plug_device(), which will skip the creation.
+ * A staged device that doesn't get plugged to that VM has to be
+ * unstaged.
  *
- * @param domid The domid of the VM to plug the device to
+ * @param domid The domid of the VM the device should go to
  * @param bus The bus ID of the device
  * @param device The ID of the device on the bus
+ * @param vendor The vendor ID of the device
+ * @param product The product ID of the device
  *
  * @return 0 for success, 1 for failure
  */
 int
-usbowls_plug_device(int domid, int bus, int device)
+usbowls_stage_device(int domid, int bus, int device, int vendor, int product)
 {
-  dominfo_t di;
+  dominfo_t *di;
   usbinfo_t ui;
+  staged_t *st;
   int ret;
 
-  ret = xenstore_get_dominfo(domid, &di);
+  if (staged_lookup(bus, device) != NULL)
+    return 0;
+  if (usbowls_build_usbinfo(bus, device, vendor, product, &ui) != 0)
+    return 1;
+  di = xenstore_get_dominfo(domid);
+  if (di == NULL)
+    return 1;
+
+  ret = xenstore_create_usb(di, &ui);
+  xenstore_put_dominfo(di);
   if (ret != 0) {
-    xd_log(LOG_ERR, "Invalid domid %d", domid);
+    xd_log(LOG_WARNING, "Failed to stage device %d-%d for domain %d",
+           bus, device, domid);
     return 1;
   }
-  ret = get_usbinfo(bus, device, &ui);
-  if (ret != 0) {
-    xd_log(LOG_ERR, "Invalid device %d-%d", bus, device);
+
+  st = malloc(sizeof(staged_t));
+  st->domid = domid;
+  st->bus = bus;
+  st->device = device;
+  st->vendor = vendor;
+  st->product = product;
+  list_add(&st->list, &staged);
+  xd_log(LOG_INFO, "Staged device %d-%d (%04x:%04x) for domain %d",
+         bus, device, vendor, product, domid);
+
+  return 0;
+}
+
+/**
+ * Tear down the XenStore nodes of a staged device that didn't get
+ * plugged. Does nothing if the device isn't staged.
+ *
+ * @param bus The bus ID of the device
+ * @param device The ID of the device on the bus
+ */
+void
+usbowls_unstage_device(int bus, int device)
+{
+  staged_t *st;
+
+  st = staged_lookup(bus, device);
+  if (st == NULL)
+    return;
+  xd_log(LOG_INFO, "Unstaging device %d-%d from domain %d",
+         bus, device, st->domid);
+  staged_forget(st, false);
+}
+
+/**
+ * Tear down the XenStore nodes of all the devices staged for a domain,
+ * when it goes away before they got plugged
+ *
+ * @param domid The domid of the domain
+ */
+void
+usbowls_unstage_domain(int domid)
+{
+  struct list_head *pos, *tmp;
+  staged_t *st;
+
+  list_for_each_safe(pos, tmp, &staged) {
+    st = list_entry(pos, staged_t, list);
+    if (st->domid != domid)
+      continue;
+    xd_log(LOG_INFO, "Unstaging device %d-%d from domain %d",
+           st->bus, st->device, domid);
+    staged_forget(st, false);
+  }
+}
+
+/* static void */
+/* dump_dev(usbinfo_t *ui) */
+/* { */
+/*   xd_log(LOG_INFO, "bus %d device %d vendor %04x product %04x virtid %06x", */
+/*          ui->usb_bus, ui->usb_device, ui->usb_vendor, ui->usb_product, ui->usb_virtid); */
+/* } */
+
+/**
+ * "Plug" devices to a VM, all at once.
+ * xenstore_create_usb() gets called to "attach" every device that
+ * wasn't staged for that VM, then all the frontends and backends get
+ * to connect in parallel, and vusb_assign() "assigns" the devices that
+ * made it. Plugging n devices costs about as much as plugging the
+ * slowest one.
+ *
+ * @param domid The domid of the VM to plug the devices to
+ * @param count The number of devices
+ * @param bus The bus IDs of the devices
+ * @param device The IDs of the devices on their bus
+ * @param results If not NULL, set to 0 or 1 for each device, like
+ *        usbowls_plug_device() would return
+ *
+ * @return 0 if all the devices got plugged, 1 otherwise
+ */
+int
+usbowls_plug_devices(int domid, int count, const int *bus, const int *device,
+                     int *results)
+{
+  dominfo_t *di;
+  usbinfo_t *ui;
+  staged_t *st;
+  device_t *dev;
+  cancel_t **cancel;
+  trace_op_t op;
+  struct timespec deadline;
+  int *res;
+  bool created;
+  int ret = 0;
+  int i;
+
+  trace_begin(&op, false, domid, count, bus[0], device[0]);
+  di = xenstore_get_dominfo(domid);
+  trace_stage(&op, TRACE_DOMINFO);
+  if (di == NULL) {
+    xd_log(LOG_ERR, "Invalid domid %d", domid);
+    for (i = 0; results != NULL && i < count; ++i)
+      results[i] = 1;
+    trace_end(&op, 1);
     return 1;
   }
 
+  ui = calloc(count, sizeof(usbinfo_t));
+  cancel = calloc(count, sizeof(cancel_t *));
+  res = calloc(count, sizeof(int));
+
   /* FIXME: nicely unbind dom0 drivers on interfaces?
    * Or not, USB supports hot unplug doesn't it? :)
    */
 
-  ret = xenstore_create_usb(&di, &ui);
-  if (ret != 0) {
-    xd_log(LOG_ERR, "Failed to attach device");
-    return 1;
+  /* Create all the nodes first. The nodes may already be there, if we
+   * guessed right */
+  for (i = 0; i < count; ++i) {
+    ret = get_usbinfo(bus[i], device[i], &ui[i]);
+    trace_stage(&op, TRACE_USBINFO);
+    if (ret != 0) {
+      xd_log(LOG_ERR, "Invalid device %d-%d", bus[i], device[i]);
+      res[i] = 1;
+      continue;
+    }
+    created = false;
+    st = staged_lookup(bus[i], device[i]);
+    if (st != NULL) {
+      created = (st->domid == domid);
+      staged_forget(st, created);
+    }
+    ret = created ? 0 : xenstore_create_usb(di, &ui[i]);
+    trace_stage(&op, TRACE_CREATE);
+    if (ret != 0) {
+      xd_log(LOG_ERR, "Failed to attach device %d-%d", bus[i], device[i]);
+      res[i] = 1;
+      continue;
+    }
+    /* Don't wait for the VM if the device is gone */
+    dev = device_lookup(bus[i], device[i]);
+    cancel[i] = cancel_new(bus[i], device[i],
+                           (dev != NULL && dev->udev != NULL) ?
+                           udev_device_get_syspath(dev->udev) : NULL);
   }
 
-  if (xenstore_wait_for_online(&di, &ui) < 0)
-    xd_log(LOG_ERR, "The frontend or the backend didn't go online, continue anyway");
+  /* Then wait for them. They're all connecting at the same time, so
+   * they all get the same deadline */
+  xenstore_wait_deadline(&deadline);
+  for (i = 0; i < count; ++i) {
+    if (res[i] != 0)
+      continue;
+    if (xenstore_wait_for_online(di, &ui[i], cancel[i], &deadline) < 0 &&
+        !cancel_requested(cancel[i]))
+      xd_log(LOG_ERR, "The frontend or the backend didn't go online, continue anyway");
+    trace_stage(&op, TRACE_ONLINE);
+    if (cancel_requested(cancel[i])) {
+      xd_log(LOG_INFO, "Device %d-%d went away while being plugged",
+             bus[i], device[i]);
+      xenstore_destroy_usb(di, &ui[i]);
+      trace_stage(&op, TRACE_DESTROY);
+      res[i] = 1;
+    }
+  }
 
-  ret = vusb_assign(ui.usb_vendor, ui.usb_product, bus, device, 1);
-  if (ret != 0) {
-    xd_log(LOG_ERR, "Failed to assign device");
-    xenstore_destroy_usb(&di, &ui);
-    return 1;
+  for (i = 0; i < count; ++i) {
+    cancel_free(cancel[i]);
+    if (res[i] != 0)
+      continue;
+    ret = vusb_assign(ui[i].usb_vendor, ui[i].usb_product,
+                      bus[i], device[i], 1);
+    trace_stage(&op, TRACE_ASSIGN);
+    if (ret != 0) {
+      xd_log(LOG_ERR, "Failed to assign device %d-%d", bus[i], device[i]);
+      xenstore_destroy_usb(di, &ui[i]);
+      trace_stage(&op, TRACE_DESTROY);
+      res[i] = 1;
+    }
   }
 
-  return 0;
+  ret = 0;
+  for (i = 0; i < count; ++i) {
+    if (res[i] != 0)
+      ret = 1;
+    if (results != NULL)
+      results[i] = res[i];
+  }
+
+  free(res);
+  free(cancel);
+  free(ui);
+  xenstore_put_dominfo(di);
+  trace_end(&op, ret);
+
+  return ret;
 }
 
 /**
- * "Unplug" a device from a VM.
- * vusb_unassign() will "unassign" it, then
- * xenstore_create_usb() will be called to "detach" the device.
+ * "Plug" a device to a VM.
+ * xenstore_create_usb() will be called to "attach" the device, unless
+ * it was staged for that VM, then vusb_assign() will "assign" it.
  *
- * @param domid The domid of the VM to unplug the device from
+ * @param domid The domid of the VM to plug the device to
  * @param bus The bus ID of the device
  * @param device The ID of the device on the bus
  *
  * @return 0 for success, 1 for failure
  */
 int
-usbowls_unplug_device(int domid, int bus, int device)
+usbowls_plug_device(int domid, int bus, int device)
 {
-  dominfo_t di;
-  usbinfo_t ui;
-  int ret;
+  return usbowls_plug_devices(domid, 1, &bus, &device, NULL);
+}
 
-  ret = xenstore_get_dominfo(domid, &di);
-  if (ret != 0) {
+/**
+ * "Unplug" devices from a VM, all at once.
+ * vusb_unassign() will "unassign" them, then xenstore_destroy_usbs()
+ * will be called to "detach" all of them together.
+ *
+ * @param domid The domid of the VM to unplug the devices from
+ * @param count The number of devices
+ * @param bus The bus IDs of the devices
+ * @param device The IDs of the devices on their bus
+ * @param results If not NULL, set to 0 or 1 for each device, like
+ *        usbowls_unplug_device() would return
+ *
+ * @return 0 if all the devices got unplugged, 1 otherwise
+ */
+int
+usbowls_unplug_devices(int domid, int count, const int *bus, const int *device,
+                       int *results)
+{
+  dominfo_t *di;
+  usbinfo_t *ui;
+  int *res, *destroyed;
+  trace_op_t op;
+  int n = 0;
+  int ret = 0;
+  int i, j;
+
+  trace_begin(&op, true, domid, count, bus[0], device[0]);
+  di = xenstore_get_dominfo(domid);
+  trace_stage(&op, TRACE_DOMINFO);
+  if (di == NULL) {
     xd_log(LOG_ERR, "Invalid domid %d", domid);
-    return 1;
-  }
-  ret = get_usbinfo(bus, device, &ui);
-  if (ret != 0) {
-    xd_log(LOG_ERR, "Invalid device %d-%d", bus, device);
+    for (i = 0; results != NULL && i < count; ++i)
+      results[i] = 1;
+    trace_end(&op, 1);
     return 1;
   }
 
-  ret = vusb_assign(ui.usb_vendor, ui.usb_product, bus, device, 0);
-  if (ret != 0) {
-    xd_log(LOG_ERR, "Failed to unassign device");
-    return 1;
+  /* ui only holds the devices that get detached, packed */
+  ui = calloc(count, sizeof(usbinfo_t));
+  res = calloc(count, sizeof(int));
+  destroyed = calloc(count, sizeof(int));
+
+  for (i = 0; i < count; ++i) {
+    ret = get_usbinfo(bus[i], device[i], &ui[n]);
+    trace_stage(&op, TRACE_USBINFO);
+    if (ret != 0) {
+      xd_log(LOG_ERR, "Invalid device %d-%d", bus[i], device[i]);
+      res[i] = 1;
+      continue;
+    }
+    ret = vusb_assign(ui[n].usb_vendor, ui[n].usb_product,
+                      bus[i], device[i], 0);
+    trace_stage(&op, TRACE_ASSIGN);
+    if (ret != 0) {
+      xd_log(LOG_ERR, "Failed to unassign device %d-%d", bus[i], device[i]);
+      res[i] = 1;
+      continue;
+    }
+    n++;
   }
 
-  ret = xenstore_destroy_usb(&di, &ui);
-  if (ret != 0) {
-    xd_log(LOG_ERR, "Failed to detach device");
-    return 1;
+  if (n > 0)
+    xenstore_destroy_usbs(di, ui, n, destroyed);
+  trace_stage(&op, TRACE_DESTROY);
+
+  ret = 0;
+  for (i = 0, j = 0; i < count; ++i) {
+    if (res[i] == 0 && destroyed[j++] != 0) {
+      xd_log(LOG_ERR, "Failed to detach device %d-%d", bus[i], device[i]);
+      res[i] = 1;
+    }
+    if (res[i] != 0)
+      ret = 1;
+    if (results != NULL)
+      results[i] = res[i];
   }
 
-  return 0;
+  free(destroyed);
+  free(res);
+  free(ui);
+  xenstore_put_dominfo(di);
+  trace_end(&op, ret);
+
+  return ret;
+}
+
+/**
+ * "Unplug" a device from a VM.
+ * vusb_unassign() will "unassign" it, then
+ * xenstore_create_usb() will be called to "detach" the device.
+ *
+ * @param domid The domid of the VM to unplug the device from
+ * @param bus The bus ID of the device
+ * @param device The ID of the device on the bus
+ *
+ * @return 0 for success, 1 for failure
+ */
+int
+usbowls_unplug_device(int domid, int bus, int device)
+{
+  return usbowls_unplug_devices(domid, 1, &bus, &device, NULL);
 }
@@ -169,6 +169,8 @@ vm_del(const int domid)
 
   xd_log(LOG_INFO, "Deleting vm, domid=%d, uuid=%s", vm->domid, vm->uuid);
   list_del(pos);
+  xenstore_forget_dominfo(domid);
+  xenstore_forget_states(domid);
 
   /**
    * XXX should we reset usb_backend_domid to 0 and let it pass through?
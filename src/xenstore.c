@@ -37,9 +37,75 @@ int usb_backend_domid = 0;
 int my_domid = -1;
 char *watch_path;
 char *watch_token = "usb_dev_watch";
-#define ASSIGN_PREFIX "assign:"
+#define ASSIGN_TOKEN "usb_assign" /**< Watch on our own data/usb, in stub mode */
+
+#define XSDEV_PATH_MAX     64   /**< Enough for data/usb/devN-M/<field> */
+#define XSDEV_MAX_RETRIES  8    /**< Attempts at a conflicting transaction */
+#define XSDEV_BACKOFF_US   1000 /**< First retry delay, doubled every time */
+#define XSDEV_RECORD_VERSION 1  /**< Version of the packed "record" node */
+#define XSDEV_RECORD_MAX   1024 /**< Maximum size of a packed record */
+#define WAIT_CANCEL_SLICE  100  /**< Milliseconds between unplug checks in waits */
+#define WAIT_TIMEOUT       5    /**< Seconds to wait for frontends and backends */
 
 static struct xs_handle *xs_state_handle;
+static xspipe_t *xs_pipe = NULL; /**< Pipelined connection, for the vusb nodes */
+
+/**
+ * Cache of the domain information, see xenstore_get_dominfo()
+ */
+static LIST_HEAD(dominfos);
+static bool dominfo_caching = false; /**< Set once the domain watches are up */
+static bool xsdev_assign_watched = false; /**< Set once data/usb is watched, in stub mode */
+
+/**
+ * Domains that exist, tracked to spot the new ones when pre-staging,
+ * see xenstore_prestage_enable()
+ */
+typedef struct {
+  struct list_head list;
+  int domid;
+  bool seen;
+} xs_domain_t;
+static LIST_HEAD(xs_domains);
+static bool prestage = false;
+
+/**
+ * Read-through cache of XenStore values, only for paths covered by
+ * one of our watches. Watch events, our own writes and domains going
+ * away invalidate entries.
+ * Entries are hashed by path, and by every one of their ancestors so
+ * that a subtree can be invalidated without walking the whole cache.
+ */
+#define XS_CACHE_BUCKETS 128 /**< Power of 2 */
+#define XS_CACHE_MAX     512 /**< The cache gets flushed past that */
+#define XS_CACHE_DEPTH   12  /**< Deeper paths don't get cached */
+
+typedef struct xs_cache_entry xs_cache_entry_t;
+
+typedef struct {
+  struct hlist_node node; /**< Item of the ancestor hash table */
+  uint32_t hash;          /**< Hash of the ancestor path */
+  xs_cache_entry_t *e;
+} xs_cache_link_t;
+
+struct xs_cache_entry {
+  struct hlist_node node; /**< Hash table item */
+  uint32_t hash;
+  char *path;
+  char *value;
+  unsigned int len;
+  int n_links;
+  xs_cache_link_t links[XS_CACHE_DEPTH]; /**< One per ancestor */
+};
+
+static struct hlist_head xs_cache[XS_CACHE_BUCKETS];
+static struct hlist_head xs_cache_under[XS_CACHE_BUCKETS]; /**< Entries by ancestor */
+static int xs_cache_entries = 0;
+static unsigned long xs_cache_hits = 0;
+static unsigned long xs_cache_misses = 0;
+#define DOMINFO_TOKEN "dominfo"
+
+void xsdev_assigning(char *path, char *token);
 
 static void*
 xmalloc(size_t size)
@@ -78,6 +144,246 @@ xasprintf(const char *fmt, ...)
   return s;
 }
 
+/**
+ * FNV-1a hash, for hash tables and checksums
+ */
+uint32_t
+fnv1a_hash(const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  uint32_t hash = 2166136261U;
+
+  while (len-- > 0) {
+    hash ^= *p++;
+    hash *= 16777619U;
+  }
+
+  return hash;
+}
+
+static void
+xs_cache_free(xs_cache_entry_t *e)
+{
+  int i;
+
+  hlist_del(&e->node);
+  for (i = 0; i < e->n_links; ++i)
+    hlist_del(&e->links[i].node);
+  free(e->path);
+  free(e->value);
+  free(e);
+  xs_cache_entries--;
+}
+
+static void
+xs_cache_flush(void)
+{
+  struct hlist_node *pos, *tmp;
+  int i;
+
+  for (i = 0; i < XS_CACHE_BUCKETS; ++i)
+    hlist_for_each_safe(pos, tmp, &xs_cache[i])
+      xs_cache_free(hlist_entry(pos, xs_cache_entry_t, node));
+}
+
+static bool
+xs_cache_prefix(const char *path, const char *prefix)
+{
+  size_t len;
+
+  if (prefix == NULL)
+    return false;
+  len = strlen(prefix);
+
+  return (strncmp(path, prefix, len) == 0 && path[len] == '/');
+}
+
+/*
+ * Check if a path is one of the keys of a domain that don't change
+ * during its life
+ */
+static bool
+xs_cache_domain_key(const char *path)
+{
+  const char *p;
+
+  if (strncmp(path, "/local/domain/", 14) != 0)
+    return false;
+  p = path + 14;
+  if (*p < '0' || *p > '9')
+    return false;
+  while (*p >= '0' && *p <= '9')
+    p++;
+
+  return (!strcmp(p, "/vm") || !strcmp(p, "/target") || !strcmp(p, "/name"));
+}
+
+/*
+ * Check if a watch will tell us when a path changes.
+ * Domain nodes are only invalidated when domains come and go, so only
+ * the keys that don't change during the life of a domain get cached.
+ */
+static bool
+xs_cache_covered(const char *path)
+{
+  char prefix[256];
+
+  if (xs_state_handle != NULL && xs_backend_path != NULL) {
+    snprintf(prefix, sizeof(prefix), "%s/backend/vusb", xs_backend_path);
+    if (xs_cache_prefix(path, prefix))
+      return true;
+  }
+  if (xs_cache_prefix(path, watch_path))
+    return true;
+  if (xsdev_assign_watched && xs_cache_prefix(path, "data/usb"))
+    return true;
+  if (dominfo_caching && xs_cache_domain_key(path))
+    return true;
+
+  return false;
+}
+
+/*
+ * xs_read() through the cache. The caller must free the result.
+ */
+static char*
+xs_cache_read(const char *path, unsigned int *len)
+{
+  struct hlist_node *pos, *tmp;
+  struct hlist_head *bucket;
+  xs_cache_entry_t *e;
+  xs_cache_link_t *link;
+  uint32_t hash;
+  unsigned int l = 0;
+  char *value, *res;
+  int depth = 0;
+  int i;
+
+  hash = fnv1a_hash(path, strlen(path));
+  bucket = &xs_cache[hash & (XS_CACHE_BUCKETS - 1)];
+  hlist_for_each_safe(pos, tmp, bucket) {
+    e = hlist_entry(pos, xs_cache_entry_t, node);
+    if (e->hash == hash && strcmp(e->path, path) == 0) {
+      xs_cache_hits++;
+      res = xmalloc(e->len + 1);
+      memcpy(res, e->value, e->len + 1);
+      if (len != NULL)
+        *len = e->len;
+      return res;
+    }
+  }
+
+  xs_cache_misses++;
+  value = xs_read(xs_handle, XBT_NULL, path, &l);
+  if (value == NULL || !xs_cache_covered(path))
+    goto out;
+  for (i = 1; path[i] != '\0'; ++i)
+    depth += (path[i] == '/');
+  if (depth > XS_CACHE_DEPTH)
+    goto out;
+
+  if (xs_cache_entries >= XS_CACHE_MAX)
+    xs_cache_flush();
+  e = xmalloc(sizeof(xs_cache_entry_t));
+  e->hash = hash;
+  e->path = strdup(path);
+  e->value = xmalloc(l + 1);
+  memcpy(e->value, value, l);
+  e->value[l] = '\0';
+  e->len = l;
+  hlist_add_head(&e->node, bucket);
+  e->n_links = 0;
+  for (i = 1; path[i] != '\0'; ++i) {
+    if (path[i] != '/')
+      continue;
+    link = &e->links[e->n_links++];
+    link->hash = fnv1a_hash(path, i);
+    link->e = e;
+    hlist_add_head(&link->node, &xs_cache_under[link->hash & (XS_CACHE_BUCKETS - 1)]);
+  }
+  xs_cache_entries++;
+
+ out:
+  if (len != NULL)
+    *len = l;
+  return value;
+}
+
+/**
+ * Drop a path and everything under it from the XenStore read cache.
+ * Call this after writing to XenStore.
+ */
+void
+xenstore_cache_invalidate(const char *path)
+{
+  struct hlist_node *pos, *tmp;
+  xs_cache_entry_t *e;
+  xs_cache_link_t *link;
+  size_t len = strlen(path);
+  uint32_t hash;
+  bool freed;
+
+  if (xs_cache_entries == 0)
+    return;
+
+  hash = fnv1a_hash(path, len);
+  hlist_for_each_safe(pos, tmp, &xs_cache[hash & (XS_CACHE_BUCKETS - 1)]) {
+    e = hlist_entry(pos, xs_cache_entry_t, node);
+    if (e->hash == hash && strcmp(e->path, path) == 0)
+      xs_cache_free(e);
+  }
+
+  /* Freeing an entry unlinks all its ancestors, which may include the
+   * next item of the bucket, so start over after each one */
+  do {
+    freed = false;
+    hlist_for_each_safe(pos, tmp, &xs_cache_under[hash & (XS_CACHE_BUCKETS - 1)]) {
+      link = hlist_entry(pos, xs_cache_link_t, node);
+      if (link->hash == hash && strncmp(link->e->path, path, len) == 0 &&
+          link->e->path[len] == '/') {
+        xs_cache_free(link->e);
+        freed = true;
+        break;
+      }
+    }
+  } while (freed);
+}
+
+/**
+ * Get the XenStore read cache counters
+ */
+void
+xenstore_cache_stats(unsigned long *hits, unsigned long *misses, int *entries)
+{
+  *hits = xs_cache_hits;
+  *misses = xs_cache_misses;
+  *entries = xs_cache_entries;
+}
+
+/*
+ * Parse a "dev<bus>-<dev>" node name.
+ * Returns a pointer to what follows it, or NULL if it doesn't match.
+ */
+static const char*
+xsdev_parse_ids(const char *name, int *busid, int *devid)
+{
+  char *end;
+
+  if (strncmp(name, "dev", 3) != 0)
+    return NULL;
+  name += 3;
+  if (*name < '0' || *name > '9')
+    return NULL;
+  *busid = strtol(name, &end, 10);
+  if (*end != '-' || end[1] < '0' || end[1] > '9')
+    return NULL;
+  *devid = strtol(end + 1, &end, 10);
+  if (*end != '\0' && *end != '/')
+    return NULL;
+
+  return end;
+}
+
 /*
  * Create a new directory in Xenstore
  */
@@ -108,6 +414,8 @@ xenstore_add_dir(xs_transaction_t xt, char *path, int d0, int p0, int d1, int p1
 
 /**
  * Read the xenstore node of a specific VM (/local/domain/<domid>/<path>)
+ * The value is cached until the domain goes away, this is meant for
+ * keys that don't change during the life of a domain.
  *
  * @param domid The domid of the VM
  * @param format The printf format of the subpath to read, followed by
@@ -118,79 +426,113 @@ xenstore_add_dir(xs_transaction_t xt, char *path, int d0, int p0, int d1, int p1
 char*
 xenstore_dom_read(unsigned int domid, const char *format, ...)
 {
-  char *domain_path;
+  dominfo_t *di;
   va_list arg;
-  char *ret = NULL;
-  char *buff = NULL;
-
-  domain_path = xs_get_domain_path(xs_handle, domid);
+  char buff[256];
+  int len;
 
-  if (!domain_path)
+  di = xenstore_get_dominfo(domid);
+  if (di == NULL)
     return NULL;
 
-  buff = xasprintf("%s/%s", domain_path, format);
-  free(domain_path);
-
+  len = snprintf(buff, sizeof(buff), "%s/", di->di_dompath);
+  xenstore_put_dominfo(di);
   va_start(arg, format);
-  ret = xs_read(xs_handle, XBT_NULL, buff, NULL);
+  vsnprintf(buff + len, sizeof(buff) - len, format, arg);
   va_end(arg);
 
-  free(buff);
-
-  return ret;
+  return xs_cache_read(buff, NULL);
 }
 
 /**
- * Fill the domain information for a given VM
+ * Get the domain information for a given VM.
+ * The information is cached until the domain goes away, the returned
+ * record is shared and must be released with xenstore_put_dominfo().
  *
  * @param domid The domid of the VM
- * @param di The domain information to fill
  *
- * @return 0 on success, -ENOENT on failure
+ * @return The domain information, or NULL on failure
  */
-int
-xenstore_get_dominfo(int domid, dominfo_t *di)
+dominfo_t*
+xenstore_get_dominfo(int domid)
 {
+  dominfo_t *di;
+
+  list_for_each_entry(di, &dominfos, list) {
+    if (di->di_domid == domid) {
+      di->refs++;
+      return di;
+    }
+  }
+
+  di = xmalloc(sizeof(dominfo_t));
   di->di_domid = domid;
   di->di_dompath = xs_get_domain_path(xs_handle, di->di_domid);
   if (!di->di_dompath) {
     xd_log(LOG_ERR, "Could not get domain %d path from xenstore", domid);
-    return -ENOENT;
+    free(di);
+    return NULL;
   }
   di->di_name = xasprintf("Domain-%d", domid);
-  return 0;
+  di->refs = 1;
+  if (dominfo_caching) {
+    /* One more reference for the cache */
+    di->refs++;
+    list_add(&di->list, &dominfos);
+  }
+
+  return di;
 }
 
-static char*
-xenstore_get_keyval(char *path, char *key)
+/**
+ * Release a domain information record from xenstore_get_dominfo()
+ */
+void
+xenstore_put_dominfo(dominfo_t *di)
 {
-  char tmppath[256];
-
-  snprintf(tmppath, sizeof(tmppath), "%s/%s", path, key);
+  if (di == NULL || --di->refs > 0)
+    return;
 
-  return xs_read(xs_handle, XBT_NULL, tmppath, NULL);
+  free(di->di_dompath);
+  free(di->di_name);
+  free(di);
 }
 
 /**
- * Write a single value into Xenstore.
+ * Drop a domain from the domain information cache. Records still in
+ * use stay valid until they're released.
+ *
+ * @param domid The domid of the VM, or -1 for all of them
  */
-static int
-xenstore_set_keyval(xs_transaction_t xt, char *path, char *key, char *val)
+void
+xenstore_forget_dominfo(int domid)
 {
-  char tmppath[256];
+  dominfo_t *di, *tmp;
+  char path[32];
 
-  if (key != NULL) {
-    snprintf(tmppath, sizeof (tmppath), "%s/%s", path, key);
-    path = tmppath;
+  list_for_each_entry_safe(di, tmp, &dominfos, list) {
+    if (domid == -1 || di->di_domid == domid) {
+      list_del(&di->list);
+      xenstore_put_dominfo(di);
+    }
   }
-  xd_log(LOG_DEBUG, "Writing to XenStore: %s = %s", path, val);
 
-  if (xs_write(xs_handle, xt, path, val, strlen(val)) == false) {
-    xd_log(LOG_ERR, "XenStore error writing %s", path);
-    return -1;
+  if (domid == -1)
+    xenstore_cache_invalidate("/local/domain");
+  else {
+    snprintf(path, sizeof(path), "/local/domain/%d", domid);
+    xenstore_cache_invalidate(path);
   }
+}
 
-  return 0;
+static char*
+xenstore_get_keyval(char *path, char *key)
+{
+  char tmppath[256];
+
+  snprintf(tmppath, sizeof(tmppath), "%s/%s", path, key);
+
+  return xs_cache_read(tmppath, NULL);
 }
 
 static char*
@@ -207,28 +549,284 @@ xenstore_dev_bepath(dominfo_t *domp, char *type, int devnum)
                     domp->di_domid, devnum));
 }
 
-void
-xenstore_get_xb_states(dominfo_t *domp, usbinfo_t *usbp, int *frontst, int *backst)
+/**
+ * XenbusState of the frontend and backend of a vusb device, kept up to
+ * date by the persistent watches on xs_state_handle
+ */
+typedef struct {
+  struct hlist_node node; /**< Hash table item */
+  int domid;
+  int virtid;
+  int frontst;            /**< XenbusState, or XB_STATE_GONE */
+  int backst;             /**< XenbusState, or XB_STATE_GONE */
+} xb_state_t;
+
+#define XB_STATE_GONE    -1   /**< The state node doesn't exist */
+#define XB_STATE_BUCKETS 64   /**< Power of 2 */
+#define XB_BACK_TOKEN    "vusb_back"
+#define XB_FRONT_TOKEN   "vusb_front"
+
+static struct hlist_head xb_states[XB_STATE_BUCKETS];
+
+/**
+ * Domains which device/vusb subtree is watched
+ */
+typedef struct {
+  struct list_head list;
+  int domid;
+} xb_watched_t;
+
+static LIST_HEAD(xb_watched);
+
+static struct hlist_head*
+xb_state_bucket(int domid, int virtid)
+{
+  return &xb_states[(domid * 31 + virtid) & (XB_STATE_BUCKETS - 1)];
+}
+
+static xb_state_t*
+xb_state_find(int domid, int virtid)
+{
+  struct hlist_node *pos, *tmp;
+  xb_state_t *st;
+
+  hlist_for_each_safe(pos, tmp, xb_state_bucket(domid, virtid)) {
+    st = hlist_entry(pos, xb_state_t, node);
+    if (st->domid == domid && st->virtid == virtid)
+      return st;
+  }
+
+  return NULL;
+}
+
+static xb_state_t*
+xb_state_get(int domid, int virtid)
+{
+  xb_state_t *st;
+
+  st = xb_state_find(domid, virtid);
+  if (st != NULL)
+    return st;
+
+  st = xmalloc(sizeof(xb_state_t));
+  st->domid = domid;
+  st->virtid = virtid;
+  st->frontst = XB_STATE_GONE;
+  st->backst = XB_STATE_GONE;
+  hlist_add_head(&st->node, xb_state_bucket(domid, virtid));
+
+  return st;
+}
+
+static int
+xb_state_read(const char *path)
 {
-  char *bepath, *fepath;
   char *v;
-  *frontst = XB_UNKNOWN;
-  *backst  = XB_UNKNOWN;
+  int state;
 
-  fepath = xenstore_dev_fepath(domp, "vusb", usbp->usb_virtid);
-  bepath = xenstore_dev_bepath(domp, "vusb", usbp->usb_virtid);
-  v = xenstore_get_keyval(fepath, "state");
-  if (v) {
-    *frontst = atoi(v);
-    free(v);
+  v = xs_read(xs_state_handle, XBT_NULL, path, NULL);
+  if (v == NULL)
+    return XB_STATE_GONE;
+  state = atoi(v);
+  free(v);
+
+  return state;
+}
+
+static void
+xb_state_read_front(xb_state_t *st)
+{
+  char path[256];
+
+  snprintf(path, sizeof(path), "/local/domain/%d/device/vusb/%d/state",
+           st->domid, st->virtid);
+  st->frontst = xb_state_read(path);
+}
+
+static void
+xb_state_read_back(xb_state_t *st)
+{
+  char path[256];
+
+  snprintf(path, sizeof(path), "%s/backend/vusb/%d/%d/state",
+           xs_backend_path, st->domid, st->virtid);
+  st->backst = xb_state_read(path);
+}
+
+/*
+ * Parse "<domid>/<virtid>" or "<virtid>" (when domid isn't NULL) out
+ * of a watch path. Only the device directory itself and its state
+ * node are interesting, NULL is returned for anything else.
+ */
+static const char*
+xb_state_parse(const char *p, int *domid, int *virtid)
+{
+  char *end;
+
+  if (domid != NULL) {
+    *domid = strtol(p, &end, 10);
+    if (end == p || *end != '/')
+      return NULL;
+    p = end + 1;
   }
-  v = xenstore_get_keyval(bepath, "state");
-  if (v) {
-    *backst = atoi(v);
-    free(v);
+  *virtid = strtol(p, &end, 10);
+  if (end == p || (*end != '\0' && strcmp(end, "/state") != 0))
+    return NULL;
+
+  return end;
+}
+
+static void
+xb_state_watch_event(char *path, char *token)
+{
+  xb_state_t *st;
+  size_t len;
+  int domid, virtid;
+
+  if (strcmp(token, XB_BACK_TOKEN) == 0) {
+    if (xs_backend_path == NULL)
+      return;
+    len = strlen(xs_backend_path);
+    if (strncmp(path, xs_backend_path, len) != 0 ||
+        strncmp(path + len, "/backend/vusb/", 14) != 0 ||
+        xb_state_parse(path + len + 14, &domid, &virtid) == NULL)
+      return;
+    st = xb_state_get(domid, virtid);
+    xb_state_read_back(st);
+  } else {
+    if (sscanf(path, "/local/domain/%d/device/vusb/", &domid) != 1)
+      return;
+    path = strstr(path, "/device/vusb/");
+    if (path == NULL ||
+        xb_state_parse(path + 13, NULL, &virtid) == NULL)
+      return;
+    st = xb_state_get(domid, virtid);
+    xb_state_read_front(st);
+  }
+}
+
+/*
+ * Watch the frontend devices of a domain, if that's not done already
+ */
+static void
+xb_state_watch_domain(dominfo_t *domp)
+{
+  xb_watched_t *w;
+  char path[256];
+
+  list_for_each_entry(w, &xb_watched, list) {
+    if (w->domid == domp->di_domid)
+      return;
+  }
+
+  snprintf(path, sizeof(path), "%s/device/vusb", domp->di_dompath);
+  if (xs_watch(xs_state_handle, path, XB_FRONT_TOKEN) == false) {
+    xd_log(LOG_ERR, "Failed to watch %s", path);
+    return;
+  }
+  w = xmalloc(sizeof(xb_watched_t));
+  w->domid = domp->di_domid;
+  list_add(&w->list, &xb_watched);
+}
+
+/*
+ * Watch the backend devices of the current backend domain
+ */
+static void
+xb_state_watch_backend(bool watch)
+{
+  char path[256];
+
+  if (xs_state_handle == NULL || xs_backend_path == NULL)
+    return;
+
+  snprintf(path, sizeof(path), "%s/backend/vusb", xs_backend_path);
+  if (watch)
+    xs_watch(xs_state_handle, path, XB_BACK_TOKEN);
+  else
+    xs_unwatch(xs_state_handle, path, XB_BACK_TOKEN);
+}
+
+/*
+ * Get the state entry of a device, reading the nodes the first time
+ * since they may predate the watches
+ */
+static xb_state_t*
+xb_state_lookup(dominfo_t *domp, int virtid)
+{
+  xb_state_t *st;
+
+  st = xb_state_find(domp->di_domid, virtid);
+  if (st == NULL) {
+    xb_state_watch_domain(domp);
+    st = xb_state_get(domp->di_domid, virtid);
+    xb_state_read_front(st);
+    xb_state_read_back(st);
+  }
+
+  return st;
+}
+
+/**
+ * Process the pending events of the state watches. To be called when
+ * the fd returned by xenstore_state_handle() is readable.
+ */
+void
+xenstore_state_event(void)
+{
+  char **ret;
+
+  while ((ret = xs_check_watch(xs_state_handle)) != NULL) {
+    xenstore_cache_invalidate(ret[XS_WATCH_PATH]);
+    xb_state_watch_event(ret[XS_WATCH_PATH], ret[XS_WATCH_TOKEN]);
+    free(ret);
+  }
+}
+
+/**
+ * Forget the states of the devices of a domain and stop watching
+ * them. Called when the domain goes away.
+ */
+void
+xenstore_forget_states(int domid)
+{
+  struct hlist_node *pos, *tmp;
+  xb_watched_t *w, *wtmp;
+  xb_state_t *st;
+  char path[256];
+  int i;
+
+  for (i = 0; i < XB_STATE_BUCKETS; ++i) {
+    hlist_for_each_safe(pos, tmp, &xb_states[i]) {
+      st = hlist_entry(pos, xb_state_t, node);
+      if (st->domid == domid) {
+        hlist_del(pos);
+        free(st);
+      }
+    }
+  }
+
+  list_for_each_entry_safe(w, wtmp, &xb_watched, list) {
+    if (w->domid == domid) {
+      snprintf(path, sizeof(path), "/local/domain/%d/device/vusb", domid);
+      xs_unwatch(xs_state_handle, path, XB_FRONT_TOKEN);
+      list_del(&w->list);
+      free(w);
+    }
   }
-  free(fepath);
-  free(bepath);
+}
+
+/**
+ * Get the frontend and backend XenbusStates of a device, from memory
+ */
+void
+xenstore_get_xb_states(dominfo_t *domp, usbinfo_t *usbp, int *frontst, int *backst)
+{
+  xb_state_t *st;
+
+  st = xb_state_lookup(domp, usbp->usb_virtid);
+  *frontst = (st->frontst == XB_STATE_GONE) ? XB_UNKNOWN : st->frontst;
+  *backst  = (st->backst == XB_STATE_GONE) ? XB_UNKNOWN : st->backst;
 }
 
 void
@@ -260,12 +858,112 @@ xenstore_list_domain_devs(dominfo_t *domp)
 /**
  * Populate Xenstore with the information about a usb device for this domain
  */
+/*
+ * The vusb nodes go through the pipelined connection when there is
+ * one, and through libxenstore otherwise. Without it the requests run
+ * right away, and the first error is kept for xenstore_sync().
+ */
+static int xs_sync_error = 0;
+
+static void
+xenstore_sync_result(bool ok)
+{
+  if (!ok && xs_sync_error == 0)
+    xs_sync_error = errno;
+}
+
+/* Wait for the queued requests, 0 if they all succeeded */
+static int
+xenstore_sync(void)
+{
+  int err;
+
+  if (xs_pipe != NULL)
+    return xspipe_wait(xs_pipe);
+
+  err = xs_sync_error;
+  xs_sync_error = 0;
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
+
+static xs_transaction_t
+xenstore_transaction_start(void)
+{
+  if (xs_pipe != NULL)
+    return xspipe_transaction_start(xs_pipe);
+
+  return xs_transaction_start(xs_handle);
+}
+
+static bool
+xenstore_transaction_end(xs_transaction_t xt, bool abort)
+{
+  if (xs_pipe != NULL)
+    return xspipe_transaction_end(xs_pipe, xt, abort);
+
+  return xs_transaction_end(xs_handle, xt, abort);
+}
+
+/* Queue the removal of a node */
+static void
+xenstore_queue_rm(xs_transaction_t xt, const char *path)
+{
+  xenstore_cache_invalidate(path);
+  if (xs_pipe != NULL)
+    xspipe_rm(xs_pipe, xt, path, NULL, NULL);
+  else
+    xenstore_sync_result(xs_rm(xs_handle, xt, path));
+}
+
+/* Queue the creation of a directory, owned by d0, with permissions p1 for d1 */
+static void
+xenstore_queue_dir(xs_transaction_t xt, char *path, int d0, int p0, int d1, int p1)
+{
+  struct xs_permissions perms[2];
+
+  xd_log(LOG_DEBUG, "Making %s in XenStore", path);
+  perms[0].perms = p0;
+  perms[0].id = d0;
+  perms[1].perms = p1;
+  perms[1].id = d1;
+  xenstore_cache_invalidate(path);
+  if (xs_pipe != NULL) {
+    xspipe_mkdir(xs_pipe, xt, path, NULL, NULL);
+    xspipe_set_permissions(xs_pipe, xt, path, perms, 2, NULL, NULL);
+  } else {
+    xenstore_sync_result(xs_mkdir(xs_handle, xt, path));
+    xenstore_sync_result(xs_set_permissions(xs_handle, xt, path, perms, 2));
+  }
+}
+
+/* Queue the write of a single value into Xenstore */
+static void
+xenstore_set_keyval(xs_transaction_t xt, char *path, char *key, char *val)
+{
+  char tmppath[256];
+
+  snprintf(tmppath, sizeof (tmppath), "%s/%s", path, key);
+  xd_log(LOG_DEBUG, "Writing to XenStore: %s = %s", tmppath, val);
+  xenstore_cache_invalidate(tmppath);
+  if (xs_pipe != NULL)
+    xspipe_write(xs_pipe, xt, tmppath, val, NULL, NULL);
+  else
+    xenstore_sync_result(xs_write(xs_handle, xt, tmppath, val, strlen(val)));
+}
+
 int
 xenstore_create_usb(dominfo_t *domp, usbinfo_t *usbp)
 {
   char *bepath, *fepath;
   char value[32];
   xs_transaction_t trans;
+  xb_state_t *st;
+  int retries = 0;
 
   xd_log(LOG_DEBUG, "Creating VUSB node for %d.%d",
          usbp->usb_bus, usbp->usb_device);
@@ -276,69 +974,74 @@ xenstore_create_usb(dominfo_t *domp, usbinfo_t *usbp)
   fepath = xenstore_dev_fepath(domp, "vusb", usbp->usb_virtid);
   bepath = xenstore_dev_bepath(domp, "vusb", usbp->usb_virtid);
 
+  /* Make sure the state changes to come get caught */
+  xb_state_watch_domain(domp);
+
   for (;;) {
-    trans = xs_transaction_start(xs_handle);
+    trans = xenstore_transaction_start();
+    if (trans == XBT_NULL)
+      break;
 
     /*
-     * Make directories for both front and back ends
+     * Queue everything and send it in one go, the transaction
+     * makes it atomic and the replies are checked all at once.
      */
-    if (xenstore_add_dir(trans, bepath, usb_backend_domid, XS_PERM_NONE,
-                         domp->di_domid, XS_PERM_READ))
-      break;
-    if (xenstore_add_dir(trans, fepath, domp->di_domid, XS_PERM_NONE,
-                         usb_backend_domid, XS_PERM_READ))
-      break;
+    xenstore_queue_dir(trans, bepath, usb_backend_domid, XS_PERM_NONE,
+                   domp->di_domid, XS_PERM_READ);
+    xenstore_queue_dir(trans, fepath, domp->di_domid, XS_PERM_NONE,
+                   usb_backend_domid, XS_PERM_READ);
 
     /*
      * Populate frontend device info
      */
     snprintf(value, sizeof(value), "%d", usb_backend_domid);
-    if (xenstore_set_keyval(trans, fepath, "backend-id", value))
-      break;
+    xenstore_set_keyval(trans, fepath, "backend-id", value);
     snprintf(value, sizeof (value), "%d", usbp->usb_virtid);
-    if (xenstore_set_keyval(trans, fepath, "virtual-device", value))
-      break;
-    if (xenstore_set_keyval(trans, fepath, "backend", bepath))
-      break;
+    xenstore_set_keyval(trans, fepath, "virtual-device", value);
+    xenstore_set_keyval(trans, fepath, "backend", bepath);
     snprintf(value, sizeof (value), "%d", XB_INITTING);
-    if (xenstore_set_keyval(trans, fepath, "state", value))
-      break;
+    xenstore_set_keyval(trans, fepath, "state", value);
 
     /*
      * Populate backend device info
      */
-    if (xenstore_set_keyval(trans, bepath, "domain", domp->di_name))
-      break;
-    if (xenstore_set_keyval(trans, bepath, "frontend", fepath))
-      break;
+    xenstore_set_keyval(trans, bepath, "domain", domp->di_name);
+    xenstore_set_keyval(trans, bepath, "frontend", fepath);
     snprintf(value, sizeof (value), "%d", XB_INITTING);
-    if (xenstore_set_keyval(trans, bepath, "state", value))
-      break;
-    if (xenstore_set_keyval(trans, bepath, "online", "1"))
-      break;
+    xenstore_set_keyval(trans, bepath, "state", value);
+    xenstore_set_keyval(trans, bepath, "online", "1");
     snprintf(value, sizeof (value), "%d", domp->di_domid);
-    if (xenstore_set_keyval(trans, bepath, "frontend-id", value))
-      break;
+    xenstore_set_keyval(trans, bepath, "frontend-id", value);
     snprintf(value, sizeof (value), "%d.%d", usbp->usb_bus,
              usbp->usb_device);
-    if (xenstore_set_keyval(trans, bepath, "physical-device", value))
-      break;
+    xenstore_set_keyval(trans, bepath, "physical-device", value);
 
-    if (xs_transaction_end(xs_handle, trans, false) == false) {
-      if (errno == EAGAIN)
-        continue;
+    if (xenstore_sync() != 0) {
+      xd_log(LOG_ERR, "XenStore error creating %s: %s", bepath, strerror(errno));
+      xenstore_transaction_end(trans, true);
       break;
     }
+
+    if (xenstore_transaction_end(trans, false) == false) {
+      if (errno != EAGAIN || ++retries >= XSDEV_MAX_RETRIES)
+        break;
+      /* Back off like xsdev_batch_flush(), the conflict may not be over */
+      usleep(XSDEV_BACKOFF_US << (retries - 1));
+      continue;
+    }
     free(fepath);
     free(bepath);
 
+    st = xb_state_get(domp->di_domid, usbp->usb_virtid);
+    st->frontst = XB_INITTING;
+    st->backst = XB_INITTING;
+
     xd_log(LOG_DEBUG, "Finished creating VUSB node for %d.%d",
            usbp->usb_bus, usbp->usb_device);
 
     return 0;
   }
 
-  xs_transaction_end(xs_handle, trans, true);
   xd_log(LOG_ERR, "Failed to write usb info to XenStore");
   free(fepath);
   free(bepath);
@@ -346,166 +1049,179 @@ xenstore_create_usb(dominfo_t *domp, usbinfo_t *usbp)
   return -1;
 }
 
+/**
+ * Compute the deadline of the waits for frontends and backends starting
+ * now. All the devices of a batch share the same one.
+ *
+ * @param deadline Set to the deadline, on the monotonic clock
+ */
+void
+xenstore_wait_deadline(struct timespec *deadline)
+{
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += WAIT_TIMEOUT;
+}
+
 static int
-wait_for_states(char *bepath, char *fepath, enum XenBusStates a, enum XenBusStates b)
+wait_for_states(dominfo_t *domp, int virtid, enum XenBusStates a, enum XenBusStates b,
+                cancel_t *cancel, const struct timespec *deadline)
 {
-  char *bstate, *fstate;
-  int bstatelen, fstatelen;
-  char *buf;
+  struct timespec now;
+  struct timeval tv;
+  xb_state_t *st;
+  fd_set set;
   int fd;
-  struct timeval tv = { .tv_sec = 5, .tv_usec = 0 };
-  int ret = -1;
-
-  bstatelen = strlen(bepath) + strlen("/state") + 1;
-  fstatelen = strlen(fepath) + strlen("/state") + 1;
-  bstate = malloc(bstatelen);
-  fstate = malloc(fstatelen);
-  snprintf(bstate, bstatelen, "%s/state", bepath);
-  snprintf(fstate, fstatelen, "%s/state", fepath);
-  xs_watch(xs_state_handle, bstate, bstate);
-  xs_watch(xs_state_handle, fstate, fstate);
+  long ms;
+
   fd = xs_fileno(xs_state_handle);
-  while (tv.tv_sec != 0 || tv.tv_usec != 0)
+  st = xb_state_lookup(domp, virtid);
+  for (;;)
   {
-    int bs, fs;
-    fd_set set;
-    unsigned int len;
-    char **watch_paths;
+    if (st->backst == XB_STATE_GONE || st->frontst == XB_STATE_GONE) {
+      /* The tree is gone, probably because the VM got shutdown and
+       * the toolstack cleaned it out. Let's pretend it's all set */
+      return 1;
+    }
+    if ((st->frontst == a || st->frontst == b) &&
+        (st->backst == a || st->backst == b))
+      return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+      (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    if (ms <= 0 || cancel_requested(cancel))
+      return -1;
+    /* Look for an unplug regularly */
+    if (cancel != NULL && ms > WAIT_CANCEL_SLICE)
+      ms = WAIT_CANCEL_SLICE;
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
 
     FD_ZERO(&set);
     FD_SET(fd, &set);
     if (select(fd + 1, &set, NULL, NULL, &tv) < 0)
-      break;
-    if (!FD_ISSET(fd, &set))
-      continue;
-    /* Read the watch to drain the buffer */
-    watch_paths = xs_read_watch(xs_state_handle, &len);
-    free(watch_paths);
-
-    buf = xs_read(xs_state_handle, XBT_NULL, bstate, NULL);
-    if (buf == NULL) {
-      /* The backend tree is gone, probably because the VM got
-       * shutdown and the toolstack cleaned it out. Let's pretend
-       * it's all set */
-      ret = 1;
-      break;
-    } else {
-      bs = *buf - '0';
-      free(buf);
-    }
-    buf = xs_read(xs_state_handle, XBT_NULL, fstate, NULL);
-    if (buf == NULL) {
-      /* Same as above */
-      ret = 1;
-      break;
-    } else {
-      fs = *buf - '0';
-      free(buf);
-    }
-    if ((fs == a || fs == b) &&
-        (bs == a || bs == b))
-    {
-      ret = 0;
-      break;
-    }
+      return -1;
+    if (FD_ISSET(fd, &set))
+      xenstore_state_event();
   }
-  xs_unwatch(xs_state_handle, bstate, bstate);
-  xs_unwatch(xs_state_handle, fstate, fstate);
-  free(bstate);
-  free(fstate);
-
-  return ret;
 }
 
 /**
  * Wait until both the frontend and the backend are in a connected
- * state. Fail after 5 seconds.
+ * state. Fail at the deadline, or if the device goes away.
  *
  * @param di Domain info
  * @param ui USB device info
+ * @param cancel The token of the device, or NULL
+ * @param deadline From xenstore_wait_deadline()
  *
  * @return 0 on success, -1 on failure
  */
 int
-xenstore_wait_for_online(dominfo_t *di, usbinfo_t *ui)
+xenstore_wait_for_online(dominfo_t *di, usbinfo_t *ui, cancel_t *cancel,
+                         const struct timespec *deadline)
 {
-  char *bepath, *fepath;
-  int ret;
-
-  bepath = xenstore_dev_bepath(di, "vusb", ui->usb_virtid);
-  fepath = xenstore_dev_fepath(di, "vusb", ui->usb_virtid);
-  ret = wait_for_states(bepath, fepath, XB_CONNECTED, XB_CONNECTED);
-  free(bepath);
-  free(fepath);
-
-  return ret;
+  return wait_for_states(di, ui->usb_virtid, XB_CONNECTED, XB_CONNECTED,
+                         cancel, deadline);
 }
 
 /**
  * Wait until both the frontend and the backend are in a closed
- * state. Fail after 5 seconds.
+ * state. Fail at the deadline.
  *
  * @param di Domain info
  * @param ui USB device info
+ * @param deadline From xenstore_wait_deadline()
  *
  * @return 0 on success, -1 on failure
  */
 int
-xenstore_wait_for_offline(dominfo_t *di, usbinfo_t *ui)
+xenstore_wait_for_offline(dominfo_t *di, usbinfo_t *ui,
+                          const struct timespec *deadline)
 {
-  char *bepath, *fepath;
-  int ret;
-
-  bepath = xenstore_dev_bepath(di, "vusb", ui->usb_virtid);
-  fepath = xenstore_dev_fepath(di, "vusb", ui->usb_virtid);
-  ret = wait_for_states(bepath, fepath, XB_UNKNOWN, XB_CLOSED);
-  free(bepath);
-  free(fepath);
-
-  return ret;
+  return wait_for_states(di, ui->usb_virtid, XB_UNKNOWN, XB_CLOSED,
+                         NULL, deadline);
 }
 
 /**
- * Remove information about a usb device for this domain from Xenstore
+ * Remove information about usb devices for this domain from Xenstore.
+ * All the backends get notified at once, so that they all go offline
+ * in parallel.
+ *
+ * @param domp Domain info
+ * @param usbp Array of USB device infos
+ * @param count The number of devices
+ * @param results If not NULL, set to 0 for each device that went
+ *        offline, -1 otherwise. The nodes get removed either way
+ *
+ * @return 0 on success, -1 if any device didn't go offline
  */
 int
-xenstore_destroy_usb(dominfo_t *domp, usbinfo_t *usbp)
+xenstore_destroy_usbs(dominfo_t *domp, usbinfo_t *usbp, int count, int *results)
 {
+  struct timespec deadline;
   char value[32];
-  char *bepath;
-  char *fepath;
-  int ret;
-
-  xd_log(LOG_DEBUG, "Deleting VUSB node %d for %d.%d",
-         usbp->usb_virtid, usbp->usb_bus, usbp->usb_device);
+  char **bepaths;
+  char **fepaths;
+  int ret = 0;
+  int i;
 
-  bepath = xenstore_dev_bepath(domp, "vusb", usbp->usb_virtid);
-  fepath = xenstore_dev_fepath(domp, "vusb", usbp->usb_virtid);
+  bepaths = malloc(count * sizeof(char *));
+  fepaths = malloc(count * sizeof(char *));
 
-  /* Notify the backend that the device is being shut down */
-  xenstore_set_keyval(XBT_NULL, bepath, "online", "0");
-  xenstore_set_keyval(XBT_NULL, bepath, "physical-device", "0.0");
+  /* Notify the backends that the devices are being shut down */
   snprintf(value, sizeof (value), "%d", XB_CLOSING);
-  xenstore_set_keyval(XBT_NULL, bepath, "state", value);
+  for (i = 0; i < count; ++i) {
+    xd_log(LOG_DEBUG, "Deleting VUSB node %d for %d.%d",
+           usbp[i].usb_virtid, usbp[i].usb_bus, usbp[i].usb_device);
+    bepaths[i] = xenstore_dev_bepath(domp, "vusb", usbp[i].usb_virtid);
+    fepaths[i] = xenstore_dev_fepath(domp, "vusb", usbp[i].usb_virtid);
+    xenstore_set_keyval(XBT_NULL, bepaths[i], "online", "0");
+    xenstore_set_keyval(XBT_NULL, bepaths[i], "physical-device", "0.0");
+    xenstore_set_keyval(XBT_NULL, bepaths[i], "state", value);
+  }
+  if (xenstore_sync() != 0)
+    xd_log(LOG_ERR, "XenStore error shutting down VUSB devices: %s", strerror(errno));
+
+  xenstore_wait_deadline(&deadline);
+  for (i = 0; i < count; ++i) {
+    if (xenstore_wait_for_offline(domp, &usbp[i], &deadline) < 0) {
+      xd_log(LOG_ERR, "Failed to bring the USB device offline, cleaning xenstore nodes anyway");
+      /* FIXME: Should we keep the nodes around? Check if the VM is asleep? */
+      ret = -1;
+      if (results != NULL)
+        results[i] = -1;
+    } else if (results != NULL)
+      results[i] = 0;
+  }
 
-  if (xenstore_wait_for_offline(domp, usbp) >= 0)
-  {
-    xs_rm(xs_handle, XBT_NULL, bepath);
-    xs_rm(xs_handle, XBT_NULL, fepath);
-    ret = 0;
-  } else {
-    xd_log(LOG_ERR, "Failed to bring the USB device offline, cleaning xenstore nodes anyway");
-    /* FIXME: Should we keep the nodes around? Check if the VM is asleep? */
-    xs_rm(xs_handle, XBT_NULL, bepath);
-    xs_rm(xs_handle, XBT_NULL, fepath);
-    ret = -1;
+  for (i = 0; i < count; ++i) {
+    xenstore_queue_rm(XBT_NULL, bepaths[i]);
+    xenstore_queue_rm(XBT_NULL, fepaths[i]);
   }
+  /* The frontend nodes are already gone if the domain died */
+  if (xenstore_sync() != 0 && errno != ENOENT)
+    xd_log(LOG_ERR, "XenStore error removing VUSB nodes: %s", strerror(errno));
+
+  for (i = 0; i < count; ++i) {
+    free(bepaths[i]);
+    free(fepaths[i]);
+  }
+  free(bepaths);
+  free(fepaths);
 
-  free(bepath);
-  free(fepath);
   return ret;
 }
 
+/**
+ * Remove information about a usb device for this domain from Xenstore
+ */
+int
+xenstore_destroy_usb(dominfo_t *domp, usbinfo_t *usbp)
+{
+  return xenstore_destroy_usbs(domp, usbp, 1, NULL);
+}
+
 /**
  * Initialize the xenstore bits
  *
@@ -545,6 +1261,21 @@ xenstore_init()
 
   free(domid_str);
 
+  /* The vusb nodes are written through a pipelined connection, or
+   * through xs_handle if there can't be one */
+  if (xs_pipe == NULL)
+    xs_pipe = xspipe_open(NULL);
+  if (xs_pipe == NULL)
+    xd_log(LOG_WARNING, "No pipelined connection to xenstore, writing vusb nodes one by one");
+
+
+  /* Domains coming and going invalidate the domain information cache */
+  if (xs_watch(xs_handle, "@introduceDomain", DOMINFO_TOKEN) == false ||
+      xs_watch(xs_handle, "@releaseDomain", DOMINFO_TOKEN) == false)
+    xd_log(LOG_WARNING, "Failed to watch domains, not caching domain information");
+  else
+    dominfo_caching = true;
+
   return xs_fileno(xs_handle);
 }
 
@@ -560,15 +1291,18 @@ xenstore_state_handle()
     return -1;
   }
 
+  xb_state_watch_backend(true);
+
   return xs_fileno(xs_state_handle);
 }
 
 int
 xenstore_new_backend(const int backend_domid)
 {
-  int ret;
+  int ret = 0;
 
   if (backend_domid != usb_backend_domid) {
+    xb_state_watch_backend(false);
     free(xs_backend_path);
     xs_backend_path = xs_get_domain_path(xs_handle, backend_domid);
 
@@ -578,6 +1312,7 @@ xenstore_new_backend(const int backend_domid)
     }
 
     usb_backend_domid = backend_domid;
+    xb_state_watch_backend(true);
   }
 
   /* Redo the watches! */
@@ -596,6 +1331,8 @@ xenstore_deinit(void)
 {
   xs_daemon_close(xs_handle);
   xs_handle = NULL;
+  xspipe_close(xs_pipe);
+  xs_pipe = NULL;
 }
 
 void
@@ -635,54 +1372,163 @@ void xsdev_del(device_t *dev)
     return;
   }
 
-  char *vusb_watch = xasprintf("%s/assign", path);
-  char *vusb_token = xasprintf(ASSIGN_PREFIX"%x %x", dev->vendorid,
-                 dev->deviceid);
-
-  xs_unwatch(xs_handle, vusb_watch, vusb_token);
-
-  free(vusb_watch);
-  free(vusb_token);
-
   if (xs_rm(xs_handle, XBT_NULL, path) == false) {
     xd_log(LOG_ERR, "failure xs_rm(%s)", path);
   }
+  xenstore_cache_invalidate(path);
 
   free(path);
 }
 
-void xsdev_write(device_t *dev)
+/**
+ * Devices waiting to be published, as bus/dev pairs, between
+ * xsdev_batch_begin() and xsdev_batch_end()
+ */
+static int xsdev_batch_depth = 0;
+static int *xsdev_batch = NULL;
+static int xsdev_batch_count = 0;
+static int xsdev_batch_size = 0;
+
+/*
+ * Append a length-prefixed string to a packed record, "-1:" for NULL
+ */
+static int
+xsdev_record_string(char *rec, int len, const char *v)
 {
-  xs_transaction_t t;
+  if (len < 0 || len >= XSDEV_RECORD_MAX)
+    return -1;
+  if (v == NULL)
+    return len + snprintf(rec + len, XSDEV_RECORD_MAX - len, " -1:");
 
-  if (g_xcbus) {
-    return;
-  }
+  return len + snprintf(rec + len, XSDEV_RECORD_MAX - len, " %zu:%s",
+                        strlen(v), v);
+}
 
-  xd_log(LOG_INFO, "%s %d %d %s", __func__, dev->busid, dev->devid,
-         dev->sysname);
+/*
+ * Pack a device into a single record, so that it can be read in one
+ * xs_read(). The format is
+ *   <version> <busid> <devid> <vendorid> <deviceid> <type>
+ * followed by serial, shortname, longname and sysname, each as
+ *   <length>:<bytes>
+ * Returns the length of the record, or -1 if it doesn't fit.
+ */
+static int
+xsdev_record_build(device_t *dev, char *rec)
+{
+  int len;
 
-  char *path = xasprintf("data/usb/dev%d-%d", dev->busid, dev->devid);
-  if (path == NULL) {
-    xd_log(LOG_ERR, "%s: xasprintf path failed", __func__);
-    return;
+  len = snprintf(rec, XSDEV_RECORD_MAX, "%d %d %d %#x %#x %#x",
+                 XSDEV_RECORD_VERSION, dev->busid, dev->devid,
+                 dev->vendorid, dev->deviceid, dev->type);
+  len = xsdev_record_string(rec, len, dev->serial);
+  len = xsdev_record_string(rec, len, dev->shortname);
+  len = xsdev_record_string(rec, len, dev->longname);
+  len = xsdev_record_string(rec, len, dev->sysname);
+  if (len < 0 || len >= XSDEV_RECORD_MAX)
+    return -1;
+
+  return len;
+}
+
+static const char*
+xsdev_record_int(const char *p, const char *end, int *v)
+{
+  char *e;
+
+  if (p == NULL || p >= end)
+    return NULL;
+  *v = strtol(p, &e, 0);
+  if (e == p)
+    return NULL;
+
+  return e;
+}
+
+static const char*
+xsdev_record_get_string(const char *p, const char *end, char **v)
+{
+  char *e;
+  long len;
+
+  *v = NULL;
+  if (p == NULL || p >= end || *p != ' ')
+    return NULL;
+  len = strtol(p + 1, &e, 10);
+  if (e == p + 1 || *e != ':')
+    return NULL;
+  e++;
+  if (len == -1)
+    return e;
+  if (len < 0 || len > end - e)
+    return NULL;
+  *v = xmalloc(len + 1);
+  memcpy(*v, e, len);
+  (*v)[len] = '\0';
+
+  return e + len;
+}
+
+/*
+ * Unpack a device record. Returns 0 on success, -1 if the record is
+ * invalid or of an unknown version, in which case nothing is
+ * allocated.
+ */
+static int
+xsdev_record_parse(const char *rec, unsigned int len,
+                   int *busid, int *devid, int *vendorid, int *deviceid,
+                   int *type, char **serial, char **shortname,
+                   char **longname, char **sysname)
+{
+  const char *end = rec + len;
+  const char *p = rec;
+  int version;
+
+  p = xsdev_record_int(p, end, &version);
+  if (p == NULL || version != XSDEV_RECORD_VERSION)
+    return -1;
+  p = xsdev_record_int(p, end, busid);
+  p = xsdev_record_int(p, end, devid);
+  p = xsdev_record_int(p, end, vendorid);
+  p = xsdev_record_int(p, end, deviceid);
+  p = xsdev_record_int(p, end, type);
+  p = xsdev_record_get_string(p, end, serial);
+  p = xsdev_record_get_string(p, end, shortname);
+  p = xsdev_record_get_string(p, end, longname);
+  p = xsdev_record_get_string(p, end, sysname);
+  if (p == NULL || p != end) {
+    free(*serial);
+    free(*shortname);
+    free(*longname);
+    free(*sysname);
+    *serial = *shortname = *longname = *sysname = NULL;
+    return -1;
   }
 
-  xenstore_add_dir(XBT_NULL, "data/usb", my_domid, XS_PERM_NONE,
-                             0, XS_PERM_READ);
+  return 0;
+}
 
-  /* TODO Add transaction abort? */
- restart:
-  t = xs_transaction_start(xs_handle);
+/*
+ * Write the fields of a device in a transaction. path is a
+ * XSDEV_PATH_MAX buffer, reused for all the nodes.
+ * The packed record is written alongside the individual fields, which
+ * are kept for older readers.
+ */
+static void
+xsdev_write_fields(xs_transaction_t t, device_t *dev, char *path)
+{
+  char value[16];
+  char rec[XSDEV_RECORD_MAX];
+  int len, reclen;
 
+  len = snprintf(path, XSDEV_PATH_MAX, "data/usb/dev%d-%d",
+                 dev->busid, dev->devid);
+  xenstore_cache_invalidate(path);
   xs_mkdir(xs_handle, t, path);
 
 #define xs_write_fmt(fmt, v) { \
-  char *_path = xasprintf("%s/%s", path, #v); \
-  char *_v = xasprintf(fmt, dev->v); \
-  xs_write(xs_handle, t, _path, _v, strlen(_v)); \
-  free(_v); \
-  free(_path); }
+  snprintf(path + len, XSDEV_PATH_MAX - len, "/%s", #v); \
+  snprintf(value, sizeof(value), fmt, dev->v); \
+  xs_write(xs_handle, t, path, value, strlen(value)); }
 #define xs_write_int(v) xs_write_fmt("%d", v)
 #define xs_write_hex(v) xs_write_fmt("%#x", v)
 
@@ -694,9 +1540,8 @@ void xsdev_write(device_t *dev)
 
 #define xs_write_string(v) { \
   if (dev->v) { \
-    char *_path = xasprintf("%s/%s", path, #v); \
-    xs_write(xs_handle, t, _path, dev->v, strlen(dev->v)); \
-    free(_path); } \
+    snprintf(path + len, XSDEV_PATH_MAX - len, "/%s", #v); \
+    xs_write(xs_handle, t, path, dev->v, strlen(dev->v)); } \
   }
 
   xs_write_string(serial);
@@ -709,34 +1554,133 @@ void xsdev_write(device_t *dev)
 #undef xs_write_hex
 #undef xs_write_fmt
 
-  if (xs_transaction_end(xs_handle, t, false) == false) {
-    if (errno == EAGAIN) {
-      goto restart;
+  reclen = xsdev_record_build(dev, rec);
+  if (reclen < 0) {
+    xd_log(LOG_WARNING, "%s: device %d-%d too big for a record", __func__,
+           dev->busid, dev->devid);
+    return;
+  }
+  snprintf(path + len, XSDEV_PATH_MAX - len, "/record");
+  xs_write(xs_handle, t, path, rec, reclen);
+}
+
+/*
+ * Publish all the batched devices in a single transaction, retrying
+ * a bounded number of times with an exponential backoff if it
+ * conflicts, then watch their assign nodes. If it still fails, the
+ * devices stay batched for the next publication and nothing gets
+ * watched.
+ */
+static void
+xsdev_batch_flush(void)
+{
+  char path[XSDEV_PATH_MAX];
+  xs_transaction_t t;
+  device_t *dev;
+  bool published = false;
+  int attempt;
+  int i;
+
+  if (xsdev_batch_count == 0)
+    return;
+
+  for (attempt = 0; ; ++attempt) {
+    t = xs_transaction_start(xs_handle);
+    if (t == XBT_NULL) {
+      xd_log(LOG_ERR, "%s failed to start a transaction", __func__);
+      break;
     }
-    xd_log(LOG_ERR, "%s xs_transaction_failed errno=%d (%s)",
-           __func__, errno, strerror(errno));
-    xs_transaction_end(xs_handle, t, true);
+
+    xenstore_add_dir(t, "data/usb", my_domid, XS_PERM_NONE,
+                     0, XS_PERM_READ);
+    for (i = 0; i < xsdev_batch_count; i += 2) {
+      dev = device_lookup(xsdev_batch[i], xsdev_batch[i + 1]);
+      if (dev != NULL)
+        xsdev_write_fields(t, dev, path);
+    }
+
+    if (xs_transaction_end(xs_handle, t, false) == true) {
+      published = true;
+      break;
+    }
+    if (errno != EAGAIN || attempt == XSDEV_MAX_RETRIES) {
+      xd_log(LOG_ERR, "%s xs_transaction_failed errno=%d (%s)",
+             __func__, errno, strerror(errno));
+      break;
+    }
+    usleep(XSDEV_BACKOFF_US << attempt);
   }
 
-  char *vusb_watch = xasprintf("%s/assign", path);
-  char *vusb_token = xasprintf("assign:%x %x", dev->vendorid,
-                 dev->deviceid);
+  if (!published) {
+    xd_log(LOG_ERR, "%s failed to publish %d device(s), will retry with the next one",
+           __func__, xsdev_batch_count / 2);
+    return;
+  }
 
-  if (xs_watch(xs_handle, vusb_watch, vusb_token) == false) {
-    xd_log(LOG_ERR, "%s failed to add %s xs_watch", __func__,
-           vusb_watch);
+  /* A single watch on the whole subtree catches the assign nodes of
+   * all the devices, see xsdev_assigning() */
+  if (!xsdev_assign_watched) {
+    if (xs_watch(xs_handle, "data/usb", ASSIGN_TOKEN) == false)
+      xd_log(LOG_ERR, "%s failed to add data/usb xs_watch", __func__);
+    else
+      xsdev_assign_watched = true;
   }
 
-  free(vusb_watch);
-  free(vusb_token);
-  free(path);
+  xsdev_batch_count = 0;
+}
+
+/**
+ * Start batching device publications. Devices passed to xsdev_write()
+ * until the matching xsdev_batch_end() get written to XenStore all at
+ * once. Batches can be nested.
+ */
+void
+xsdev_batch_begin(void)
+{
+  xsdev_batch_depth++;
+}
+
+/**
+ * End a batch started by xsdev_batch_begin(), publishing the devices
+ * if it's the outermost one
+ */
+void
+xsdev_batch_end(void)
+{
+  if (xsdev_batch_depth == 0)
+    return;
+  if (--xsdev_batch_depth == 0)
+    xsdev_batch_flush();
+}
+
+/**
+ * Publish a device to XenStore for the domain that handles the policy.
+ * This only does something in stub mode.
+ */
+void xsdev_write(device_t *dev)
+{
+  if (g_xcbus) {
+    return;
+  }
+
+  xd_log(LOG_INFO, "%s %d %d %s", __func__, dev->busid, dev->devid,
+         dev->sysname);
+
+  if (xsdev_batch_count + 2 > xsdev_batch_size) {
+    xsdev_batch_size = xsdev_batch_size ? xsdev_batch_size * 2 : 32;
+    xsdev_batch = realloc(xsdev_batch, xsdev_batch_size * sizeof(int));
+  }
+  xsdev_batch[xsdev_batch_count++] = dev->busid;
+  xsdev_batch[xsdev_batch_count++] = dev->devid;
+
+  if (xsdev_batch_depth == 0)
+    xsdev_batch_flush();
 }
 
 static void xsdev_remove_one(char *path)
 {
   int busid;
   int devid;
-  int num;
   char *p;
 
   xd_log(LOG_INFO, "%s path=%s", __func__, path);
@@ -749,8 +1693,7 @@ static void xsdev_remove_one(char *path)
   }
   p++;
 
-  num = sscanf(p, "dev%d-%d", &busid, &devid);
-  if (num != 2) {
+  if (xsdev_parse_ids(p, &busid, &devid) == NULL) {
     xd_log(LOG_ERR, "%s could not parse path=%s", __func__, path);
 
     return;
@@ -792,8 +1735,8 @@ xsdev_add(char *path)
   char *longname;
   char *sysname;
   int type;
-  int num;
-
+  char *rec, *rec_path;
+  int ret;
 
   xs_transaction_t t;
 
@@ -807,13 +1750,26 @@ xsdev_add(char *path)
   }
   p++;
 
-  num = sscanf(p, "dev%d-%d", &busid, &devid);
-  if (num != 2) {
+  if (xsdev_parse_ids(p, &busid, &devid) == NULL) {
     xd_log(LOG_DEBUG, "%s could not parse path=%s", __func__, path);
 
     return;
   }
 
+  /* Newer backends publish everything in a single packed node */
+  rec_path = xasprintf("%s/record", path);
+  rec = xs_cache_read(rec_path, &len);
+  free(rec_path);
+  if (rec != NULL) {
+    ret = xsdev_record_parse(rec, len, &busid, &devid, &vendorid, &deviceid,
+                             &type, &serial, &shortname, &longname, &sysname);
+    free(rec);
+    if (ret == 0)
+      goto add;
+    xd_log(LOG_WARNING, "%s: invalid record for %s, reading the fields",
+           __func__, path);
+  }
+
  restart:
   t = xs_transaction_start(xs_handle);
 
@@ -857,6 +1813,7 @@ xsdev_add(char *path)
     return;
   }
 
+ add:
   if (shortname == NULL ||
       longname == NULL ||
       sysname == NULL ||
@@ -891,7 +1848,7 @@ xsdev_event_one(char *path)
   unsigned int len;
   char *dev_path;
 
-  dev_path = xs_read(xs_handle, 0, path, &len);
+  dev_path = xs_cache_read(path, &len);
   if (dev_path == NULL) {
     xsdev_remove(path);
 
@@ -933,26 +1890,73 @@ int xsdev_fill()
   return 1;
 }
 
+/*
+ * Apply the assign nodes already there, which don't fire an event of
+ * their own when the watch gets added
+ */
+static void
+xsdev_assign_existing(void)
+{
+  char **nodes;
+  char *path, *val;
+  unsigned int count, i;
+
+  nodes = xs_directory(xs_handle, XBT_NULL, "data/usb", &count);
+  if (nodes == NULL)
+    return;
+
+  for (i = 0; i < count; ++i) {
+    path = xasprintf("data/usb/%s/assign", nodes[i]);
+    /* Most devices have none, the read gets cached for the handler */
+    val = xs_cache_read(path, NULL);
+    if (val != NULL) {
+      free(val);
+      xsdev_assigning(path, ASSIGN_TOKEN);
+    }
+    free(path);
+  }
+
+  free(nodes);
+}
+
+/**
+ * Handle an event on our data/usb subtree, in stub mode.
+ * Only data/usb/dev<bus>-<dev>/assign is interesting, it's where the
+ * policy domain tells us to (un)assign the device. The event on
+ * data/usb itself, fired when the watch gets added, applies all the
+ * existing ones.
+ */
 void xsdev_assigning(char *path, char *token)
 {
-  int vid, pid;
-  int num;
+  const char *p;
+  device_t *dev;
+  int busid, devid;
   unsigned int len;
   int add;
   char *val;
 
-  xd_log(LOG_INFO, "%s: path=%s token=%s", __func__, path, token);
+  if (strcmp(path, "data/usb") == 0) {
+    xsdev_assign_existing();
+    return;
+  }
+  if (strncmp(path, "data/usb/", 9) != 0)
+    return;
+  p = xsdev_parse_ids(path + 9, &busid, &devid);
+  if (p == NULL || strcmp(p, "/assign") != 0)
+    return;
+
+  xd_log(LOG_INFO, "%s: path=%s", __func__, path);
 
-  num = sscanf(token, "assign:%x %x", &vid, &pid);
-  if (num != 2) {
-    xd_log(LOG_ERR, "%s: Unexpected token %s", __func__, token);
+  dev = device_lookup(busid, devid);
+  if (dev == NULL) {
+    xd_log(LOG_INFO, "%s: unknown device %d-%d", __func__, busid, devid);
     return;
   }
 
-  val = xs_read(xs_handle, XBT_NULL, path, &len);
+  val = xs_cache_read(path, &len);
   if (val == NULL) {
     xd_log(LOG_INFO, "%s: xs_read(%s)=NULL %04x:%04x", __func__,
-           path, vid, pid);
+           path, dev->vendorid, dev->deviceid);
     return;
   }
 
@@ -966,42 +1970,144 @@ void xsdev_assigning(char *path, char *token)
   }
 
   xd_log(LOG_INFO, "%s: val=%s %s %x:%x", __func__, val,
-         add ? "adding" : "removing", vid, pid);
+         add ? "adding" : "removing", dev->vendorid, dev->deviceid);
 
-  vusb_assign_local(vid, pid, add);
+  vusb_assign_local(dev->vendorid, dev->deviceid, busid, devid, add);
 
  out:
   free(val);
 }
 
+static void
+xsdev_watch_event(char *path, char *token)
+{
+  /* Ignore a watch event that doesn't have a child */
+  if (watch_path == NULL)
+    return;
+
+  xsdev_event_one(path);
+}
+
+/**
+ * Diff the domains in XenStore against the ones we know about.
+ * New guests get their sticky devices staged, gone ones get whatever
+ * was staged for them torn down.
+ *
+ * @param stage False to only take note of the domains
+ */
+static void
+xenstore_scan_domains(bool stage)
+{
+  xs_domain_t *d, *tmp;
+  char **dirs, *vm, *target;
+  unsigned int count, i;
+  int domid, n;
+
+  dirs = xs_directory(xs_handle, XBT_NULL, "/local/domain", &count);
+  if (dirs == NULL)
+    return;
+
+  list_for_each_entry(d, &xs_domains, list)
+    d->seen = false;
+  for (i = 0; i < count; ++i) {
+    domid = strtol(dirs[i], NULL, 10);
+    list_for_each_entry(d, &xs_domains, list) {
+      if (d->domid == domid)
+        break;
+    }
+    if (&d->list != &xs_domains) {
+      d->seen = true;
+      continue;
+    }
+
+    d = xmalloc(sizeof(xs_domain_t));
+    d->domid = domid;
+    d->seen = true;
+    list_add(&d->list, &xs_domains);
+    if (!stage || domid == 0 || domid == my_domid)
+      continue;
+
+    /* Stubdomains share the UUID of their guest, leave them be */
+    target = xenstore_dom_read(domid, "target");
+    vm = xenstore_dom_read(domid, "vm");
+    if (target == NULL && vm != NULL && !strncmp(vm, "/vm/", 4)) {
+      n = policy_prestage_domain(domid, vm + 4);
+      if (n > 0)
+        xd_log(LOG_INFO, "Pre-staged %d device(s) for domain %d", n, domid);
+    }
+    free(target);
+    free(vm);
+  }
+  free(dirs);
+
+  list_for_each_entry_safe(d, tmp, &xs_domains, list) {
+    if (d->seen)
+      continue;
+    usbowls_unstage_domain(d->domid);
+    /* A domain that never became a VM doesn't get forgotten by
+     * vm_del(), drop what staging watched for it */
+    xenstore_forget_states(d->domid);
+    list_del(&d->list);
+    free(d);
+  }
+}
+
+/**
+ * Create the vusb nodes of sticky devices as soon as their VM's domain
+ * shows up, instead of when the toolstack calls new_vm. The frontend
+ * then finds them while the guest boots, and new_vm only has to assign
+ * them. Domains that already exist are left alone.
+ *
+ * @return 0 on success, -1 if domains can't be watched
+ */
+int
+xenstore_prestage_enable(void)
+{
+  if (!dominfo_caching) {
+    xd_log(LOG_WARNING, "Domains aren't watched, not pre-staging devices");
+    return -1;
+  }
+  xenstore_scan_domains(false);
+  prestage = true;
+
+  return 0;
+}
+
+static void
+dominfo_watch_event(char *path, char *token)
+{
+  /* The watch doesn't tell which domain, forget them all */
+  xenstore_forget_dominfo(-1);
+
+  if (prestage)
+    xenstore_scan_domains(!strcmp(path, "@introduceDomain"));
+}
+
 void
 xenstore_event()
 {
   char **ret;
 
   ret = xs_check_watch(xs_handle);
-  if (ret == NULL && errno == EAGAIN) {
+  if (ret == NULL) {
     return;
   }
 
   char *path = ret[XS_WATCH_PATH];
   char *token = ret[XS_WATCH_TOKEN];
 
-  if (strcmp(watch_token, token) == 0) {
-    /* Ignore a watch event that doesn't have a child */
-    if (watch_path == NULL) {
-      goto free_ret;
-    }
+  /* Whatever changed isn't current in the cache anymore */
+  xenstore_cache_invalidate(path);
 
-    xsdev_event_one(path);
-  } else if (strncmp(token, ASSIGN_PREFIX, strlen(ASSIGN_PREFIX)) == 0) {
+  if (strcmp(token, watch_token) == 0)
+    xsdev_watch_event(path, token);
+  else if (strcmp(token, ASSIGN_TOKEN) == 0)
     xsdev_assigning(path, token);
-  } else {
-    xd_log(LOG_ERR, "Unexpected token %s doesn't match our's (%s)",
-           token, watch_token);
-  }
+  else if (strcmp(token, DOMINFO_TOKEN) == 0)
+    dominfo_watch_event(path, token);
+  else
+    xd_log(LOG_ERR, "Unexpected watch token %s", token);
 
- free_ret:
   free(ret);
 
   /* We need to process all watch events, so recurse. */
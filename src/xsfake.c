@@ -0,0 +1,675 @@
+/*
+ * Copyright (c) 2026 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   xsfake.c
+ * @date   Sun Oct 18 20:41:52 2026
+ *
+ * @brief  In-process stand-in for xenstored
+ *
+ * A minimal xenstored serving the wire protocol on a Unix socket from
+ * a thread of the daemon, so that the XenStore code paths can be
+ * exercised and timed without Xen. Point libxenstore and xspipe at it
+ * with XENSTORED_PATH.
+ *
+ * It keeps the tree in memory and supports reads, writes, directories
+ * and watches. All the clients are dom0, permissions are accepted and
+ * ignored, and transactions are not isolated: they always commit.
+ * Everything lives on the server thread, there is no locking.
+ *
+ * A hook can be set to play the other side of the protocol: it gets
+ * called on the server thread for every write, and can answer with
+ * xsfake_write_later(), like a frontend or a backend would.
+ */
+
+#include "project.h"
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <xen/io/xs_wire.h>
+
+#define XSFAKE_MAX_CLIENTS 32
+#define XSFAKE_DOM0_PATH   "/local/domain/0"
+
+typedef struct {
+  struct list_head list; /**< Linux-kernel-style list item */
+  char *path;            /**< Absolute path */
+  char *value;
+  unsigned int len;
+} xsfake_node_t;
+
+typedef struct {
+  struct list_head list; /**< Linux-kernel-style list item */
+  int client;            /**< Index of the client that set the watch */
+  char *path;            /**< Path as given by the client */
+  char *abs;             /**< Absolute path */
+  char *token;
+} xsfake_watch_t;
+
+typedef struct {
+  struct list_head list; /**< Linux-kernel-style list item, sorted by time */
+  struct timespec when;  /**< CLOCK_MONOTONIC time of the write */
+  char *abs;
+  char *value;
+} xsfake_timer_t;
+
+typedef struct {
+  int fd;                /**< -1 if the slot is free */
+  char in[sizeof(struct xsd_sockmsg) + XENSTORE_PAYLOAD_MAX];
+  size_t in_len;
+} xsfake_client_t;
+
+static struct {
+  int listen_fd;
+  int wake[2];           /**< Written to by xsfake_stop() */
+  pthread_t thread;
+  char path[108];
+  xsfake_client_t clients[XSFAKE_MAX_CLIENTS];
+  struct list_head nodes;
+  struct list_head watches;
+  struct list_head timers; /**< Delayed writes, soonest first */
+  uint32_t next_tx;
+  xsfake_hook_t hook;
+  unsigned long requests;  /**< Requests handled, all clients together, atomic */
+} xsfake;
+
+/* Make a path absolute, relative paths are relative to dom0 */
+static char*
+xsfake_abs(const char *path)
+{
+  char *res;
+
+  if (path[0] == '/' || path[0] == '@')
+    return strdup(path);
+  res = malloc(strlen(XSFAKE_DOM0_PATH) + strlen(path) + 2);
+  sprintf(res, "%s/%s", XSFAKE_DOM0_PATH, path);
+
+  return res;
+}
+
+/* Check if path is prefix or a child of prefix */
+static bool
+xsfake_under(const char *path, const char *prefix)
+{
+  size_t len = strlen(prefix);
+
+  return (strncmp(path, prefix, len) == 0 &&
+          (path[len] == '\0' || path[len] == '/'));
+}
+
+static xsfake_node_t*
+xsfake_find(const char *abs)
+{
+  xsfake_node_t *node;
+
+  list_for_each_entry(node, &xsfake.nodes, list) {
+    if (strcmp(node->path, abs) == 0)
+      return node;
+  }
+
+  return NULL;
+}
+
+/* Create a node and its missing parents. Returns the node */
+static xsfake_node_t*
+xsfake_create(const char *abs)
+{
+  xsfake_node_t *node;
+  char *parent, *slash;
+
+  node = xsfake_find(abs);
+  if (node != NULL)
+    return node;
+
+  parent = strdup(abs);
+  slash = strrchr(parent, '/');
+  if (slash != NULL && slash != parent) {
+    *slash = '\0';
+    xsfake_create(parent);
+  }
+  free(parent);
+
+  node = malloc(sizeof(xsfake_node_t));
+  node->path = strdup(abs);
+  node->value = strdup("");
+  node->len = 0;
+  list_add_tail(&node->list, &xsfake.nodes);
+
+  return node;
+}
+
+/* Set the value of a node, creating it if needed */
+static xsfake_node_t*
+xsfake_set(const char *abs, const char *value, unsigned int len)
+{
+  xsfake_node_t *node;
+
+  node = xsfake_create(abs);
+  free(node->value);
+  node->len = len;
+  node->value = malloc(len + 1);
+  memcpy(node->value, value, len);
+  node->value[len] = '\0';
+
+  return node;
+}
+
+static void
+xsfake_send(int client, uint32_t type, uint32_t req_id, uint32_t tx_id,
+            const char *data, unsigned int len)
+{
+  struct xsd_sockmsg msg;
+  struct iovec iov[2];
+  int fd = xsfake.clients[client].fd;
+
+  msg.type = type;
+  msg.req_id = req_id;
+  msg.tx_id = tx_id;
+  msg.len = len;
+  iov[0].iov_base = &msg;
+  iov[0].iov_len = sizeof(msg);
+  iov[1].iov_base = (void *)data;
+  iov[1].iov_len = len;
+  if (writev(fd, iov, 2) != sizeof(msg) + len)
+    xd_log(LOG_WARNING, "xsfake: short write to client %d", client);
+}
+
+static void
+xsfake_event(xsfake_watch_t *w, const char *abs)
+{
+  char buf[XENSTORE_PAYLOAD_MAX];
+  const char *path = abs;
+  int len;
+
+  /* Relative watches get relative paths */
+  if (w->path[0] != '/' && w->path[0] != '@' &&
+      xsfake_under(abs, XSFAKE_DOM0_PATH))
+    path = abs + strlen(XSFAKE_DOM0_PATH) + 1;
+  len = snprintf(buf, sizeof(buf), "%s%c%s", path, '\0', w->token) + 1;
+  xsfake_send(w->client, XS_WATCH_EVENT, 0, 0, buf, len);
+}
+
+/* Fire the watches on a node that changed */
+static void
+xsfake_fire(const char *abs)
+{
+  xsfake_watch_t *w;
+
+  list_for_each_entry(w, &xsfake.watches, list) {
+    if (xsfake_under(abs, w->abs))
+      xsfake_event(w, abs);
+    else if (xsfake_under(w->abs, abs))
+      /* A parent of the watched node got removed */
+      xsfake_event(w, w->abs);
+  }
+}
+
+static void
+xsfake_reply_error(int client, struct xsd_sockmsg *msg, int err)
+{
+  unsigned int i;
+
+  for (i = 0; i < sizeof(xsd_errors) / sizeof(xsd_errors[0]); ++i) {
+    if (xsd_errors[i].errnum == err) {
+      xsfake_send(client, XS_ERROR, msg->req_id, msg->tx_id,
+                  xsd_errors[i].errstring,
+                  strlen(xsd_errors[i].errstring) + 1);
+      return;
+    }
+  }
+  xsfake_send(client, XS_ERROR, msg->req_id, msg->tx_id, "EIO", 4);
+}
+
+static void
+xsfake_reply(int client, struct xsd_sockmsg *msg, const char *data,
+             unsigned int len)
+{
+  xsfake_send(client, msg->type, msg->req_id, msg->tx_id, data, len);
+}
+
+static void
+xsfake_directory(int client, struct xsd_sockmsg *msg, const char *abs)
+{
+  char buf[XENSTORE_PAYLOAD_MAX];
+  xsfake_node_t *node;
+  size_t plen = strlen(abs);
+  unsigned int len = 0;
+  const char *name;
+
+  list_for_each_entry(node, &xsfake.nodes, list) {
+    if (strncmp(node->path, abs, plen) != 0 || node->path[plen] != '/')
+      continue;
+    name = node->path + plen + 1;
+    if (strchr(name, '/') != NULL || len + strlen(name) + 1 > sizeof(buf))
+      continue;
+    strcpy(buf + len, name);
+    len += strlen(name) + 1;
+  }
+  xsfake_reply(client, msg, buf, len);
+}
+
+static void
+xsfake_rm(const char *abs)
+{
+  xsfake_node_t *node, *tmp;
+
+  list_for_each_entry_safe(node, tmp, &xsfake.nodes, list) {
+    if (xsfake_under(node->path, abs)) {
+      list_del(&node->list);
+      free(node->path);
+      free(node->value);
+      free(node);
+    }
+  }
+}
+
+static void
+xsfake_unwatch(int client, const char *path, const char *token)
+{
+  xsfake_watch_t *w, *tmp;
+
+  list_for_each_entry_safe(w, tmp, &xsfake.watches, list) {
+    if (w->client == client &&
+        (path == NULL || (!strcmp(w->path, path) && !strcmp(w->token, token)))) {
+      list_del(&w->list);
+      free(w->path);
+      free(w->abs);
+      free(w->token);
+      free(w);
+    }
+  }
+}
+
+/* Handle one request. data is NUL-terminated. */
+static void
+xsfake_handle(int client, struct xsd_sockmsg *msg, char *data)
+{
+  char buf[64];
+  xsfake_node_t *node;
+  xsfake_watch_t *w;
+  char *abs = NULL;
+  char *arg;
+  size_t plen;
+
+  __sync_fetch_and_add(&xsfake.requests, 1);
+  plen = strlen(data);
+  arg = data + plen + 1;
+  switch (msg->type) {
+  case XS_READ:
+  case XS_WRITE:
+  case XS_MKDIR:
+  case XS_RM:
+  case XS_DIRECTORY:
+  case XS_GET_PERMS:
+  case XS_SET_PERMS:
+    abs = xsfake_abs(data);
+    break;
+  default:
+    break;
+  }
+
+  switch (msg->type) {
+  case XS_READ:
+    node = xsfake_find(abs);
+    if (node == NULL)
+      xsfake_reply_error(client, msg, ENOENT);
+    else
+      xsfake_reply(client, msg, node->value, node->len);
+    break;
+  case XS_WRITE:
+    node = xsfake_set(abs, arg, (plen + 1 <= msg->len) ? msg->len - plen - 1 : 0);
+    xsfake_reply(client, msg, "OK", 3);
+    xsfake_fire(abs);
+    if (xsfake.hook != NULL)
+      xsfake.hook(abs, node->value);
+    break;
+  case XS_MKDIR:
+    if (xsfake_find(abs) == NULL) {
+      xsfake_create(abs);
+      xsfake_fire(abs);
+    }
+    xsfake_reply(client, msg, "OK", 3);
+    break;
+  case XS_RM:
+    if (xsfake_find(abs) == NULL) {
+      xsfake_reply_error(client, msg, ENOENT);
+      break;
+    }
+    xsfake_rm(abs);
+    xsfake_reply(client, msg, "OK", 3);
+    xsfake_fire(abs);
+    break;
+  case XS_DIRECTORY:
+    if (xsfake_find(abs) == NULL)
+      xsfake_reply_error(client, msg, ENOENT);
+    else
+      xsfake_directory(client, msg, abs);
+    break;
+  case XS_GET_PERMS:
+    if (xsfake_find(abs) == NULL)
+      xsfake_reply_error(client, msg, ENOENT);
+    else
+      xsfake_reply(client, msg, "n0", 3);
+    break;
+  case XS_SET_PERMS:
+    if (xsfake_find(abs) == NULL)
+      xsfake_reply_error(client, msg, ENOENT);
+    else
+      xsfake_reply(client, msg, "OK", 3);
+    break;
+  case XS_WATCH:
+    w = malloc(sizeof(xsfake_watch_t));
+    w->client = client;
+    w->path = strdup(data);
+    w->abs = xsfake_abs(data);
+    w->token = strdup(arg);
+    list_add_tail(&w->list, &xsfake.watches);
+    xsfake_reply(client, msg, "OK", 3);
+    /* Watches fire once when they're set */
+    xsfake_event(w, w->abs);
+    break;
+  case XS_UNWATCH:
+    xsfake_unwatch(client, data, arg);
+    xsfake_reply(client, msg, "OK", 3);
+    break;
+  case XS_RESET_WATCHES:
+    xsfake_unwatch(client, NULL, NULL);
+    xsfake_reply(client, msg, "OK", 3);
+    break;
+  case XS_TRANSACTION_START:
+    snprintf(buf, sizeof(buf), "%u", ++xsfake.next_tx);
+    xsfake_reply(client, msg, buf, strlen(buf) + 1);
+    break;
+  case XS_TRANSACTION_END:
+    xsfake_reply(client, msg, "OK", 3);
+    break;
+  case XS_GET_DOMAIN_PATH:
+    snprintf(buf, sizeof(buf), "/local/domain/%s", data);
+    xsfake_reply(client, msg, buf, strlen(buf) + 1);
+    break;
+  case XS_IS_DOMAIN_INTRODUCED:
+    xsfake_reply(client, msg, "T", 2);
+    break;
+  default:
+    xsfake_reply_error(client, msg, ENOSYS);
+    break;
+  }
+
+  free(abs);
+}
+
+static void
+xsfake_drop_client(int client)
+{
+  xsfake_unwatch(client, NULL, NULL);
+  close(xsfake.clients[client].fd);
+  xsfake.clients[client].fd = -1;
+}
+
+static void
+xsfake_client_input(int client)
+{
+  xsfake_client_t *c = &xsfake.clients[client];
+  struct xsd_sockmsg msg;
+  char data[XENSTORE_PAYLOAD_MAX + 1];
+  size_t size;
+  ssize_t n;
+
+  n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+  if (n <= 0) {
+    xsfake_drop_client(client);
+    return;
+  }
+  c->in_len += n;
+
+  while (c->in_len >= sizeof(msg)) {
+    memcpy(&msg, c->in, sizeof(msg));
+    if (msg.len > XENSTORE_PAYLOAD_MAX) {
+      xsfake_drop_client(client);
+      return;
+    }
+    size = sizeof(msg) + msg.len;
+    if (c->in_len < size)
+      break;
+    memcpy(data, c->in + sizeof(msg), msg.len);
+    data[msg.len] = '\0';
+    memmove(c->in, c->in + size, c->in_len - size);
+    c->in_len -= size;
+    xsfake_handle(client, &msg, data);
+  }
+}
+
+/* Apply the delayed writes that are due. Returns the poll() timeout
+ * until the next one, or -1 if there's none */
+static int
+xsfake_run_timers(void)
+{
+  xsfake_timer_t *t;
+  struct timespec now;
+  long long ns;
+
+  while (!list_empty(&xsfake.timers)) {
+    t = list_entry(xsfake.timers.next, xsfake_timer_t, list);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (t->when.tv_sec - now.tv_sec) * 1000000000LL +
+      (t->when.tv_nsec - now.tv_nsec);
+    if (ns > 0)
+      /* Round up, so that nothing is written early */
+      return (ns + 999999) / 1000000;
+    list_del(&t->list);
+    xsfake_set(t->abs, t->value, strlen(t->value));
+    xsfake_fire(t->abs);
+    if (xsfake.hook != NULL)
+      xsfake.hook(t->abs, t->value);
+    free(t->abs);
+    free(t->value);
+    free(t);
+  }
+
+  return -1;
+}
+
+static void*
+xsfake_thread(void *arg)
+{
+  struct pollfd pfds[XSFAKE_MAX_CLIENTS + 2];
+  int map[XSFAKE_MAX_CLIENTS + 2];
+  int n, i, fd;
+  int timeout;
+
+  for (;;) {
+    timeout = xsfake_run_timers();
+    pfds[0].fd = xsfake.wake[0];
+    pfds[0].events = POLLIN;
+    pfds[1].fd = xsfake.listen_fd;
+    pfds[1].events = POLLIN;
+    n = 2;
+    for (i = 0; i < XSFAKE_MAX_CLIENTS; ++i) {
+      if (xsfake.clients[i].fd == -1)
+        continue;
+      pfds[n].fd = xsfake.clients[i].fd;
+      pfds[n].events = POLLIN;
+      map[n++] = i;
+    }
+
+    if (poll(pfds, n, timeout) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (pfds[0].revents)
+      break;
+    if (pfds[1].revents & POLLIN) {
+      fd = accept(xsfake.listen_fd, NULL, NULL);
+      for (i = 0; fd != -1 && i < XSFAKE_MAX_CLIENTS; ++i) {
+        if (xsfake.clients[i].fd == -1) {
+          xsfake.clients[i].fd = fd;
+          xsfake.clients[i].in_len = 0;
+          break;
+        }
+      }
+      if (fd != -1 && i == XSFAKE_MAX_CLIENTS)
+        close(fd);
+    }
+    for (i = 2; i < n; ++i)
+      if (pfds[i].revents)
+        xsfake_client_input(map[i]);
+  }
+
+  return NULL;
+}
+
+/**
+ * Set the function called on every write, from the server thread.
+ * This must be called before xsfake_start().
+ */
+void
+xsfake_set_hook(xsfake_hook_t hook)
+{
+  xsfake.hook = hook;
+}
+
+/**
+ * Write a node after a delay, firing the watches and the hook like a
+ * client write would. This must only be called from the hook.
+ *
+ * @param abs The absolute path of the node
+ * @param value The string to write
+ * @param delay_ms The delay, in milliseconds
+ */
+void
+xsfake_write_later(const char *abs, const char *value, int delay_ms)
+{
+  xsfake_timer_t *t, *pos;
+
+  t = malloc(sizeof(xsfake_timer_t));
+  clock_gettime(CLOCK_MONOTONIC, &t->when);
+  t->when.tv_sec += delay_ms / 1000;
+  t->when.tv_nsec += (delay_ms % 1000) * 1000000L;
+  if (t->when.tv_nsec >= 1000000000L) {
+    t->when.tv_sec++;
+    t->when.tv_nsec -= 1000000000L;
+  }
+  t->abs = strdup(abs);
+  t->value = strdup(value);
+
+  /* Keep the list sorted, equal times stay in order */
+  list_for_each_entry(pos, &xsfake.timers, list) {
+    if (pos->when.tv_sec > t->when.tv_sec ||
+        (pos->when.tv_sec == t->when.tv_sec &&
+         pos->when.tv_nsec > t->when.tv_nsec))
+      break;
+  }
+  list_add_tail(&t->list, &pos->list);
+}
+
+/**
+ * @return The number of requests handled since xsfake_start()
+ */
+unsigned long
+xsfake_requests(void)
+{
+  /* Read from the benchmark thread while the fake xenstored runs */
+  return __sync_fetch_and_add(&xsfake.requests, 0);
+}
+
+/**
+ * Start the fake xenstored
+ *
+ * @param path The Unix socket to listen on
+ *
+ * @return 0 on success, -1 on failure
+ */
+int
+xsfake_start(const char *path)
+{
+  struct sockaddr_un addr;
+  int i;
+
+  INIT_LIST_HEAD(&xsfake.nodes);
+  INIT_LIST_HEAD(&xsfake.watches);
+  INIT_LIST_HEAD(&xsfake.timers);
+  xsfake.requests = 0;
+  for (i = 0; i < XSFAKE_MAX_CLIENTS; ++i)
+    xsfake.clients[i].fd = -1;
+  snprintf(xsfake.path, sizeof(xsfake.path), "%s", path);
+
+  /* What the daemon reads at startup */
+  xsfake_set(XSFAKE_DOM0_PATH "/domid", "0", 1);
+
+  xsfake.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (xsfake.listen_fd == -1)
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+  unlink(path);
+  if (bind(xsfake.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(xsfake.listen_fd, XSFAKE_MAX_CLIENTS) != 0 ||
+      pipe(xsfake.wake) != 0) {
+    xd_log(LOG_ERR, "xsfake: failed to listen on %s", path);
+    close(xsfake.listen_fd);
+    return -1;
+  }
+
+  if (pthread_create(&xsfake.thread, NULL, xsfake_thread, NULL) != 0) {
+    close(xsfake.listen_fd);
+    close(xsfake.wake[0]);
+    close(xsfake.wake[1]);
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Stop the fake xenstored and free the tree
+ */
+void
+xsfake_stop(void)
+{
+  xsfake_node_t *node, *tmp;
+  xsfake_timer_t *t, *ttmp;
+  int i;
+
+  if (write(xsfake.wake[1], "", 1) != 1)
+    return;
+  pthread_join(xsfake.thread, NULL);
+
+  for (i = 0; i < XSFAKE_MAX_CLIENTS; ++i)
+    if (xsfake.clients[i].fd != -1)
+      xsfake_drop_client(i);
+  list_for_each_entry_safe(node, tmp, &xsfake.nodes, list) {
+    list_del(&node->list);
+    free(node->path);
+    free(node->value);
+    free(node);
+  }
+  list_for_each_entry_safe(t, ttmp, &xsfake.timers, list) {
+    list_del(&t->list);
+    free(t->abs);
+    free(t->value);
+    free(t);
+  }
+  close(xsfake.listen_fd);
+  close(xsfake.wake[0]);
+  close(xsfake.wake[1]);
+  unlink(xsfake.path);
+}
@@ -0,0 +1,578 @@
+/*
+ * Copyright (c) 2026 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   xspipe.c
+ * @date   Sun Oct 18 19:27:05 2026
+ *
+ * @brief  Pipelined XenStore client
+ *
+ * libxenstore waits for the reply of every request before sending the
+ * next one. This speaks the XenStore wire protocol directly, so that
+ * many independent requests can be sent in a single write and their
+ * replies collected later, matched by request ID.
+ *
+ * Requests are queued by the xspipe_ functions and only sent by
+ * xspipe_flush(), xspipe_wait() or xspipe_process(). Replies complete
+ * the requests in the pending queue, calling their callback if any.
+ * Requests without a callback that fail are remembered, and reported
+ * by the next xspipe_wait().
+ *
+ * If xenstored doesn't answer in time, or the connection fails, all
+ * the pending requests are dropped without calling their callback and
+ * the connection is closed. The next flush opens a new one.
+ */
+
+#include "project.h"
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <xen/io/xs_wire.h>
+
+#define XSPIPE_SOCKET  "/var/run/xenstored/socket" /**< xenstored in dom0 */
+#define XSPIPE_XENBUS  "/dev/xen/xenbus"           /**< xenstored from a domU */
+#define XSPIPE_TIMEOUT 5000                        /**< xspipe_wait() timeout, in ms */
+
+typedef struct {
+  struct list_head list; /**< Linux-kernel-style list item, for the queue */
+  uint32_t req_id;
+  xspipe_cb_t cb;
+  void *opaque;
+} xspipe_req_t;
+
+struct xspipe {
+  int fd;                    /**< -1 after a failure, until reconnected */
+  char *path;                /**< The xenstored socket */
+  bool xenbus;               /**< fd is the xenbus device, one message per write */
+  uint32_t next_id;          /**< Request ID of the next request */
+  struct list_head pending;  /**< Requests waiting for a reply, oldest first */
+  int n_pending;
+  int error;                 /**< First error of a request without callback */
+  char *out;                 /**< Requests not sent yet */
+  size_t out_len;
+  size_t out_size;
+  char in[sizeof(struct xsd_sockmsg) + XENSTORE_PAYLOAD_MAX + 1];
+  size_t in_len;             /**< Bytes of in used by a partial reply */
+};
+
+static int
+xspipe_connect(const char *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* (Re)connect, to the socket if possible, to the xenbus device otherwise */
+static int
+xspipe_reconnect(xspipe_t *xp)
+{
+  int fd;
+
+  xp->xenbus = false;
+  fd = xspipe_connect(xp->path);
+  if (fd == -1) {
+    fd = open(XSPIPE_XENBUS, O_RDWR);
+    xp->xenbus = true;
+  }
+  if (fd == -1) {
+    xd_log(LOG_ERR, "Failed to connect to xenstored for pipelining");
+    return -1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  xp->fd = fd;
+
+  return 0;
+}
+
+/* Drop everything in flight and close the connection */
+static void
+xspipe_reset(xspipe_t *xp)
+{
+  xspipe_req_t *req, *tmp;
+
+  list_for_each_entry_safe(req, tmp, &xp->pending, list) {
+    list_del(&req->list);
+    free(req);
+  }
+  xp->n_pending = 0;
+  xp->error = 0;
+  xp->out_len = 0;
+  xp->in_len = 0;
+  if (xp->fd != -1)
+    close(xp->fd);
+  xp->fd = -1;
+}
+
+/**
+ * Open a pipelined connection to xenstored
+ *
+ * @param path The xenstored socket, or NULL for the default one,
+ *        which can be overriden by $XENSTORED_PATH like for libxenstore
+ *
+ * @return The connection, or NULL on failure
+ */
+xspipe_t*
+xspipe_open(const char *path)
+{
+  xspipe_t *xp;
+
+  if (path == NULL)
+    path = getenv("XENSTORED_PATH");
+  if (path == NULL)
+    path = XSPIPE_SOCKET;
+
+  xp = malloc(sizeof(xspipe_t));
+  memset(xp, 0, sizeof(xspipe_t));
+  xp->path = strdup(path);
+  xp->next_id = 1;
+  INIT_LIST_HEAD(&xp->pending);
+  if (xspipe_reconnect(xp) != 0) {
+    free(xp->path);
+    free(xp);
+    return NULL;
+  }
+
+  return xp;
+}
+
+/**
+ * Close a connection. Pending requests are dropped without calling
+ * their callback.
+ */
+void
+xspipe_close(xspipe_t *xp)
+{
+  if (xp == NULL)
+    return;
+
+  xspipe_reset(xp);
+  free(xp->out);
+  free(xp->path);
+  free(xp);
+}
+
+/**
+ * @return The file descriptor to watch for replies, -1 while
+ *         disconnected
+ */
+int
+xspipe_fileno(xspipe_t *xp)
+{
+  return xp->fd;
+}
+
+/**
+ * @return The number of requests that didn't complete yet
+ */
+int
+xspipe_pending(xspipe_t *xp)
+{
+  return xp->n_pending;
+}
+
+/**
+ * Queue a raw request. The payload is the concatenation of the
+ * n_parts parts.
+ *
+ * @return 0 on success, -1 if the request is too big
+ */
+static int
+xspipe_request(xspipe_t *xp, enum xsd_sockmsg_type type, xs_transaction_t tx,
+               const void **parts, const unsigned int *lens, int n_parts,
+               xspipe_cb_t cb, void *opaque)
+{
+  struct xsd_sockmsg msg;
+  xspipe_req_t *req;
+  unsigned int len = 0;
+  int i;
+
+  for (i = 0; i < n_parts; ++i)
+    len += lens[i];
+  if (len > XENSTORE_PAYLOAD_MAX) {
+    errno = E2BIG;
+    return -1;
+  }
+
+  msg.type = type;
+  msg.req_id = xp->next_id++;
+  msg.tx_id = tx;
+  msg.len = len;
+
+  if (xp->out_len + sizeof(msg) + len > xp->out_size) {
+    while (xp->out_len + sizeof(msg) + len > xp->out_size)
+      xp->out_size = xp->out_size ? xp->out_size * 2 : 4096;
+    xp->out = realloc(xp->out, xp->out_size);
+  }
+  memcpy(xp->out + xp->out_len, &msg, sizeof(msg));
+  xp->out_len += sizeof(msg);
+  for (i = 0; i < n_parts; ++i) {
+    memcpy(xp->out + xp->out_len, parts[i], lens[i]);
+    xp->out_len += lens[i];
+  }
+
+  req = malloc(sizeof(xspipe_req_t));
+  req->req_id = msg.req_id;
+  req->cb = cb;
+  req->opaque = opaque;
+  list_add_tail(&req->list, &xp->pending);
+  xp->n_pending++;
+
+  return 0;
+}
+
+/* Queue a request which payload is a path, optionally followed by data */
+static int
+xspipe_path_request(xspipe_t *xp, enum xsd_sockmsg_type type,
+                    xs_transaction_t tx, const char *path,
+                    const void *data, unsigned int len,
+                    xspipe_cb_t cb, void *opaque)
+{
+  const void *parts[2] = { path, data };
+  unsigned int lens[2] = { strlen(path) + 1, len };
+
+  return xspipe_request(xp, type, tx, parts, lens, data ? 2 : 1, cb, opaque);
+}
+
+/**
+ * Queue a read. The callback gets the value and its length, the value
+ * is NUL-terminated for convenience.
+ */
+int
+xspipe_read(xspipe_t *xp, xs_transaction_t tx, const char *path,
+            xspipe_cb_t cb, void *opaque)
+{
+  return xspipe_path_request(xp, XS_READ, tx, path, NULL, 0, cb, opaque);
+}
+
+/**
+ * Queue a write of a string value
+ */
+int
+xspipe_write(xspipe_t *xp, xs_transaction_t tx, const char *path,
+             const char *value, xspipe_cb_t cb, void *opaque)
+{
+  return xspipe_path_request(xp, XS_WRITE, tx, path, value, strlen(value),
+                             cb, opaque);
+}
+
+/**
+ * Queue the creation of a directory
+ */
+int
+xspipe_mkdir(xspipe_t *xp, xs_transaction_t tx, const char *path,
+             xspipe_cb_t cb, void *opaque)
+{
+  return xspipe_path_request(xp, XS_MKDIR, tx, path, NULL, 0, cb, opaque);
+}
+
+/**
+ * Queue the removal of a node and its children
+ */
+int
+xspipe_rm(xspipe_t *xp, xs_transaction_t tx, const char *path,
+          xspipe_cb_t cb, void *opaque)
+{
+  return xspipe_path_request(xp, XS_RM, tx, path, NULL, 0, cb, opaque);
+}
+
+/**
+ * Queue a permission change, like xs_set_permissions()
+ */
+int
+xspipe_set_permissions(xspipe_t *xp, xs_transaction_t tx, const char *path,
+                       struct xs_permissions *perms, unsigned int num_perms,
+                       xspipe_cb_t cb, void *opaque)
+{
+  char buf[256];
+  unsigned int len = 0;
+  unsigned int i;
+  char c;
+
+  for (i = 0; i < num_perms && len < sizeof(buf) - 16; ++i) {
+    switch (perms[i].perms & (XS_PERM_READ | XS_PERM_WRITE)) {
+    case XS_PERM_READ | XS_PERM_WRITE: c = 'b'; break;
+    case XS_PERM_READ: c = 'r'; break;
+    case XS_PERM_WRITE: c = 'w'; break;
+    default: c = 'n'; break;
+    }
+    len += snprintf(buf + len, sizeof(buf) - len, "%c%u", c, perms[i].id) + 1;
+  }
+
+  return xspipe_path_request(xp, XS_SET_PERMS, tx, path, buf, len,
+                             cb, opaque);
+}
+
+/**
+ * Send all the queued requests, reconnecting first if needed. The
+ * xenbus device takes exactly one message per write(), the socket
+ * takes them all at once.
+ *
+ * @return 0 on success, -1 if the connection failed, in which case
+ *         all the pending requests are dropped
+ */
+int
+xspipe_flush(xspipe_t *xp)
+{
+  struct xsd_sockmsg msg;
+  struct pollfd pfd;
+  size_t done = 0;
+  size_t size;
+  ssize_t n;
+
+  if (xp->out_len == 0)
+    return 0;
+  if (xp->fd == -1 && xspipe_reconnect(xp) != 0) {
+    xspipe_reset(xp);
+    errno = ENOTCONN;
+    return -1;
+  }
+
+  while (done < xp->out_len) {
+    size = xp->out_len - done;
+    if (xp->xenbus) {
+      memcpy(&msg, xp->out + done, sizeof(msg));
+      size = sizeof(msg) + msg.len;
+    }
+    n = write(xp->fd, xp->out + done, size);
+    if (n > 0 && (!xp->xenbus || (size_t)n == size)) {
+      done += n;
+      continue;
+    }
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && errno == EAGAIN) {
+      pfd.fd = xp->fd;
+      pfd.events = POLLOUT;
+      poll(&pfd, 1, -1);
+      continue;
+    }
+    if (n >= 0)
+      errno = EIO;
+    xd_log(LOG_ERR, "Failed to send XenStore requests: %s", strerror(errno));
+    xspipe_reset(xp);
+    return -1;
+  }
+  xp->out_len = 0;
+
+  return 0;
+}
+
+static int
+xspipe_errno(const char *s)
+{
+  unsigned int i;
+
+  for (i = 0; i < sizeof(xsd_errors) / sizeof(xsd_errors[0]); ++i)
+    if (strcmp(s, xsd_errors[i].errstring) == 0)
+      return xsd_errors[i].errnum;
+
+  return EIO;
+}
+
+static void
+xspipe_complete(xspipe_t *xp, struct xsd_sockmsg *msg, char *data)
+{
+  xspipe_req_t *req;
+  char next;
+  int err = 0;
+
+  if (msg->type == XS_WATCH_EVENT)
+    /* Watches go through libxenstore, not here */
+    return;
+
+  list_for_each_entry(req, &xp->pending, list) {
+    if (req->req_id == msg->req_id)
+      break;
+  }
+  if (&req->list == &xp->pending) {
+    xd_log(LOG_WARNING, "Unexpected XenStore reply %u", msg->req_id);
+    return;
+  }
+  list_del(&req->list);
+  xp->n_pending--;
+
+  /* NUL-terminate the payload for the callback, the byte after it may
+   * belong to the next reply */
+  next = data[msg->len];
+  data[msg->len] = '\0';
+  if (msg->type == XS_ERROR)
+    err = xspipe_errno(data);
+  if (req->cb != NULL)
+    req->cb(err, data, msg->len, req->opaque);
+  else if (err != 0 && xp->error == 0)
+    xp->error = err;
+  data[msg->len] = next;
+  free(req);
+}
+
+/**
+ * Read the available replies and complete the corresponding requests.
+ * Call this when the file descriptor is readable. Callbacks may queue
+ * new requests, but must not wait for them.
+ *
+ * @return 0 on success, -1 if the connection failed
+ */
+int
+xspipe_process(xspipe_t *xp)
+{
+  struct xsd_sockmsg msg;
+  size_t size;
+  ssize_t n;
+
+  if (xspipe_flush(xp) != 0)
+    return -1;
+  if (xp->fd == -1)
+    return 0;
+
+  for (;;) {
+    n = read(xp->fd, xp->in + xp->in_len, sizeof(xp->in) - 1 - xp->in_len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && errno == EAGAIN)
+      return 0;
+    if (n <= 0) {
+      xd_log(LOG_ERR, "XenStore connection lost");
+      xspipe_reset(xp);
+      errno = ECONNRESET;
+      return -1;
+    }
+    xp->in_len += n;
+
+    /* Complete every full reply in the buffer */
+    while (xp->in_len >= sizeof(msg)) {
+      memcpy(&msg, xp->in, sizeof(msg));
+      if (msg.len > XENSTORE_PAYLOAD_MAX) {
+        xd_log(LOG_ERR, "Invalid XenStore reply");
+        xspipe_reset(xp);
+        errno = EIO;
+        return -1;
+      }
+      size = sizeof(msg) + msg.len;
+      if (xp->in_len < size)
+        break;
+      xspipe_complete(xp, &msg, xp->in + sizeof(msg));
+      memmove(xp->in, xp->in + size, xp->in_len - size);
+      xp->in_len -= size;
+    }
+  }
+}
+
+/**
+ * Send the queued requests and wait for all of them to complete. On
+ * timeout the connection is reset, so that no callback can run after
+ * this returns.
+ *
+ * @return 0 if all the requests without callback succeeded, -1
+ *         otherwise, with errno set to the first error
+ */
+int
+xspipe_wait(xspipe_t *xp)
+{
+  struct pollfd pfd;
+  int err;
+
+  if (xspipe_flush(xp) != 0)
+    return -1;
+
+  pfd.fd = xp->fd;
+  pfd.events = POLLIN;
+  while (xp->n_pending > 0) {
+    if (poll(&pfd, 1, XSPIPE_TIMEOUT) <= 0) {
+      xd_log(LOG_ERR, "Timed out waiting for XenStore, dropping %d request(s)",
+             xp->n_pending);
+      xspipe_reset(xp);
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    if (xspipe_process(xp) != 0)
+      return -1;
+  }
+
+  err = xp->error;
+  xp->error = 0;
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
+
+static void
+xspipe_transaction_started(int err, const char *data, unsigned int len,
+                           void *opaque)
+{
+  xs_transaction_t *tx = opaque;
+
+  *tx = (err == 0) ? strtoul(data, NULL, 10) : XBT_NULL;
+}
+
+/**
+ * Start a transaction. This waits for the reply, along with anything
+ * queued before.
+ *
+ * @return The transaction ID, or XBT_NULL on failure
+ */
+xs_transaction_t
+xspipe_transaction_start(xspipe_t *xp)
+{
+  const void *parts[1] = { "" };
+  unsigned int lens[1] = { 1 };
+  xs_transaction_t tx = XBT_NULL;
+
+  if (xspipe_request(xp, XS_TRANSACTION_START, XBT_NULL, parts, lens, 1,
+                     xspipe_transaction_started, &tx) != 0 ||
+      xspipe_wait(xp) != 0)
+    return XBT_NULL;
+
+  return tx;
+}
+
+/**
+ * End a transaction, waiting for the result
+ *
+ * @return true on success, false otherwise, with errno set to EAGAIN
+ *         if the transaction should be retried
+ */
+bool
+xspipe_transaction_end(xspipe_t *xp, xs_transaction_t tx, bool abort)
+{
+  const void *parts[1] = { abort ? "F" : "T" };
+  unsigned int lens[1] = { 2 };
+
+  if (xspipe_request(xp, XS_TRANSACTION_END, tx, parts, lens, 1,
+                     NULL, NULL) != 0)
+    return false;
+
+  return (xspipe_wait(xp) == 0);
+}